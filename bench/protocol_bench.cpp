@@ -0,0 +1,561 @@
+/**
+ * @file protocol_bench.cpp
+ * @brief Benchmark cho Protocol layer
+ *
+ * Measures time, throughput and heap allocations per operation for the
+ * serialize / deserialize paths, MessageBuffer reassembly, message type
+ * lookups and getCurrentTimestamp over realistic workloads: short chat lines, a large
+ * ONLINE_LIST and TCP streams delivered in MSS-sized or tiny fragments.
+ *
+ * Usage: protocol_bench [filter]   (only runs benchmarks whose name
+ * contains filter)
+ */
+
+#include "common/Protocol.h"
+#include "json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// ==================== Allocation Counter ====================
+
+static size_t g_allocations = 0;
+
+// Every replaced form of operator new / delete goes through these two, so
+// scalar and array allocations are counted alike and always paired
+static void* countedAllocate(size_t size) {
+    ++g_allocations;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+static void countedRelease(void* p) noexcept {
+    std::free(p);
+}
+
+void* operator new(size_t size) {
+    return countedAllocate(size);
+}
+
+void* operator new[](size_t size) {
+    return countedAllocate(size);
+}
+
+void operator delete(void* p) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void* p) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    countedRelease(p);
+}
+
+// ==================== Harness ====================
+
+using namespace Protocol;
+
+// Each benchmark runs for roughly this long after warm-up
+static const double TARGET_NS = 200e6;
+
+static const char* g_filter = nullptr;
+static size_t g_sink = 0;
+
+/**
+ * @brief Time fn and print ns/op, MB/s and allocs/op
+ * @param name Benchmark name
+ * @param opsPerCall Operations performed by one call of fn
+ * @param bytesPerCall Wire bytes handled by one call of fn (0: no MB/s)
+ * @param fn Benchmark body
+ */
+template <typename Fn>
+static void run(const char* name, size_t opsPerCall, size_t bytesPerCall, Fn&& fn) {
+    if (g_filter != nullptr && std::strstr(name, g_filter) == nullptr) {
+        return;
+    }
+
+    // Warm up so reusable buffers reach their steady-state capacity, and
+    // size the measured run from the warm-up speed
+    const int warmup = 16;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < warmup; ++i) {
+        fn();
+    }
+    double warmupNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    size_t calls = static_cast<size_t>(std::clamp(TARGET_NS * warmup / std::max(warmupNs, 1.0), 16.0, 5e7));
+
+    size_t allocsBefore = g_allocations;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) {
+        fn();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    size_t allocs = g_allocations - allocsBefore;
+
+    double ops = static_cast<double>(calls) * opsPerCall;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    if (bytesPerCall > 0) {
+        double mbps = (static_cast<double>(calls) * bytesPerCall / (1024.0 * 1024.0)) / (ns / 1e9);
+        std::printf("%-44s %10.1f ns/op %9.1f MB/s %8.2f allocs/op\n",
+                    name, ns / ops, mbps, static_cast<double>(allocs) / ops);
+    } else {
+        std::printf("%-44s %10.1f ns/op %14s %8.2f allocs/op\n",
+                    name, ns / ops, "", static_cast<double>(allocs) / ops);
+    }
+}
+
+// ==================== Workloads ====================
+
+static Message tinyMessage() {
+    return createGlobalMessage("alice", "hello everyone, how is it going?");
+}
+
+static Message escapedMessage() {
+    return createPrivateMessage("bình", "alice", "\"Xin chào\" các bạn!\nTiếng Việt có dấu \\ tab\t end");
+}
+
+// Roughly 4 KB of running text, ASCII or Vietnamese (mostly 2-3 byte sequences)
+static Message longTextMessage(bool vietnamese) {
+    const char* line = vietnamese ? "Hôm nay trời đẹp, chúng ta cùng đi học mạng máy tính nhé! "
+                                  : "Nice weather today, shall we go study computer networks? ";
+    std::string text;
+    while (text.size() < 4096) {
+        text += line;
+    }
+    return createGlobalMessage("alice", text);
+}
+
+static Message onlineListMessage(size_t users) {
+    std::vector<std::string> names;
+    names.reserve(users);
+    for (size_t i = 0; i < users; ++i) {
+        names.push_back("user_" + std::to_string(i));
+    }
+    return createOnlineListMessage(names);
+}
+
+// Concatenated frames of a realistic chat mix: mostly short lines, some
+// escaped text and an occasional online list
+static std::vector<uint8_t> chatStream(const WireOptions& options, size_t& messages) {
+    Message tiny = tinyMessage();
+    Message escaped = escapedMessage();
+    Message list = onlineListMessage(200);
+
+    std::vector<uint8_t> stream;
+    messages = 0;
+    for (int i = 0; i < 1000; ++i) {
+        const Message& msg = (i % 100 == 99) ? list : (i % 5 == 4) ? escaped : tiny;
+        serializeInto(msg, stream, options);
+        ++messages;
+    }
+    return stream;
+}
+
+// Split a stream into the segment sizes a receiver sees from recv()
+static std::vector<size_t> fragmentSizes(size_t total, size_t minSize, size_t maxSize) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> dist(minSize, maxSize);
+    std::vector<size_t> sizes;
+    for (size_t done = 0; done < total;) {
+        size_t size = std::min(dist(rng), total - done);
+        sizes.push_back(size);
+        done += size;
+    }
+    return sizes;
+}
+
+// Payload of a single serialized frame
+static std::vector<uint8_t> payloadOf(const Message& msg, WireFormat format) {
+    std::vector<uint8_t> frame = serialize(msg, format);
+    return std::vector<uint8_t>(frame.begin() + 4, frame.end());
+}
+
+// ==================== Benchmarks ====================
+
+static void benchSerialize() {
+    Message tiny = tinyMessage();
+    Message escaped = escapedMessage();
+    Message list = onlineListMessage(2000);
+    std::vector<uint8_t> out;
+
+    WireOptions compressed = WireOptions::supported();
+    compressed.format = WireFormat::JSON;
+    compressed.checksums = false;
+
+    size_t tinyJson = serialize(tiny, WireFormat::JSON).size();
+    size_t tinyBinary = serialize(tiny, WireFormat::BINARY).size();
+    size_t escapedJson = serialize(escaped, WireFormat::JSON).size();
+    size_t listJson = serialize(list, WireFormat::JSON).size();
+    size_t listBinary = serialize(list, WireFormat::BINARY).size();
+
+    std::printf("-- serialize --\n");
+    run("serialize/tiny/json DOM (legacy encoder)", 1, tinyJson, [&] {
+        nlohmann::json j;
+        j["type"] = static_cast<int>(tiny.type);
+        j["sender"] = tiny.sender;
+        j["receiver"] = tiny.receiver;
+        j["content"] = tiny.content;
+        j["timestamp"] = tiny.timestamp;
+        j["extra"] = tiny.extra;
+        g_sink += j.dump().size();
+    });
+    run("serialize/tiny/JSON", 1, tinyJson, [&] {
+        g_sink += serialize(tiny, WireFormat::JSON).size();
+    });
+    run("serializeInto/tiny/JSON", 1, tinyJson, [&] {
+        out.clear();
+        g_sink += serializeInto(tiny, out, WireFormat::JSON);
+    });
+    run("serializeInto/tiny/BINARY", 1, tinyBinary, [&] {
+        out.clear();
+        g_sink += serializeInto(tiny, out, WireFormat::BINARY);
+    });
+    run("serializeInto/escaped/JSON", 1, escapedJson, [&] {
+        out.clear();
+        g_sink += serializeInto(escaped, out, WireFormat::JSON);
+    });
+    run("serializeInto/online_list_2000/JSON", 1, listJson, [&] {
+        out.clear();
+        g_sink += serializeInto(list, out, WireFormat::JSON);
+    });
+    run("serializeInto/online_list_2000/BINARY", 1, listBinary, [&] {
+        out.clear();
+        g_sink += serializeInto(list, out, WireFormat::BINARY);
+    });
+    if (compressed.compression) {
+        run("serializeInto/online_list_2000/JSON+zlib", 1, listJson, [&] {
+            out.clear();
+            g_sink += serializeInto(list, out, compressed);
+        });
+    }
+
+    std::vector<Message> batch(16, tiny);
+    run("serializeBatchInto/16x tiny/BINARY", batch.size(), 0, [&] {
+        out.clear();
+        g_sink += serializeBatchInto(batch, out, WireFormat::BINARY);
+    });
+}
+
+static void benchDeserialize() {
+    struct Case {
+        const char* name;
+        Message msg;
+        WireFormat format;
+    };
+    const Case cases[] = {
+        {"deserialize/tiny/JSON", tinyMessage(), WireFormat::JSON},
+        {"deserialize/tiny/BINARY", tinyMessage(), WireFormat::BINARY},
+        {"deserialize/escaped/JSON", escapedMessage(), WireFormat::JSON},
+        {"deserialize/text_4k_ascii/JSON", longTextMessage(false), WireFormat::JSON},
+        {"deserialize/text_4k_ascii/BINARY", longTextMessage(false), WireFormat::BINARY},
+        {"deserialize/text_4k_vietnamese/JSON", longTextMessage(true), WireFormat::JSON},
+        {"deserialize/text_4k_vietnamese/BINARY", longTextMessage(true), WireFormat::BINARY},
+        {"deserialize/online_list_2000/JSON", onlineListMessage(2000), WireFormat::JSON},
+        {"deserialize/online_list_2000/BINARY", onlineListMessage(2000), WireFormat::BINARY},
+    };
+
+    std::printf("\n-- deserialize --\n");
+    MessageArena arena;
+    for (const Case& c : cases) {
+        std::vector<uint8_t> payload = payloadOf(c.msg, c.format);
+        run(c.name, 1, payload.size(), [&] {
+            g_sink += deserialize(payload.data(), payload.size(), c.format).content.size();
+        });
+
+        std::string arenaName = std::string(c.name) + " (arena)";
+        run(arenaName.c_str(), 1, payload.size(), [&] {
+            g_sink += deserialize(payload.data(), payload.size(), c.format, arena).content.size();
+            arena.reset();
+        });
+    }
+}
+
+static void benchMessageBuffer() {
+    std::printf("\n-- MessageBuffer append + extract (chat mix, per message) --\n");
+
+    WireOptions json;
+    WireOptions binary;
+    binary.format = WireFormat::BINARY;
+    WireOptions zlib = WireOptions::supported();
+    zlib.checksums = false;
+
+    enum class Extract { MESSAGE, VIEW, ARENA };
+    struct Stream {
+        const char* name;
+        WireOptions options;
+        size_t minFragment;
+        size_t maxFragment;
+        Extract extract;
+    };
+    std::vector<Stream> streams = {
+        {"buffer/JSON/mss/extractMessage", json, 1460, 1460, Extract::MESSAGE},
+        {"buffer/JSON/mss/extractMessage(arena)", json, 1460, 1460, Extract::ARENA},
+        {"buffer/JSON/mss/extractView", json, 1460, 1460, Extract::VIEW},
+        {"buffer/JSON/fragmented 1-64/extractMessage", json, 1, 64, Extract::MESSAGE},
+        {"buffer/BINARY/mss/extractMessage", binary, 1460, 1460, Extract::MESSAGE},
+        {"buffer/BINARY/mss/extractMessage(arena)", binary, 1460, 1460, Extract::ARENA},
+        {"buffer/BINARY/mss/extractView", binary, 1460, 1460, Extract::VIEW},
+        {"buffer/BINARY/fragmented 1-64/extractView", binary, 1, 64, Extract::VIEW},
+    };
+    if (zlib.compression) {
+        streams.push_back({"buffer/BINARY+zlib/mss/extractView", zlib, 1460, 1460, Extract::VIEW});
+    }
+
+    for (const Stream& s : streams) {
+        size_t messages;
+        std::vector<uint8_t> stream = chatStream(s.options, messages);
+        std::vector<size_t> fragments = fragmentSizes(stream.size(), s.minFragment, s.maxFragment);
+
+        MessageBuffer buffer;
+        buffer.configure(s.options);
+        MessageArena arena;
+        run(s.name, messages, stream.size(), [&] {
+            const uint8_t* p = stream.data();
+            for (size_t size : fragments) {
+                buffer.append(p, size);
+                p += size;
+                if (s.extract == Extract::VIEW) {
+                    MessageView view;
+                    while (buffer.extractView(view)) {
+                        g_sink += view.content.size();
+                    }
+                } else if (s.extract == Extract::ARENA) {
+                    // One arena round per recv(), as a server handles it
+                    while (ArenaMessage* msg = buffer.extractMessage(arena)) {
+                        g_sink += msg->content.size();
+                    }
+                    arena.reset();
+                } else {
+                    while (buffer.hasCompleteMessage()) {
+                        g_sink += buffer.extractMessage().content.size();
+                    }
+                }
+            }
+        });
+    }
+}
+
+static void benchChecksums() {
+    std::printf("\n-- frame checksums (CRC-32C) --\n");
+    std::vector<uint8_t> data(65536);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+    for (size_t size : {64, 1024, 65536}) {
+        std::string name = "crc32c/" + std::to_string(size) + "B";
+        run(name.c_str(), 1, size, [&] {
+            g_sink += crc32c(data.data(), size);
+        });
+    }
+
+    // Same chat mix as above, with and without the trailer on every frame
+    for (WireFormat format : {WireFormat::JSON, WireFormat::BINARY}) {
+        WireOptions options;
+        options.format = format;
+        const std::string suffix = format == WireFormat::BINARY ? "BINARY" : "JSON";
+        for (bool checksums : {false, true}) {
+            options.checksums = checksums;
+            size_t messages;
+            std::vector<uint8_t> stream = chatStream(options, messages);
+            std::vector<size_t> fragments = fragmentSizes(stream.size(), 1460, 1460);
+
+            MessageBuffer buffer;
+            buffer.configure(options);
+            std::string name = "buffer/" + suffix + (checksums ? "+crc32c" : "") + "/mss/extractView";
+            run(name.c_str(), messages, stream.size(), [&] {
+                const uint8_t* p = stream.data();
+                for (size_t size : fragments) {
+                    buffer.append(p, size);
+                    p += size;
+                    MessageView view;
+                    while (buffer.extractView(view)) {
+                        g_sink += view.content.size();
+                    }
+                }
+            });
+        }
+    }
+}
+
+static void benchTypedPayloads() {
+    std::printf("\n-- typed payloads (encode + decode + read fields) --\n");
+    WireOptions legacy;
+    legacy.format = WireFormat::BINARY;
+    WireOptions typed = legacy;
+    typed.typedPayloads = true;
+
+    Message login = createLoginMessage("alice", "correct horse battery staple");
+    Message list = onlineListMessage(2000);
+    std::vector<uint8_t> out;
+    std::string username, password;
+    std::vector<std::string> users;
+
+    struct Case {
+        const char* name;
+        const Message* msg;
+        const WireOptions* options;
+    };
+    const Case cases[] = {
+        {"login/BINARY legacy (JSON in content)", &login, &legacy},
+        {"login/BINARY typed", &login, &typed},
+        {"online_list_2000/BINARY legacy (JSON in extra)", &list, &legacy},
+        {"online_list_2000/BINARY typed", &list, &typed},
+    };
+    for (const Case& c : cases) {
+        out.clear();
+        size_t bytes = serializeInto(*c.msg, out, *c.options);
+        run(c.name, 1, bytes, [&] {
+            out.clear();
+            serializeInto(*c.msg, out, *c.options);
+            Message msg = deserialize(out.data() + 4, out.size() - 4, WireFormat::BINARY);
+            if (msg.type == MessageType::LOGIN) {
+                g_sink += parseCredentials(msg, username, password) ? password.size() : 0;
+            } else {
+                g_sink += parseOnlineList(msg, users) ? users.size() : 0;
+            }
+        });
+    }
+}
+
+static void benchRelay() {
+    std::printf("\n-- relaying a private message (receive frame -> frame for the receiver) --\n");
+    Message msg = createPrivateMessage("alice", "bob", std::string(200, 'x'));
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> out;
+
+    for (WireFormat format : {WireFormat::JSON, WireFormat::BINARY}) {
+        WireOptions options = WireOptions::supported();
+        options.format = format;
+        options.compression = false;
+        options.checksums = false;
+        MessageBuffer buffer;
+        buffer.configure(options);
+        const std::string suffix = format == WireFormat::BINARY ? "/BINARY" : "/JSON";
+
+        frame.clear();
+        serializeInto(msg, frame, options);
+        run(("decode + re-serialize" + suffix).c_str(), 1, frame.size(), [&] {
+            buffer.append(frame.data(), frame.size());
+            MessageView view;
+            buffer.extractView(view);
+            out.clear();
+            serializeInto(view, out, options);
+            g_sink += out.size();
+        });
+        run(("peekRoute + takeFrame" + suffix).c_str(), 1, frame.size(), [&] {
+            buffer.append(frame.data(), frame.size());
+            RouteHeader route;
+            out.clear();
+            if (buffer.peekRoute(route) && canForwardVerbatim(route, options, options)) {
+                buffer.takeFrame(out);
+            }
+            g_sink += out.size();
+        });
+    }
+}
+
+static void benchNameDictionary() {
+    const size_t receivers = 1000;
+    std::printf("\n-- fan-out of one global message to %zu receivers --\n", receivers);
+    Message msg = createGlobalMessage("nguyen_van_an_2024", "ok, see you at 8");
+    WireOptions plain = WireOptions::supported();
+    plain.compression = false;
+    plain.nameDictionary = false;
+    plain.checksums = false;
+    WireOptions named = plain;
+    named.nameDictionary = true;
+    std::vector<uint8_t> out;
+
+    // Steady state: every receiver has already been sent this name once
+    std::vector<NameDictionary> dictionaries(receivers);
+    for (NameDictionary& names : dictionaries) {
+        serializeInto(msg, out, named, names);
+    }
+    out.clear();
+    size_t plainBytes = serializeInto(msg, out, plain);
+    out.clear();
+    size_t namedBytes = serializeInto(msg, out, named, dictionaries.front());
+    std::printf("frame size: %zu bytes plain, %zu bytes with name dictionary\n", plainBytes, namedBytes);
+
+    run("fan-out/BINARY plain", receivers, plainBytes * receivers, [&] {
+        for (size_t i = 0; i < receivers; ++i) {
+            out.clear();
+            g_sink += serializeInto(msg, out, plain);
+        }
+    });
+    run("fan-out/BINARY name dictionary", receivers, namedBytes * receivers, [&] {
+        for (NameDictionary& names : dictionaries) {
+            out.clear();
+            g_sink += serializeInto(msg, out, named, names);
+        }
+    });
+}
+
+static void benchSchema() {
+    std::printf("\n-- message schema --\n");
+    const MessageType types[] = {MessageType::MSG_GLOBAL, MessageType::KICK_USER,
+                                 MessageType::PING, MessageType::HELLO_ACK};
+    size_t i = 0;
+    run("messageTypeToString", 1, 0, [&] {
+        g_sink += messageTypeToString(types[i++ & 3]).size();
+    });
+    run("messageTypeName", 1, 0, [&] {
+        g_sink += messageTypeName(types[i++ & 3]).size();
+    });
+
+    MessageTypeTable<size_t> counts;
+    run("MessageTypeTable dispatch (valid + count)", 1, 0, [&] {
+        MessageType type = types[i++ & 3];
+        if (size_t* slot = counts.find(type)) {
+            g_sink += ++*slot;
+        }
+    });
+}
+
+static void benchTimestamp() {
+    std::printf("\n-- clock --\n");
+    run("getCurrentTimestamp", 1, 0, [&] {
+        g_sink += getCurrentTimestamp().size();
+    });
+    run("getEpochMillis", 1, 0, [&] {
+        g_sink += static_cast<size_t>(getEpochMillis());
+    });
+    run("createGlobalMessage (incl. timestamp)", 1, 0, [&] {
+        g_sink += createGlobalMessage("alice", "hi").timestamp.size();
+    });
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        g_filter = argv[1];
+    }
+
+    std::printf("Protocol benchmark (~%.0f ms per benchmark)\n\n", TARGET_NS / 1e6);
+
+    benchSerialize();
+    benchDeserialize();
+    benchMessageBuffer();
+    benchChecksums();
+    benchTypedPayloads();
+    benchRelay();
+    benchNameDictionary();
+    benchSchema();
+    benchTimestamp();
+
+    std::printf("\n(checksum %zu)\n", g_sink);
+    return 0;
+}
@@ -6,133 +6,1859 @@
 #include "Protocol.h"
 #include "../thirdparty/json.hpp"
 #include <cstring>
-#include <iomanip>
-#include <sstream>
+#include <algorithm>
 #include <chrono>
+#include <charconv>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PROTOCOL_HAVE_SSE2 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// SSSE3 code is compiled per function and picked at runtime, so the
+// library still runs on plain SSE2 machines
+#if defined(PROTOCOL_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#include <tmmintrin.h>
+#define PROTOCOL_HAVE_SSSE3 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PROTOCOL_TARGET_SSSE3
+#else
+#define PROTOCOL_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+// Same for the SSE4.2 crc32 instruction behind frame checksums
+#if defined(PROTOCOL_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#include <nmmintrin.h>
+#define PROTOCOL_HAVE_SSE42 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PROTOCOL_TARGET_SSE42
+#else
+#define PROTOCOL_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#ifdef PROTOCOL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef PROTOCOL_DEBUG_LOG
+#include <iostream>
+#endif
 
 using json = nlohmann::json;
 
 namespace Protocol {
 
-std::vector<uint8_t> serialize(const Message& msg) {
-    // Create JSON object
-    json j;
-    j["type"] = static_cast<int>(msg.type);
-    j["sender"] = msg.sender;
-    j["receiver"] = msg.receiver;
-    j["content"] = msg.content;
-    j["timestamp"] = msg.timestamp.empty() ? getCurrentTimestamp() : msg.timestamp;
-    j["extra"] = msg.extra;
+namespace {
+
+// Binary codec: [type][flags][sender][receiver][content][timestamp][extra][trace]
+const uint8_t BINARY_FLAGS_NONE = 0;
+const uint8_t BINARY_FLAG_TRACE = 0x01;  // Trailing varints: clientSend, serverRecv, serverSend
+const uint8_t BINARY_FLAG_FIELDS = 0x02; // Typed payload after extra: [varint size][packed fields]
+const uint8_t BINARY_FLAG_NAME = 0x04;   // Sender is varint((id << 1) | define) [+ name if define]
+const uint8_t BINARY_FLAG_REQUEST = 0x08; // Varint request id after the typed fields
+
+void writeVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void writeBinaryString(std::vector<uint8_t>& out, std::string_view str) {
+    writeVarint(out, str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+void writeHeader(uint8_t* header, uint32_t length, uint8_t flags) {
+    if (length > MAX_FRAME_LENGTH) {
+        throw std::length_error("payload exceeds MAX_FRAME_LENGTH; stream it instead");
+    }
+    header[0] = flags;
+    header[1] = (length >> 16) & 0xFF;
+    header[2] = (length >> 8) & 0xFF;
+    header[3] = length & 0xFF;
+}
+
+bool readVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool readBinaryString(const uint8_t*& p, const uint8_t* end, std::string_view& str) {
+    uint64_t length;
+    if (!readVarint(p, end, length) || length > static_cast<uint64_t>(end - p)) {
+        return false;
+    }
+    str = std::string_view(reinterpret_cast<const char*>(p), static_cast<size_t>(length));
+    p += length;
+    return true;
+}
+
+size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// UTF-8 validation: every string leaving MessageBuffer is checked once,
+// before anything is allocated for it
+
+inline unsigned countTrailingZeros(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Length of the well-formed UTF-8 sequence starting at p, 0 if invalid
+size_t utf8SequenceLength(const uint8_t* p, const uint8_t* end) {
+    uint8_t lead = p[0];
+    size_t length;
+    uint8_t min = 0x80, max = 0xBF;   // Allowed range of the first continuation byte
+
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0) min = 0xA0;        // Overlong
+        else if (lead == 0xED) max = 0x9F;   // Surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0) min = 0x90;        // Overlong
+        else if (lead == 0xF4) max = 0x8F;   // Above U+10FFFF
+    } else {
+        return 0;
+    }
+
+    if (static_cast<size_t>(end - p) < length || p[1] < min || p[1] > max) {
+        return 0;
+    }
+    for (size_t i = 2; i < length; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// Length of the leading run of 7-bit ASCII bytes
+size_t asciiRun(const uint8_t* p, size_t n) {
+    size_t i = 0;
+
+#ifdef PROTOCOL_HAVE_SSE2
+    // The sign bit is set exactly on non-ASCII bytes
+    for (; i + 32 <= n; i += 32) {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(low, high)) != 0) {
+            break;
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i))));
+        if (mask != 0) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        if ((word & 0x8080808080808080ULL) != 0) {
+            break;
+        }
+    }
+#endif
+
+    while (i < n && p[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+bool validUtf8Scalar(const uint8_t* p, const uint8_t* end) {
+    for (;;) {
+        p += asciiRun(p, static_cast<size_t>(end - p));
+        if (p == end) {
+            return true;
+        }
+        // Non-ASCII text (e.g. Vietnamese) mixes short ASCII runs with
+        // multi-byte sequences; stay on the sequence path until a run starts
+        do {
+            size_t length = utf8SequenceLength(p, end);
+            if (length == 0) {
+                return false;
+            }
+            p += length;
+        } while (p < end && *p >= 0x80);
+    }
+}
+
+#ifdef PROTOCOL_HAVE_SSSE3
+// Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per
+// Byte" (2021): three nibble lookups classify each pair of adjacent bytes,
+// and the bits of the result name the error the pair would make.
+const uint8_t UTF8_TOO_SHORT = 1 << 0;       // Lead byte not followed by enough continuations
+const uint8_t UTF8_TOO_LONG = 1 << 1;        // Continuation after ASCII
+const uint8_t UTF8_OVERLONG_3 = 1 << 2;
+const uint8_t UTF8_TOO_LARGE = 1 << 3;       // Above U+10FFFF
+const uint8_t UTF8_SURROGATE = 1 << 4;
+const uint8_t UTF8_OVERLONG_2 = 1 << 5;
+const uint8_t UTF8_TOO_LARGE_1000 = 1 << 6;
+const uint8_t UTF8_OVERLONG_4 = 1 << 6;
+const uint8_t UTF8_TWO_CONTS = 1 << 7;       // Two continuations: fine only inside 3/4-byte sequences
+const uint8_t UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS;
+
+PROTOCOL_TARGET_SSSE3
+inline __m128i utf8Lookup(const uint8_t (&table)[16], __m128i nibbles) {
+    return _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)), nibbles);
+}
+
+PROTOCOL_TARGET_SSSE3
+inline __m128i highNibbles(__m128i v) {
+    return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+// Error bits of one 16-byte block given the block before it
+PROTOCOL_TARGET_SSSE3
+__m128i utf8BlockErrors(__m128i input, __m128i previous) {
+    static const uint8_t BYTE_1_HIGH[16] = {
+        // 0xxx: ASCII
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        // 10xx: continuation
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        // 1100, 1101: two-byte lead
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        // 1110: three-byte lead
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        // 1111: four-byte lead
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    };
+    static const uint8_t BYTE_1_LOW[16] = {
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    };
+    static const uint8_t BYTE_2_HIGH[16] = {
+        // 0xxx: ASCII
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        // 1000, 1001, 101x: continuation
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        // 11xx: lead
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    };
+
+    __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(utf8Lookup(BYTE_1_HIGH, highNibbles(prev1)),
+                      utf8Lookup(BYTE_1_LOW, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)))),
+        utf8Lookup(BYTE_2_HIGH, highNibbles(input)));
+
+    // Third and fourth bytes of 3/4-byte sequences must be continuations,
+    // and are exactly where TWO_CONTS is allowed
+    __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m128i mustContinue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+    return _mm_xor_si128(mustContinue, special);
+}
+
+// Non-zero where the block ends inside a sequence
+PROTOCOL_TARGET_SSSE3
+inline __m128i utf8Incomplete(__m128i input) {
+    const __m128i maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1),
+                                           static_cast<char>(0xC0 - 1));
+    return _mm_subs_epu8(input, maxValue);
+}
+
+PROTOCOL_TARGET_SSSE3
+bool validUtf8Ssse3(const uint8_t* p, const uint8_t* end) {
+    __m128i previous = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    __m128i errors = _mm_setzero_si128();
+
+    // The zero padding of the last block is ASCII, so a sequence cut
+    // short by the end of the string shows up as TOO_SHORT
+    while (p < end) {
+        __m128i input;
+        if (end - p >= 16) {
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        } else {
+            uint8_t tail[16] = {};
+            std::memcpy(tail, p, static_cast<size_t>(end - p));
+            input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+        }
+        if (_mm_movemask_epi8(input) == 0) {
+            errors = _mm_or_si128(errors, incomplete);
+            incomplete = _mm_setzero_si128();
+        } else {
+            errors = _mm_or_si128(errors, utf8BlockErrors(input, previous));
+            incomplete = utf8Incomplete(input);
+        }
+        previous = input;
+        p += 16;
+    }
+    errors = _mm_or_si128(errors, incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) == 0xFFFF;
+}
+
+bool cpuHasSsse3() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+// False if str is not well-formed UTF-8; clears ascii on any non-ASCII byte
+bool checkUtf8(const uint8_t* p, size_t n, bool& ascii) {
+    size_t run = asciiRun(p, n);
+    if (run == n) {
+        return true;
+    }
+    ascii = false;
+    // A non-ASCII byte after an ASCII run starts at a character boundary
+#ifdef PROTOCOL_HAVE_SSSE3
+    static const bool ssse3 = cpuHasSsse3();
+    if (ssse3) {
+        return validUtf8Ssse3(p + run, p + n);
+    }
+#endif
+    return validUtf8Scalar(p + run, p + n);
+}
+
+bool checkUtf8(std::string_view str, bool& ascii) {
+    return checkUtf8(reinterpret_cast<const uint8_t*>(str.data()), str.size(), ascii);
+}
+
+bool isAscii(std::string_view str) {
+    return asciiRun(reinterpret_cast<const uint8_t*>(str.data()), str.size()) == str.size();
+}
+
+// Frame checksums: CRC-32C (Castagnoli, reflected polynomial 0x82F63B78)
+
+// Slicing-by-8 tables for CPUs without the SSE4.2 crc32 instruction
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+uint32_t crc32cPortable(const uint8_t* p, size_t n, uint32_t crc) {
+    static const Crc32cTables tables;
+    const auto& t = tables.table;
+    while (n >= 8) {
+        uint32_t low = crc ^ (static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+                              static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        n -= 8;
+    }
+    while (n-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef PROTOCOL_HAVE_SSE42
+PROTOCOL_TARGET_SSE42
+uint32_t crc32cSse42(const uint8_t* p, size_t n, uint32_t crc) {
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t wide = crc;
+    while (n >= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        wide = _mm_crc32_u64(wide, word);
+        p += 8;
+        n -= 8;
+    }
+    crc = static_cast<uint32_t>(wide);
+#else
+    while (n >= 4) {
+        uint32_t word;
+        std::memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        n -= 4;
+    }
+#endif
+    while (n-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool cpuHasSse42() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+// Checksum trailer behind every frame on connections that agreed on it
+const size_t CHECKSUM_SIZE = 4;
+
+uint32_t readBigEndian32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+// Typed payload fields as one binary string of packed [varint length][bytes]
+bool hasFields(const Message& msg) { return !msg.fields.empty(); }
+bool hasFields(const MessageView& view) { return !view.fields.empty(); }
+
+void writeFields(std::vector<uint8_t>& out, const Message& msg) {
+    size_t packed = 0;
+    for (const std::string& field : msg.fields) {
+        packed += varintSize(field.size()) + field.size();
+    }
+    writeVarint(out, packed);
+    for (const std::string& field : msg.fields) {
+        writeBinaryString(out, field);
+    }
+}
+
+void writeFields(std::vector<uint8_t>& out, const MessageView& view) {
+    writeBinaryString(out, view.fields);
+}
+
+bool validFields(std::string_view packed, bool& ascii) {
+    FieldReader reader(packed);
+    std::string_view field;
+    while (reader.next(field)) {
+        if (!checkUtf8(field, ascii)) {
+            return false;
+        }
+    }
+    return reader.done();
+}
+
+// Route header: [type][route flags][sender][receiver][timestamp if stamped]
+template <typename Msg>
+bool isRoutable(const Msg& msg) {
+    return msg.type == MessageType::MSG_PRIVATE && !msg.receiver.empty();
+}
+
+template <typename Msg>
+void writeRouteHeader(std::vector<uint8_t>& out, const Msg& msg) {
+    out.push_back(static_cast<uint8_t>(msg.type));
+    out.push_back(0);
+    writeBinaryString(out, msg.sender);
+    writeBinaryString(out, msg.receiver);
+}
+
+// Returns the route header length, 0 if malformed
+size_t readRouteHeader(const uint8_t* data, size_t length, RouteHeader& route) {
+    if (length < 2 || !isValidMessageType(data[0]) || (data[1] & ~ROUTE_FLAG_TIMESTAMP) != 0) {
+        return 0;
+    }
+    const uint8_t* p = data + 2;
+    const uint8_t* end = data + length;
+    if (!readBinaryString(p, end, route.sender) || !readBinaryString(p, end, route.receiver)) {
+        return 0;
+    }
+    route.timestamp = std::string_view();
+    if ((data[1] & ROUTE_FLAG_TIMESTAMP) != 0 && !readBinaryString(p, end, route.timestamp)) {
+        return 0;
+    }
+    bool ascii = true;
+    if (!checkUtf8(route.sender, ascii) || !checkUtf8(route.receiver, ascii) ||
+        !checkUtf8(route.timestamp, ascii)) {
+        return 0;
+    }
+    route.type = static_cast<MessageType>(data[0]);
+    route.flags = data[1];
+    return static_cast<size_t>(p - data);
+}
+
+// Optional payload features a connection agreed on
+struct Encoding {
+    bool trace;             // Trace stamps
+    bool typed;             // Typed fields (BINARY only)
+    bool requestIds;        // Request ids in BINARY; JSON always carries them
+    NameDictionary* names;  // Sender name dictionary (BINARY only)
+
+    // Without options: everything the message has, as the plain serializers always did
+    Encoding() : trace(true), typed(false), requestIds(true), names(nullptr) {}
+
+    explicit Encoding(const WireOptions& options, NameDictionary* dictionary = nullptr)
+        : trace(options.tracing), typed(options.typedPayloads), requestIds(options.requestIds),
+          names(options.nameDictionary ? dictionary : nullptr) {}
+};
+
+// Encoders take a Message or a MessageView
+template <typename Msg>
+void encodeBinary(const Msg& msg, std::vector<uint8_t>& out, const Encoding& encoding) {
+    bool traced = encoding.trace && !msg.trace.empty();
+    bool withFields = encoding.typed && hasFields(msg);
+    bool withRequest = encoding.requestIds && msg.requestId != 0;
+    uint32_t nameId = 0;
+    int define = (encoding.names != nullptr && !msg.sender.empty()) ? encoding.names->encode(msg.sender, nameId) : -1;
+    out.push_back(static_cast<uint8_t>(msg.type));
+    out.push_back((traced ? BINARY_FLAG_TRACE : BINARY_FLAGS_NONE) |
+                  (withFields ? BINARY_FLAG_FIELDS : BINARY_FLAGS_NONE) |
+                  (define >= 0 ? BINARY_FLAG_NAME : BINARY_FLAGS_NONE) |
+                  (withRequest ? BINARY_FLAG_REQUEST : BINARY_FLAGS_NONE));
+    if (define < 0) {
+        writeBinaryString(out, msg.sender);
+    } else {
+        writeVarint(out, (static_cast<uint64_t>(nameId) << 1) | static_cast<uint64_t>(define));
+        if (define > 0) {
+            writeBinaryString(out, msg.sender);
+        }
+    }
+    writeBinaryString(out, msg.receiver);
+    writeBinaryString(out, msg.content);
+    if (msg.timestamp.empty()) {
+        writeBinaryString(out, getCurrentTimestamp());
+    } else {
+        writeBinaryString(out, msg.timestamp);
+    }
+    writeBinaryString(out, msg.extra);
+    if (withFields) {
+        writeFields(out, msg);
+    }
+    if (withRequest) {
+        writeVarint(out, msg.requestId);
+    }
+    if (traced) {
+        writeVarint(out, msg.trace.clientSend);
+        writeVarint(out, msg.trace.serverRecv);
+        writeVarint(out, msg.trace.serverSend);
+    }
+}
+
+// Sender slot of a payload with BINARY_FLAG_NAME
+const char* readSenderName(const uint8_t*& p, const uint8_t* end, NameDictionary* names, std::string_view& sender) {
+    if (names == nullptr) {
+        return "name reference outside a name dictionary";
+    }
+    uint64_t code;
+    if (!readVarint(p, end, code)) {
+        return "truncated binary payload";
+    }
+    if ((code >> 1) >= MAX_NAME_DICTIONARY) {
+        return "invalid name reference";
+    }
+    uint32_t id = static_cast<uint32_t>(code >> 1);
+    if ((code & 1) != 0) {
+        if (!readBinaryString(p, end, sender)) {
+            return "truncated binary payload";
+        }
+        bool ascii = true;
+        if (!checkUtf8(sender, ascii)) {
+            return "invalid UTF-8";   // Never enters the dictionary
+        }
+        if (!names->define(id, sender)) {
+            return "invalid name definition";
+        }
+    }
+    return names->resolve(id, sender) ? nullptr : "invalid name reference";
+}
+
+const char* decodeBinaryView(const uint8_t* data, size_t length, MessageView& view, NameDictionary* names) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + length;
+
+    if (length < 2) {
+        return "truncated binary payload";
+    }
+    if (!isValidMessageType(*p)) {
+        return "unknown message type";
+    }
+    view.type = static_cast<MessageType>(*p++);
+    uint8_t flags = *p++;
+    if ((flags & ~(BINARY_FLAG_TRACE | BINARY_FLAG_FIELDS | BINARY_FLAG_NAME | BINARY_FLAG_REQUEST)) != 0) {
+        return "unsupported binary flags";
+    }
+
+    const uint8_t* strings = p;
+    if ((flags & BINARY_FLAG_NAME) != 0) {
+        if (const char* error = readSenderName(p, end, names, view.sender)) {
+            return error;
+        }
+    } else if (!readBinaryString(p, end, view.sender)) {
+        return "truncated binary payload";
+    }
+    if (!readBinaryString(p, end, view.receiver) ||
+        !readBinaryString(p, end, view.content) ||
+        !readBinaryString(p, end, view.timestamp) ||
+        !readBinaryString(p, end, view.extra)) {
+        return "truncated binary payload";
+    }
+    // Short strings make one pass over all of them (length prefixes
+    // included) cheaper than five; it settles the common all-ASCII case
+    bool ascii = true;
+    size_t span = static_cast<size_t>(p - strings);
+    if (asciiRun(strings, span) != span) {
+        if (!checkUtf8(view.sender, ascii) || !checkUtf8(view.receiver, ascii) ||
+            !checkUtf8(view.content, ascii) || !checkUtf8(view.timestamp, ascii) ||
+            !checkUtf8(view.extra, ascii)) {
+            return "invalid UTF-8";
+        }
+    } else if ((flags & BINARY_FLAG_NAME) != 0) {
+        ascii = isAscii(view.sender);   // A reference leaves the name out of the payload
+    }
+
+    view.fields = std::string_view();
+    if ((flags & BINARY_FLAG_FIELDS) != 0) {
+        if (!readBinaryString(p, end, view.fields)) {
+            return "truncated binary payload";
+        }
+        if (!validFields(view.fields, ascii)) {
+            return "malformed typed payload";
+        }
+    }
+    view.asciiOnly = ascii;
+
+    view.requestId = 0;
+    if ((flags & BINARY_FLAG_REQUEST) != 0) {
+        uint64_t requestId;
+        if (!readVarint(p, end, requestId)) {
+            return "truncated binary payload";
+        }
+        if (requestId > UINT32_MAX) {
+            return "request id out of range";
+        }
+        view.requestId = static_cast<uint32_t>(requestId);
+    }
+
+    view.trace = TraceStamps();
+    if ((flags & BINARY_FLAG_TRACE) != 0 &&
+        (!readVarint(p, end, view.trace.clientSend) ||
+         !readVarint(p, end, view.trace.serverRecv) ||
+         !readVarint(p, end, view.trace.serverSend))) {
+        return "truncated binary payload";
+    }
+    return nullptr;
+}
+
+// Fixed-schema JSON encoder
+//
+// Emits exactly what json::dump() produces for the Message object: keys in
+// sorted order, no whitespace, UTF-8 passed through verbatim, and only
+// '"', '\\' and control characters escaped (lowercase \u00XX for the ones
+// without a short form). Python's json.loads() accepts this unchanged.
+
+// Length of the leading run that is printable ASCII without '"' or '\\'
+size_t plainAsciiRun(const uint8_t* p, size_t n) {
+    size_t i = 0;
+
+#ifdef PROTOCOL_HAVE_SSE2
+    // Signed compare against 0x20 flags both control bytes and bytes >= 0x80
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i special = _mm_or_si128(
+            _mm_cmplt_epi8(chunk, space),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (mask != 0) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        uint8_t c = p[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+// Length of the leading run without '"', '\\' or control bytes; unlike
+// plainAsciiRun it runs over UTF-8 sequences, for input already validated
+size_t jsonStringRun(const uint8_t* p, size_t n) {
+    size_t i = 0;
+
+#ifdef PROTOCOL_HAVE_SSE2
+    const __m128i control = _mm_set1_epi8(0x1F);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i special = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special));
+        if (mask != 0) {
+            return i + countTrailingZeros(mask);
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        uint8_t c = p[i];
+        if (c < 0x20 || c == '"' || c == '\\') {
+            break;
+        }
+    }
+    return i;
+}
+
+void writeRaw(std::vector<uint8_t>& out, const char* data, size_t length) {
+    out.insert(out.end(), reinterpret_cast<const uint8_t*>(data),
+               reinterpret_cast<const uint8_t*>(data) + length);
+}
+
+template <size_t N>
+void writeLiteral(std::vector<uint8_t>& out, const char (&literal)[N]) {
+    writeRaw(out, literal, N - 1);
+}
+
+void writeJsonString(std::vector<uint8_t>& out, std::string_view str) {
+    static const char HEX[] = "0123456789abcdef";
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(str.data());
+    const uint8_t* end = p + str.size();
+
+    out.push_back('"');
+    while (p < end) {
+        size_t run = plainAsciiRun(p, static_cast<size_t>(end - p));
+        out.insert(out.end(), p, p + run);
+        p += run;
+        if (p == end) {
+            break;
+        }
 
-    // Convert to string
-    std::string payload = j.dump();
+        uint8_t c = *p;
+        if (c >= 0x80) {
+            size_t length = utf8SequenceLength(p, end);
+            if (length == 0) {
+                throw std::runtime_error("invalid UTF-8 byte at index " +
+                    std::to_string(p - reinterpret_cast<const uint8_t*>(str.data())));
+            }
+            out.insert(out.end(), p, p + length);
+            p += length;
+            continue;
+        }
 
-    // Create result with 4-byte length prefix (network byte order - big endian)
-    uint32_t length = static_cast<uint32_t>(payload.size());
-    std::vector<uint8_t> result(4 + length);
+        switch (c) {
+            case '"':  writeLiteral(out, "\\\""); break;
+            case '\\': writeLiteral(out, "\\\\"); break;
+            case '\b': writeLiteral(out, "\\b"); break;
+            case '\t': writeLiteral(out, "\\t"); break;
+            case '\n': writeLiteral(out, "\\n"); break;
+            case '\f': writeLiteral(out, "\\f"); break;
+            case '\r': writeLiteral(out, "\\r"); break;
+            default: {
+                const uint8_t escape[6] = {'\\', 'u', '0', '0',
+                                           static_cast<uint8_t>(HEX[c >> 4]),
+                                           static_cast<uint8_t>(HEX[c & 0x0F])};
+                out.insert(out.end(), escape, escape + 6);
+                break;
+            }
+        }
+        ++p;
+    }
+    out.push_back('"');
+}
+
+void writeNumber(std::vector<uint8_t>& out, uint64_t value) {
+    char number[24];
+    auto result = std::to_chars(number, number + sizeof(number), value);
+    writeRaw(out, number, static_cast<size_t>(result.ptr - number));
+}
+
+template <typename Msg>
+void encodeJson(const Msg& msg, std::vector<uint8_t>& out, bool withTrace) {
+    writeLiteral(out, "{\"content\":");
+    writeJsonString(out, msg.content);
+    writeLiteral(out, ",\"extra\":");
+    writeJsonString(out, msg.extra);
+    writeLiteral(out, ",\"receiver\":");
+    writeJsonString(out, msg.receiver);
+    if (msg.requestId != 0) {
+        writeLiteral(out, ",\"requestId\":");
+        writeNumber(out, msg.requestId);
+    }
+    writeLiteral(out, ",\"sender\":");
+    writeJsonString(out, msg.sender);
+    writeLiteral(out, ",\"timestamp\":");
+    if (msg.timestamp.empty()) {
+        writeJsonString(out, getCurrentTimestamp());
+    } else {
+        writeJsonString(out, msg.timestamp);
+    }
+    if (withTrace && !msg.trace.empty()) {
+        writeLiteral(out, ",\"trace\":{\"clientSend\":");
+        writeNumber(out, msg.trace.clientSend);
+        writeLiteral(out, ",\"serverRecv\":");
+        writeNumber(out, msg.trace.serverRecv);
+        writeLiteral(out, ",\"serverSend\":");
+        writeNumber(out, msg.trace.serverSend);
+        out.push_back('}');
+    }
+    writeLiteral(out, ",\"type\":");
+    writeNumber(out, static_cast<uint64_t>(static_cast<int>(msg.type)));
+    out.push_back('}');
+}
+
+// Streaming JSON parser producing a MessageView
+//
+// Walks the payload once without building a DOM. Strings are returned as
+// views into the payload; only strings containing escapes are rewritten,
+// in place, which is safe because an escape never expands.
+class JsonViewParser {
+public:
+    JsonViewParser(uint8_t* data, size_t length) : p_(data), end_(data + length), escapedNonAscii_(false) {}
+
+    // ascii: the payload (already UTF-8 checked) has no byte >= 0x80
+    const char* parse(MessageView& view, bool ascii) {
+        view = MessageView();
+        escapedNonAscii_ = false;
+        bool hasType = false;
+
+        skipWhitespace();
+        if (!consume('{')) {
+            return "expected '{'";
+        }
+        skipWhitespace();
+        if (!consume('}')) {
+            for (;;) {
+                std::string_view key;
+                skipWhitespace();
+                if (!parseString(key)) {
+                    return "expected member name";
+                }
+                skipWhitespace();
+                if (!consume(':')) {
+                    return "expected ':'";
+                }
+                skipWhitespace();
 
-    // Write length in big-endian
-    result[0] = (length >> 24) & 0xFF;
-    result[1] = (length >> 16) & 0xFF;
-    result[2] = (length >> 8) & 0xFF;
-    result[3] = length & 0xFF;
+                std::string_view* field = nullptr;
+                if (key == "type") {
+                    long long type;
+                    if (!parseInteger(type)) {
+                        return "type must be an integer";
+                    }
+                    if (type < 0 || type > 255 || !isValidMessageType(static_cast<int>(type))) {
+                        return "unknown message type";
+                    }
+                    view.type = static_cast<MessageType>(type);
+                    hasType = true;
+                } else if (key == "trace") {
+                    if (!parseTrace(view.trace)) {
+                        return "malformed trace";
+                    }
+                } else if (key == "requestId") {
+                    uint64_t requestId;
+                    if (!parseUnsigned(requestId) || requestId > UINT32_MAX) {
+                        return "malformed request id";
+                    }
+                    view.requestId = static_cast<uint32_t>(requestId);
+                } else if ((field = stringField(view, key)) != nullptr) {
+                    if (!parseString(*field)) {
+                        return "field must be a string";
+                    }
+                } else if (!skipValue(0)) {
+                    return "malformed value";
+                }
 
-    // Write payload
-    std::memcpy(result.data() + 4, payload.data(), length);
+                skipWhitespace();
+                if (consume('}')) {
+                    break;
+                }
+                if (!consume(',')) {
+                    return "expected ',' or '}'";
+                }
+            }
+        }
+
+        skipWhitespace();
+        if (p_ != end_) {
+            return "trailing data after object";
+        }
+        if (!hasType) {
+            return "missing type";
+        }
+        view.asciiOnly = ascii && !escapedNonAscii_;
+        return nullptr;
+    }
+
+private:
+    static const int MAX_DEPTH = 64;
+
+    static std::string_view* stringField(MessageView& view, std::string_view key) {
+        if (key == "sender") return &view.sender;
+        if (key == "receiver") return &view.receiver;
+        if (key == "content") return &view.content;
+        if (key == "timestamp") return &view.timestamp;
+        if (key == "extra") return &view.extra;
+        return nullptr;
+    }
+
+    void skipWhitespace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+            ++p_;
+        }
+    }
+
+    bool consume(uint8_t c) {
+        if (p_ < end_ && *p_ == c) {
+            ++p_;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseInteger(long long& value) {
+        bool negative = consume('-');
+        const uint8_t* start = p_;
+        value = 0;
+        while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+            if (value > 100000000000LL) {
+                return false;
+            }
+            value = value * 10 + (*p_++ - '0');
+        }
+        if (p_ == start) {
+            return false;
+        }
+        if (negative) {
+            value = -value;
+        }
+        return p_ == end_ || (*p_ != '.' && *p_ != 'e' && *p_ != 'E');
+    }
+
+    bool parseUnsigned(uint64_t& value) {
+        const uint8_t* start = p_;
+        value = 0;
+        while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+            uint64_t digit = static_cast<uint64_t>(*p_++ - '0');
+            if (value > (UINT64_MAX - digit) / 10) {
+                return false;
+            }
+            value = value * 10 + digit;
+        }
+        return p_ != start && (p_ == end_ || (*p_ != '.' && *p_ != 'e' && *p_ != 'E'));
+    }
+
+    // {"clientSend":N,"serverRecv":N,"serverSend":N}, unknown members ignored
+    bool parseTrace(TraceStamps& trace) {
+        if (!consume('{')) {
+            return false;
+        }
+        skipWhitespace();
+        if (consume('}')) {
+            return true;
+        }
+        for (;;) {
+            std::string_view key;
+            skipWhitespace();
+            if (!parseString(key)) {
+                return false;
+            }
+            skipWhitespace();
+            if (!consume(':')) {
+                return false;
+            }
+            skipWhitespace();
+
+            uint64_t* stamp = key == "clientSend" ? &trace.clientSend
+                            : key == "serverRecv" ? &trace.serverRecv
+                            : key == "serverSend" ? &trace.serverSend : nullptr;
+            if (stamp != nullptr ? !parseUnsigned(*stamp) : !skipValue(1)) {
+                return false;
+            }
+
+            skipWhitespace();
+            if (consume('}')) {
+                return true;
+            }
+            if (!consume(',')) {
+                return false;
+            }
+        }
+    }
+
+    static int hexValue(uint8_t c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool parseHex4(uint32_t& value) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i) {
+            int digit = hexValue(*p_++);
+            if (digit < 0) {
+                return false;
+            }
+            value = (value << 4) | static_cast<uint32_t>(digit);
+        }
+        return true;
+    }
+
+    static uint8_t* writeUtf8(uint8_t* w, uint32_t cp) {
+        if (cp < 0x80) {
+            *w++ = static_cast<uint8_t>(cp);
+        } else if (cp < 0x800) {
+            *w++ = static_cast<uint8_t>(0xC0 | (cp >> 6));
+            *w++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            *w++ = static_cast<uint8_t>(0xE0 | (cp >> 12));
+            *w++ = static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+            *w++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+        } else {
+            *w++ = static_cast<uint8_t>(0xF0 | (cp >> 18));
+            *w++ = static_cast<uint8_t>(0x80 | ((cp >> 12) & 0x3F));
+            *w++ = static_cast<uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+            *w++ = static_cast<uint8_t>(0x80 | (cp & 0x3F));
+        }
+        return w;
+    }
+
+    bool parseString(std::string_view& out) {
+        if (!consume('"')) {
+            return false;
+        }
+        uint8_t* start = p_;
+
+        // Fast path: no escapes, the view points straight at the payload.
+        // The payload was UTF-8 checked before parsing, so multi-byte
+        // sequences need no attention here.
+        p_ += jsonStringRun(p_, static_cast<size_t>(end_ - p_));
+        if (p_ == end_) {
+            return false;
+        }
+        if (*p_ == '"') {
+            out = std::string_view(reinterpret_cast<const char*>(start), static_cast<size_t>(p_ - start));
+            ++p_;
+            return true;
+        }
+
+        // Slow path: unescape in place from the first backslash onwards
+        uint8_t* w = p_;
+        while (p_ < end_) {
+            uint8_t c = *p_++;
+            if (c == '"') {
+                out = std::string_view(reinterpret_cast<const char*>(start), static_cast<size_t>(w - start));
+                return true;
+            }
+            if (c < 0x20) {
+                return false;
+            }
+            if (c != '\\') {
+                *w++ = c;
+                continue;
+            }
+            if (p_ == end_) {
+                return false;
+            }
+            switch (*p_++) {
+                case '"':  *w++ = '"'; break;
+                case '\\': *w++ = '\\'; break;
+                case '/':  *w++ = '/'; break;
+                case 'b':  *w++ = '\b'; break;
+                case 'f':  *w++ = '\f'; break;
+                case 'n':  *w++ = '\n'; break;
+                case 'r':  *w++ = '\r'; break;
+                case 't':  *w++ = '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!parseHex4(cp)) {
+                        return false;
+                    }
+                    if (cp >= 0xD800 && cp <= 0xDBFF) {
+                        uint32_t low;
+                        if (!consume('\\') || !consume('u') || !parseHex4(low) ||
+                            low < 0xDC00 || low > 0xDFFF) {
+                            return false;
+                        }
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                        return false;
+                    }
+                    escapedNonAscii_ = escapedNonAscii_ || cp >= 0x80;
+                    w = writeUtf8(w, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    bool skipValue(int depth) {
+        if (p_ == end_ || depth > MAX_DEPTH) {
+            return false;
+        }
+
+        uint8_t c = *p_;
+        if (c == '"') {
+            std::string_view ignored;
+            return parseString(ignored);
+        }
+        if (c == '{' || c == '[') {
+            uint8_t close = (c == '{') ? '}' : ']';
+            ++p_;
+            skipWhitespace();
+            if (consume(close)) {
+                return true;
+            }
+            for (;;) {
+                skipWhitespace();
+                if (c == '{') {
+                    std::string_view ignored;
+                    if (!parseString(ignored)) {
+                        return false;
+                    }
+                    skipWhitespace();
+                    if (!consume(':')) {
+                        return false;
+                    }
+                    skipWhitespace();
+                }
+                if (!skipValue(depth + 1)) {
+                    return false;
+                }
+                skipWhitespace();
+                if (consume(close)) {
+                    return true;
+                }
+                if (!consume(',')) {
+                    return false;
+                }
+            }
+        }
+        if (c == 't') return consumeLiteral("true");
+        if (c == 'f') return consumeLiteral("false");
+        if (c == 'n') return consumeLiteral("null");
+
+        const uint8_t* start = p_;
+        while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '-' || *p_ == '+' ||
+                             *p_ == '.' || *p_ == 'e' || *p_ == 'E')) {
+            ++p_;
+        }
+        return p_ != start;
+    }
+
+    bool consumeLiteral(std::string_view literal) {
+        if (static_cast<size_t>(end_ - p_) < literal.size() ||
+            std::memcmp(p_, literal.data(), literal.size()) != 0) {
+            return false;
+        }
+        p_ += literal.size();
+        return true;
+    }
+
+    uint8_t* p_;
+    uint8_t* end_;
+    bool escapedNonAscii_;   // A \\u escape produced a non-ASCII character
+};
+
+const char* parseViewImpl(uint8_t* data, size_t length, MessageView& view, WireFormat format,
+                          NameDictionary* names = nullptr) {
+    if (format == WireFormat::BINARY) {
+        return decodeBinaryView(data, length, view, names);
+    }
+    bool ascii = true;
+    if (!checkUtf8(data, length, ascii)) {
+        return "invalid UTF-8";
+    }
+    return JsonViewParser(data, length).parse(view, ascii);
+}
+
+} // namespace
+
+namespace {
+
+// Legacy form of a typed message: what peers without typed payloads expect
+// in content / extra. Written with the fixed-schema JSON encoder, so the
+// output matches json::dump() without building a DOM.
+
+std::string jsonObject(const char* firstKey, std::string_view first,
+                       const char* secondKey, std::string_view second) {
+    // Keys must be passed in sorted order, as json::dump() emits them
+    thread_local std::vector<uint8_t> scratch;
+    scratch.clear();
+    scratch.push_back('{');
+    writeJsonString(scratch, firstKey);
+    scratch.push_back(':');
+    writeJsonString(scratch, first);
+    if (secondKey != nullptr) {
+        scratch.push_back(',');
+        writeJsonString(scratch, secondKey);
+        scratch.push_back(':');
+        writeJsonString(scratch, second);
+    }
+    scratch.push_back('}');
+    return std::string(scratch.begin(), scratch.end());
+}
+
+std::string jsonArray(const std::vector<std::string_view>& items) {
+    thread_local std::vector<uint8_t> scratch;
+    scratch.clear();
+    scratch.push_back('[');
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i > 0) {
+            scratch.push_back(',');
+        }
+        writeJsonString(scratch, items[i]);
+    }
+    scratch.push_back(']');
+    return std::string(scratch.begin(), scratch.end());
+}
+
+template <typename Msg>
+Message legacyForm(const Msg& msg) {
+    Message lowered(msg.type);
+    lowered.sender.assign(msg.sender.data(), msg.sender.size());
+    lowered.receiver.assign(msg.receiver.data(), msg.receiver.size());
+    lowered.content.assign(msg.content.data(), msg.content.size());
+    lowered.timestamp.assign(msg.timestamp.data(), msg.timestamp.size());
+    lowered.extra.assign(msg.extra.data(), msg.extra.size());
+    lowered.requestId = msg.requestId;
+    lowered.asciiOnly = msg.asciiOnly;
+    lowered.trace = msg.trace;
+
+    thread_local std::vector<std::string_view> f;
+    f.clear();
+    if constexpr (std::is_same_v<Msg, Message>) {
+        f.assign(msg.fields.begin(), msg.fields.end());
+    } else {
+        FieldReader reader(msg.fields);
+        std::string_view field;
+        while (reader.next(field)) {
+            f.push_back(field);
+        }
+    }
+
+    switch (msg.type) {
+        case MessageType::LOGIN:
+        case MessageType::REGISTER:
+            if (f.size() >= 2) {
+                lowered.content = jsonObject("password", f[1], "username", f[0]);
+            }
+            break;
+        case MessageType::CHANGE_PASSWORD:
+            if (f.size() >= 2) {
+                lowered.content = jsonObject("newPassword", f[1], "oldPassword", f[0]);
+            }
+            break;
+        case MessageType::ONLINE_LIST:
+            lowered.extra = jsonArray(f);
+            break;
+        case MessageType::USER_STATUS:
+            if (!f.empty()) {
+                lowered.content.assign(f[0].data(), f[0].size());
+                lowered.extra = jsonObject("status", f[0], nullptr, {});
+            }
+            break;
+        default:
+            break;
+    }
+    return lowered;
+}
+
+// Typed fields go on the wire only in BINARY on connections that agreed on
+// them; everywhere else the message is lowered to its legacy JSON-in-string form
+//
+// Names are only looked up in BINARY; routed frames are relayed to other
+// connections, so they never use this connection's dictionary.
+template <typename Msg>
+size_t serializeFrame(const Msg& msg, std::vector<uint8_t>& out, WireFormat format, uint8_t flags,
+                      const Encoding& encoding = Encoding()) {
+    if (hasFields(msg) && !(encoding.typed && format == WireFormat::BINARY)) {
+        return serializeFrame(legacyForm(msg), out, format, flags, encoding);
+    }
+    NameDictionary* names = encoding.names;
+    if (format != WireFormat::BINARY || (flags & FRAME_FLAG_ROUTED) != 0) {
+        names = nullptr;
+    }
+
+    // Reserve the 4-byte length prefix, encode payload behind it
+    size_t start = out.size();
+    size_t namesBefore = names != nullptr ? names->size() : 0;
+    out.resize(start + 4);
+    if ((flags & FRAME_FLAG_ROUTED) != 0) {
+        writeRouteHeader(out, msg);
+    }
+    if (format == WireFormat::BINARY) {
+        Encoding binary = encoding;
+        binary.names = names;
+        encodeBinary(msg, out, binary);
+    } else {
+        encodeJson(msg, out, encoding.trace);
+    }
+
+    // Back-patch length in big-endian (network byte order)
+    uint32_t length = static_cast<uint32_t>(out.size() - start - 4);
+    try {
+        writeHeader(out.data() + start, length, flags);
+    } catch (...) {
+        // The frame is never sent, so neither are the names it defined
+        out.resize(start);
+        if (names != nullptr) {
+            names->truncate(namesBefore);
+        }
+        throw;
+    }
 
     // Debug log (can be enabled for detailed protocol analysis)
     #ifdef PROTOCOL_DEBUG_LOG
-    std::cout << "[PROTOCOL] Serialize: Type=" << messageTypeToString(msg.type) 
+    const uint8_t* header = out.data() + start;
+    std::cout << "[PROTOCOL] Serialize: Type=" << messageTypeName(msg.type)
+              << ", Format=" << (format == WireFormat::BINARY ? "BINARY" : "JSON")
               << ", Length=" << length << " bytes" << std::endl;
-    std::cout << "[PROTOCOL] JSON Payload: " << payload << std::endl;
     std::cout << "[PROTOCOL] Header bytes: [" 
-              << std::hex << (int)result[0] << " " << (int)result[1] << " " 
-              << (int)result[2] << " " << (int)result[3] << "]" << std::dec << std::endl;
+              << std::hex << (int)header[0] << " " << (int)header[1] << " " 
+              << (int)header[2] << " " << (int)header[3] << "]" << std::dec << std::endl;
     #endif
 
-    return result;
+    return 4 + static_cast<size_t>(length);
 }
 
-Message deserialize(const uint8_t* data, size_t length) {
-    Message msg;
+// Compressed payload: [varint uncompressed length][zlib stream]
+#ifdef PROTOCOL_HAVE_ZLIB
+// zlib contexts are set up once per thread and reset per frame, which
+// avoids allocating the deflate window for every message
+struct Deflater {
+    z_stream stream;
+    bool ready;
+    Deflater() : stream() { ready = deflateInit(&stream, Z_BEST_SPEED) == Z_OK; }
+    ~Deflater() { if (ready) deflateEnd(&stream); }
+};
+
+struct Inflater {
+    z_stream stream;
+    bool ready;
+    Inflater() : stream() { ready = inflateInit(&stream) == Z_OK; }
+    ~Inflater() { if (ready) inflateEnd(&stream); }
+};
+
+bool compressPayload(const uint8_t* data, size_t length, std::vector<uint8_t>& out) {
+    thread_local Deflater deflater;
+    z_stream& stream = deflater.stream;
+    if (!deflater.ready || deflateReset(&stream) != Z_OK) {
+        return false;
+    }
+
+    out.clear();
+    writeVarint(out, length);
+    size_t prefix = out.size();
+    out.resize(prefix + deflateBound(&stream, static_cast<uLong>(length)));
+
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = static_cast<uInt>(length);
+    stream.next_out = out.data() + prefix;
+    stream.avail_out = static_cast<uInt>(out.size() - prefix);
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    out.resize(prefix + stream.total_out);
+    return out.size() < length;
+}
+
+const char* inflatePayload(const uint8_t* data, size_t length, uint32_t limit, std::vector<uint8_t>& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + length;
+    uint64_t rawLength;
+    if (!readVarint(p, end, rawLength) || rawLength == 0) {
+        return "malformed compressed frame";
+    }
+    // Checked before inflating, so a small frame cannot expand past the limit
+    if (rawLength > limit) {
+        return "decompressed frame too large";
+    }
+
+    thread_local Inflater inflater;
+    z_stream& stream = inflater.stream;
+    if (!inflater.ready || inflateReset(&stream) != Z_OK) {
+        return "decompression unavailable";
+    }
 
+    out.resize(static_cast<size_t>(rawLength));
+    stream.next_in = const_cast<Bytef*>(p);
+    stream.avail_in = static_cast<uInt>(end - p);
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(rawLength);
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out != rawLength || stream.avail_in != 0) {
+        return "corrupt compressed frame";
+    }
+    return nullptr;
+}
+#else
+bool compressPayload(const uint8_t*, size_t, std::vector<uint8_t>&) {
+    return false;
+}
+
+const char* inflatePayload(const uint8_t*, size_t, uint32_t, std::vector<uint8_t>&) {
+    return "compression not supported by this build";
+}
+#endif
+
+// Compress the frame starting at out[start] in place when the options ask for it
+void compressFrame(std::vector<uint8_t>& out, size_t start, const WireOptions& options) {
+    size_t length = out.size() - start - 4;
+    if (!options.compression || length == 0 || length < options.compressionThreshold) {
+        return;
+    }
+    // Relays must be able to read the route header as is
+    if ((out[start] & FRAME_FLAG_ROUTED) != 0) {
+        return;
+    }
+
+    thread_local std::vector<uint8_t> scratch;
+    if (!compressPayload(out.data() + start + 4, length, scratch)) {
+        return;  // Incompressible: keep the plain frame
+    }
+    uint8_t flags = out[start];
+    out.resize(start + 4);
+    out.insert(out.end(), scratch.begin(), scratch.end());
+    writeHeader(out.data() + start, static_cast<uint32_t>(scratch.size()), flags | FRAME_FLAG_COMPRESSED);
+}
+
+// Append the checksum trailer to the finished frame at out[start] when the options ask for it
+void checksumFrame(std::vector<uint8_t>& out, size_t start, const WireOptions& options) {
+    if (options.checksums) {
+        appendFrameChecksum(out, start);
+    }
+}
+
+size_t serializeBatchFrame(const std::vector<Message>& messages, std::vector<uint8_t>& out, WireFormat format,
+                           const Encoding& encoding) {
+    if (messages.size() <= 1) {
+        // Nothing to amortize: a lone message goes out as a plain frame
+        return messages.empty() ? 0 : serializeFrame(messages.front(), out, format, 0, encoding);
+    }
+    NameDictionary* names = format == WireFormat::BINARY ? encoding.names : nullptr;
+
+    // Outer header, then each message framed as a flag-less entry
+    size_t start = out.size();
+    size_t namesBefore = names != nullptr ? names->size() : 0;
+    out.resize(start + 4);
     try {
-        std::string payload(reinterpret_cast<const char*>(data), length);
-        
-        #ifdef PROTOCOL_DEBUG_LOG
-        std::cout << "[PROTOCOL] Deserialize: Length=" << length << " bytes" << std::endl;
-        std::cout << "[PROTOCOL] JSON Payload: " << payload << std::endl;
-        #endif
-        
-        json j = json::parse(payload);
-
-        msg.type = static_cast<MessageType>(j["type"].get<int>());
-        msg.sender = j.value("sender", "");
-        msg.receiver = j.value("receiver", "");
-        msg.content = j.value("content", "");
-        msg.timestamp = j.value("timestamp", "");
-        msg.extra = j.value("extra", "");
-        
+        for (const Message& msg : messages) {
+            serializeFrame(msg, out, format, 0, encoding);
+        }
+        writeHeader(out.data() + start, static_cast<uint32_t>(std::min<size_t>(out.size() - start - 4, UINT32_MAX)),
+                    FRAME_FLAG_BATCH);
+    } catch (...) {
+        out.resize(start);
+        if (names != nullptr) {
+            names->truncate(namesBefore);
+        }
+        throw;
+    }
+    return out.size() - start;
+}
+
+} // namespace
+
+uint32_t crc32c(const uint8_t* data, size_t length, uint32_t crc) {
+    crc = ~crc;
+#ifdef PROTOCOL_HAVE_SSE42
+    static const bool sse42 = cpuHasSse42();
+    if (sse42) {
+        return ~crc32cSse42(data, length, crc);
+    }
+#endif
+    return ~crc32cPortable(data, length, crc);
+}
+
+void appendFrameChecksum(std::vector<uint8_t>& out, size_t frameStart) {
+    uint32_t crc = crc32c(out.data() + frameStart, out.size() - frameStart);
+    uint8_t trailer[CHECKSUM_SIZE] = {
+        static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+        static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+    out.insert(out.end(), trailer, trailer + CHECKSUM_SIZE);
+}
+
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, WireFormat format) {
+    return serializeFrame(msg, out, format, 0);
+}
+
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, const WireOptions& options) {
+    size_t start = out.size();
+    uint8_t flags = options.routing && isRoutable(msg) ? FRAME_FLAG_ROUTED : 0;
+    serializeFrame(msg, out, options.format, flags, Encoding(options));
+    compressFrame(out, start, options);
+    checksumFrame(out, start, options);
+    return out.size() - start;
+}
+
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, const WireOptions& options,
+                     NameDictionary& names) {
+    size_t start = out.size();
+    uint8_t flags = options.routing && isRoutable(msg) ? FRAME_FLAG_ROUTED : 0;
+    serializeFrame(msg, out, options.format, flags, Encoding(options, &names));
+    compressFrame(out, start, options);
+    checksumFrame(out, start, options);
+    return out.size() - start;
+}
+
+size_t serializeInto(const MessageView& view, std::vector<uint8_t>& out, WireFormat format) {
+    return serializeFrame(view, out, format, 0);
+}
+
+size_t serializeInto(const MessageView& view, std::vector<uint8_t>& out, const WireOptions& options) {
+    size_t start = out.size();
+    uint8_t flags = options.routing && isRoutable(view) ? FRAME_FLAG_ROUTED : 0;
+    serializeFrame(view, out, options.format, flags, Encoding(options));
+    compressFrame(out, start, options);
+    checksumFrame(out, start, options);
+    return out.size() - start;
+}
+
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out, WireFormat format) {
+    return serializeBatchFrame(messages, out, format, Encoding());
+}
+
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out,
+                          const WireOptions& options) {
+    size_t start = out.size();
+    serializeBatchFrame(messages, out, options.format, Encoding(options));
+    if (out.size() > start) {
+        compressFrame(out, start, options);
+        checksumFrame(out, start, options);
+    }
+    return out.size() - start;
+}
+
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out,
+                          const WireOptions& options, NameDictionary& names) {
+    size_t start = out.size();
+    serializeBatchFrame(messages, out, options.format, Encoding(options, &names));
+    if (out.size() > start) {
+        compressFrame(out, start, options);
+        checksumFrame(out, start, options);
+    }
+    return out.size() - start;
+}
+
+std::vector<uint8_t> serializeBatch(const std::vector<Message>& messages, WireFormat format) {
+    std::vector<uint8_t> result;
+    serializeBatchInto(messages, result, format);
+    return result;
+}
+
+size_t serializeStreamHead(const Message& msg, std::vector<uint8_t>& out, WireFormat format) {
+    return serializeFrame(msg, out, format, FRAME_FLAG_MORE);
+}
+
+size_t serializeStreamChunk(const uint8_t* data, size_t length, bool last, std::vector<uint8_t>& out) {
+    if (length > MAX_FRAME_LENGTH) {
+        throw std::length_error("stream chunk exceeds MAX_FRAME_LENGTH");
+    }
+    size_t start = out.size();
+    out.resize(start + 4);
+    writeHeader(out.data() + start, static_cast<uint32_t>(length),
+                last ? FRAME_FLAG_CHUNK : (FRAME_FLAG_CHUNK | FRAME_FLAG_MORE));
+    out.insert(out.end(), data, data + length);
+    return 4 + length;
+}
+
+std::vector<uint8_t> serialize(const Message& msg, WireFormat format) {
+    std::vector<uint8_t> result;
+    result.reserve(4 + 96 + msg.sender.size() + msg.receiver.size() +
+                   msg.content.size() + msg.timestamp.size() + msg.extra.size());
+    serializeInto(msg, result, format);
+    return result;
+}
+
+std::vector<uint8_t> serialize(const Message& msg, const WireOptions& options) {
+    std::vector<uint8_t> result;
+    serializeInto(msg, result, options);
+    return result;
+}
+
+Message MessageView::toMessage() const {
+    Message msg(type);
+    msg.sender.assign(sender.data(), sender.size());
+    msg.receiver.assign(receiver.data(), receiver.size());
+    msg.content.assign(content.data(), content.size());
+    msg.timestamp.assign(timestamp.data(), timestamp.size());
+    msg.extra.assign(extra.data(), extra.size());
+    msg.requestId = requestId;
+    msg.asciiOnly = asciiOnly;
+    FieldReader reader(fields);
+    std::string_view field;
+    while (reader.next(field)) {
+        msg.fields.emplace_back(field);
+    }
+    msg.trace = trace;
+    return msg;
+}
+
+bool FieldReader::next(std::string_view& field) {
+    const uint8_t* p = p_;
+    uint64_t length;
+    if (!readVarint(p, end_, length) || length > static_cast<uint64_t>(end_ - p)) {
+        return false;
+    }
+    field = std::string_view(reinterpret_cast<const char*>(p), static_cast<size_t>(length));
+    p_ = p + length;
+    return true;
+}
+
+// ==================== ArenaMessage / MessageArena ====================
+
+ArenaMessage::ArenaMessage(const allocator_type& alloc)
+    : type(MessageType::OK), sender(alloc), receiver(alloc), content(alloc),
+      timestamp(alloc), extra(alloc), fields(alloc), requestId(0), asciiOnly(false) {}
+
+MessageView ArenaMessage::view() const {
+    MessageView view;
+    view.type = type;
+    view.sender = sender;
+    view.receiver = receiver;
+    view.content = content;
+    view.timestamp = timestamp;
+    view.extra = extra;
+    view.fields = fields;
+    view.requestId = requestId;
+    view.asciiOnly = asciiOnly;
+    view.trace = trace;
+    return view;
+}
+
+Message ArenaMessage::toMessage() const {
+    return view().toMessage();
+}
+
+// Largest block an arena keeps across reset(); a rare huge message must not
+// pin its memory on the connection forever
+static const size_t MAX_RETAINED_ARENA = 256 * 1024;
+
+void* MessageArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+    overflow += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void MessageArena::Upstream::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+bool MessageArena::Upstream::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+MessageArena::MessageArena(size_t initialSize)
+    : storage_(std::max<size_t>(initialSize, 256)) {
+    arena_.emplace(storage_.data(), storage_.size(), &upstream_);
+}
+
+ArenaMessage& MessageArena::materialize(const MessageView& view) {
+    void* p = arena_->allocate(sizeof(ArenaMessage), alignof(ArenaMessage));
+    ArenaMessage* msg = new (p) ArenaMessage(ArenaMessage::allocator_type(&*arena_));
+    msg->type = view.type;
+    msg->sender.assign(view.sender.data(), view.sender.size());
+    msg->receiver.assign(view.receiver.data(), view.receiver.size());
+    msg->content.assign(view.content.data(), view.content.size());
+    msg->timestamp.assign(view.timestamp.data(), view.timestamp.size());
+    msg->extra.assign(view.extra.data(), view.extra.size());
+    msg->fields.assign(view.fields.data(), view.fields.size());
+    msg->requestId = view.requestId;
+    msg->asciiOnly = view.asciiOnly;
+    msg->trace = view.trace;
+    return *msg;
+}
+
+void MessageArena::reset() {
+    // Messages are never destroyed one by one: their strings only hold
+    // arena memory, which is released here in one go
+    arena_.reset();
+
+    // Grow the inline block to this round's working set so the next
+    // round stays off the heap
+    if (upstream_.overflow > 0 && storage_.size() < MAX_RETAINED_ARENA) {
+        size_t grown = std::min(storage_.size() + upstream_.overflow, MAX_RETAINED_ARENA);
+        storage_ = std::vector<std::byte>(grown);
+    }
+    upstream_.overflow = 0;
+    arena_.emplace(storage_.data(), storage_.size(), &upstream_);
+}
+
+bool parseView(uint8_t* data, size_t length, MessageView& view, WireFormat format) {
+    return parseViewImpl(data, length, view, format) == nullptr;
+}
+
+namespace {
+
+// Decode a payload into a view. JSON is unescaped in place, so it is parsed
+// from a per-thread copy; the view stays valid until the next call on the
+// same thread.
+const char* decodePayloadView(const uint8_t* data, size_t length, WireFormat format, MessageView& view,
+                              NameDictionary* names = nullptr) {
+    if (format == WireFormat::BINARY) {
+        return decodeBinaryView(data, length, view, names);
+    }
+    bool ascii = true;
+    if (!checkUtf8(data, length, ascii)) {
+        return "invalid UTF-8";
+    }
+    thread_local std::vector<uint8_t> scratch;
+    scratch.assign(data, data + length);
+    return JsonViewParser(scratch.data(), length).parse(view, ascii);
+}
+
+} // namespace
+
+Message deserialize(const uint8_t* data, size_t length, WireFormat format) {
+    #ifdef PROTOCOL_DEBUG_LOG
+    std::cout << "[PROTOCOL] Deserialize: Length=" << length << " bytes" << std::endl;
+    #endif
+
+    MessageView view;
+    if (const char* error = decodePayloadView(data, length, format, view)) {
+        Message msg(MessageType::ERROR);
+        msg.content = std::string("Parse error: ") + error;
+
         #ifdef PROTOCOL_DEBUG_LOG
-        std::cout << "[PROTOCOL] Parsed: Type=" << messageTypeToString(msg.type) << std::endl;
+        std::cerr << "[PROTOCOL] Parse error: " << error << std::endl;
         #endif
-    } catch (const std::exception& e) {
+        return msg;
+    }
+
+    #ifdef PROTOCOL_DEBUG_LOG
+    std::cout << "[PROTOCOL] Parsed: Type=" << messageTypeName(view.type) << std::endl;
+    #endif
+
+    return view.toMessage();
+}
+
+ArenaMessage& deserialize(const uint8_t* data, size_t length, WireFormat format, MessageArena& arena) {
+    MessageView view;
+    if (const char* error = decodePayloadView(data, length, format, view)) {
+        ArenaMessage& msg = arena.materialize(MessageView());
         msg.type = MessageType::ERROR;
-        msg.content = std::string("Parse error: ") + e.what();
-        
-        #ifdef PROTOCOL_DEBUG_LOG
-        std::cerr << "[PROTOCOL] Parse error: " << e.what() << std::endl;
-        #endif
+        msg.content = "Parse error: ";
+        msg.content += error;
+        return msg;
     }
+    return arena.materialize(view);
+}
 
-    return msg;
+namespace {
+
+// Per-thread "HH:MM:SS" text, reformatted only when the second changes
+struct TimestampCache {
+    int64_t second;
+    char text[8];
+
+    TimestampCache() : second(INT64_MIN), text() {}
+};
+
+void writeTwoDigits(char* out, int value) {
+    out[0] = static_cast<char>('0' + value / 10);
+    out[1] = static_cast<char>('0' + value % 10);
 }
 
-std::string getCurrentTimestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto time_t_now = std::chrono::system_clock::to_time_t(now);
-    std::tm* tm_now = std::localtime(&time_t_now);
+} // namespace
 
-    std::ostringstream oss;
-    oss << std::setfill('0')
-        << std::setw(2) << tm_now->tm_hour << ":"
-        << std::setw(2) << tm_now->tm_min << ":"
-        << std::setw(2) << tm_now->tm_sec;
+int64_t getEpochMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-    return oss.str();
+uint64_t getEpochMicros() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
 }
 
-std::string messageTypeToString(MessageType type) {
-    switch (type) {
-        case MessageType::REGISTER: return "REGISTER";
-        case MessageType::LOGIN: return "LOGIN";
-        case MessageType::LOGOUT: return "LOGOUT";
-        case MessageType::CHANGE_PASSWORD: return "CHANGE_PASSWORD";
-        case MessageType::MSG_GLOBAL: return "MSG_GLOBAL";
-        case MessageType::MSG_PRIVATE: return "MSG_PRIVATE";
-        case MessageType::ONLINE_LIST: return "ONLINE_LIST";
-        case MessageType::USER_STATUS: return "USER_STATUS";
-        case MessageType::USER_INFO: return "USER_INFO";
-        case MessageType::KICK_USER: return "KICK_USER";
-        case MessageType::BAN_USER: return "BAN_USER";
-        case MessageType::UNBAN_USER: return "UNBAN_USER";
-        case MessageType::MUTE_USER: return "MUTE_USER";
-        case MessageType::UNMUTE_USER: return "UNMUTE_USER";
-        case MessageType::PROMOTE_USER: return "PROMOTE_USER";
-        case MessageType::DEMOTE_USER: return "DEMOTE_USER";
-        case MessageType::GET_ALL_USERS: return "GET_ALL_USERS";
-        case MessageType::GET_BANNED_LIST: return "GET_BANNED_LIST";
-        case MessageType::GET_MUTED_LIST: return "GET_MUTED_LIST";
-        case MessageType::KICKED: return "KICKED";
-        case MessageType::BANNED: return "BANNED";
-        case MessageType::MUTED: return "MUTED";
-        case MessageType::UNMUTED: return "UNMUTED";
-        case MessageType::OK: return "OK";
-        case MessageType::ERROR: return "ERROR";
-        case MessageType::PING: return "PING";
-        case MessageType::PONG: return "PONG";
-        default: return "UNKNOWN";
+std::string getCurrentTimestamp() {
+    thread_local TimestampCache cache;
+
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if (second != cache.second) {
+        // Reentrant localtime: the shared std::localtime buffer races between threads
+        std::time_t now = static_cast<std::time_t>(second);
+        std::tm local = {};
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        writeTwoDigits(cache.text, local.tm_hour);
+        cache.text[2] = ':';
+        writeTwoDigits(cache.text + 3, local.tm_min);
+        cache.text[5] = ':';
+        writeTwoDigits(cache.text + 6, local.tm_sec);
+        cache.second = second;
     }
+    return std::string(cache.text, sizeof(cache.text));
+}
+
+std::string messageTypeToString(MessageType type) {
+    return std::string(messageTypeName(type));
 }
 
 Message createOkResponse(const std::string& content, const std::string& extra) {
@@ -150,6 +1876,18 @@ Message createErrorResponse(const std::string& content) {
     return msg;
 }
 
+Message createOkResponse(const Message& request, const std::string& content, const std::string& extra) {
+    Message msg = createOkResponse(content, extra);
+    msg.requestId = request.requestId;
+    return msg;
+}
+
+Message createErrorResponse(const Message& request, const std::string& content) {
+    Message msg = createErrorResponse(content);
+    msg.requestId = request.requestId;
+    return msg;
+}
+
 Message createGlobalMessage(const std::string& sender, const std::string& content) {
     Message msg(MessageType::MSG_GLOBAL);
     msg.sender = sender;
@@ -169,8 +1907,7 @@ Message createPrivateMessage(const std::string& sender, const std::string& recei
 
 Message createOnlineListMessage(const std::vector<std::string>& users) {
     Message msg(MessageType::ONLINE_LIST);
-    json j = users;
-    msg.extra = j.dump();
+    msg.fields = users;
     msg.timestamp = getCurrentTimestamp();
     return msg;
 }
@@ -178,79 +1915,880 @@ Message createOnlineListMessage(const std::vector<std::string>& users) {
 Message createUserStatusMessage(const std::string& username, UserStatus status) {
     Message msg(MessageType::USER_STATUS);
     msg.sender = username;
-    msg.content = (status == UserStatus::ONLINE) ? "online" : "offline";
+    msg.fields.push_back((status == UserStatus::ONLINE) ? "online" : "offline");
     msg.timestamp = getCurrentTimestamp();
     return msg;
 }
 
-// MessageBuffer implementation
-// Maximum message size: 1MB (to prevent memory issues with malformed data)
+static Message createCredentialsMessage(MessageType type, const std::string& first, const std::string& second) {
+    Message msg(type);
+    msg.fields = {first, second};
+    msg.timestamp = getCurrentTimestamp();
+    return msg;
+}
+
+Message createLoginMessage(const std::string& username, const std::string& password) {
+    return createCredentialsMessage(MessageType::LOGIN, username, password);
+}
+
+Message createRegisterMessage(const std::string& username, const std::string& password) {
+    return createCredentialsMessage(MessageType::REGISTER, username, password);
+}
+
+Message createChangePasswordMessage(const std::string& oldPassword, const std::string& newPassword) {
+    return createCredentialsMessage(MessageType::CHANGE_PASSWORD, oldPassword, newPassword);
+}
+
+Message createAdminCommand(MessageType type, const std::string& target) {
+    Message msg(type);
+    msg.receiver = target;
+    msg.timestamp = getCurrentTimestamp();
+    return msg;
+}
+
+// Typed payload readers: prefer the fields, fall back to the legacy
+// JSON-in-string form sent by peers without typed payloads
+
+static bool parseFieldPair(const Message& msg, const char* firstKey, const char* secondKey,
+                           std::string& first, std::string& second) {
+    if (msg.fields.size() >= 2) {
+        first = msg.fields[0];
+        second = msg.fields[1];
+        return true;
+    }
+    try {
+        json j = json::parse(msg.content);
+        if (!j.is_object() || !j.contains(firstKey) || !j[firstKey].is_string() ||
+            !j.contains(secondKey) || !j[secondKey].is_string()) {
+            return false;
+        }
+        first = j[firstKey].get<std::string>();
+        second = j[secondKey].get<std::string>();
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+bool parseCredentials(const Message& msg, std::string& username, std::string& password) {
+    if (msg.type != MessageType::LOGIN && msg.type != MessageType::REGISTER) {
+        return false;
+    }
+    return parseFieldPair(msg, "username", "password", username, password);
+}
+
+bool parsePasswordChange(const Message& msg, std::string& oldPassword, std::string& newPassword) {
+    if (msg.type != MessageType::CHANGE_PASSWORD) {
+        return false;
+    }
+    return parseFieldPair(msg, "oldPassword", "newPassword", oldPassword, newPassword);
+}
+
+bool parseOnlineList(const Message& msg, std::vector<std::string>& users) {
+    if (msg.type != MessageType::ONLINE_LIST) {
+        return false;
+    }
+    if (!msg.fields.empty() || msg.extra.empty()) {
+        users = msg.fields;
+        return true;
+    }
+    try {
+        json j = json::parse(msg.extra);
+        if (!j.is_array()) {
+            return false;
+        }
+        users.clear();
+        for (const auto& user : j) {
+            if (!user.is_string()) {
+                return false;
+            }
+            users.push_back(user.get<std::string>());
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+bool parseUserStatus(const Message& msg, UserStatus& status) {
+    if (msg.type != MessageType::USER_STATUS) {
+        return false;
+    }
+    std::string value;
+    if (!msg.fields.empty()) {
+        value = msg.fields[0];
+    } else if (!msg.content.empty()) {
+        value = msg.content;
+    } else {
+        try {
+            json j = json::parse(msg.extra);
+            if (!j.is_object() || !j.contains("status") || !j["status"].is_string()) {
+                return false;
+            }
+            value = j["status"].get<std::string>();
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    if (value != "online" && value != "offline") {
+        return false;
+    }
+    status = (value == "online") ? UserStatus::ONLINE : UserStatus::OFFLINE;
+    return true;
+}
+
+// Capability negotiation
+
+// Default maximum message size: 1MB (to prevent memory issues with malformed data)
 static const uint32_t MAX_MESSAGE_SIZE = 1024 * 1024;
 
-MessageBuffer::MessageBuffer() {}
+// Smaller payloads gain too little from compression to pay for the CPU time
+static const uint32_t DEFAULT_COMPRESSION_THRESHOLD = 512;
 
-void MessageBuffer::append(const uint8_t* data, size_t length) {
-    buffer_.insert(buffer_.end(), data, data + length);
+WireOptions::WireOptions()
+    : version(PROTOCOL_VERSION), format(WireFormat::JSON), compression(false),
+      compressionThreshold(0), batching(false), streaming(false), maxFrameSize(MAX_MESSAGE_SIZE), tracing(false),
+      typedPayloads(false), routing(false), nameDictionary(false), requestIds(false),
+      checksums(false) {}
+
+WireOptions WireOptions::supported() {
+    WireOptions options;
+    options.format = WireFormat::BINARY;
+    options.batching = true;
+    options.streaming = true;
+    options.tracing = true;
+    options.typedPayloads = true;
+    options.routing = true;
+    options.nameDictionary = true;
+    options.requestIds = true;
+    options.checksums = true;
+#ifdef PROTOCOL_HAVE_ZLIB
+    options.compression = true;
+    options.compressionThreshold = DEFAULT_COMPRESSION_THRESHOLD;
+#endif
+    return options;
 }
 
-bool MessageBuffer::hasCompleteMessage() const {
-    // Need at least 4 bytes for length prefix
-    if (buffer_.size() < 4) {
+static Message createHandshakeMessage(MessageType type, const WireOptions& options, bool offer) {
+    json codecs = json::array();
+    if (offer || options.format == WireFormat::JSON) {
+        codecs.push_back("json");
+    }
+    if (options.format == WireFormat::BINARY) {
+        codecs.push_back("binary");
+    }
+
+    json j;
+    j["version"] = options.version;
+    j["codecs"] = codecs;
+    j["compression"] = options.compression;
+    j["compressionThreshold"] = options.compressionThreshold;
+    j["batching"] = options.batching;
+    j["streaming"] = options.streaming;
+    j["maxFrameSize"] = options.maxFrameSize;
+    j["tracing"] = options.tracing;
+    j["typedPayloads"] = options.typedPayloads;
+    j["routing"] = options.routing;
+    j["nameDictionary"] = options.nameDictionary;
+    j["requestIds"] = options.requestIds;
+    j["checksums"] = options.checksums;
+
+    Message msg(type);
+    msg.extra = j.dump();
+    msg.timestamp = getCurrentTimestamp();
+    return msg;
+}
+
+Message createHelloMessage(const WireOptions& offered) {
+    return createHandshakeMessage(MessageType::HELLO, offered, true);
+}
+
+Message createHelloAckMessage(const WireOptions& agreed) {
+    return createHandshakeMessage(MessageType::HELLO_ACK, agreed, false);
+}
+
+bool parseWireOptions(const Message& msg, WireOptions& options) {
+    if (msg.type != MessageType::HELLO && msg.type != MessageType::HELLO_ACK) {
+        return false;
+    }
+
+    options = WireOptions();
+    try {
+        json j = json::parse(msg.extra);
+        if (!j.is_object()) {
+            return false;
+        }
+
+        options.version = j.value("version", 1u);
+        options.format = WireFormat::JSON;
+        if (j.contains("codecs") && j["codecs"].is_array()) {
+            for (const auto& codec : j["codecs"]) {
+                if (codec == "binary") {
+                    options.format = WireFormat::BINARY;
+                }
+            }
+        }
+        options.compression = j.value("compression", false);
+        options.compressionThreshold = j.value("compressionThreshold", 0u);
+        options.batching = j.value("batching", false);
+        options.streaming = j.value("streaming", false);
+        options.maxFrameSize = std::min(j.value("maxFrameSize", MAX_MESSAGE_SIZE), MAX_FRAME_LENGTH);
+        options.tracing = j.value("tracing", false);
+        options.typedPayloads = j.value("typedPayloads", false);
+        options.routing = j.value("routing", false);
+        options.nameDictionary = j.value("nameDictionary", false);
+        options.requestIds = j.value("requestIds", false);
+        options.checksums = j.value("checksums", false);
+    } catch (const std::exception&) {
+        options = WireOptions();
+        return false;
+    }
+    return true;
+}
+
+WireOptions negotiate(const WireOptions& local, const WireOptions& remote) {
+    WireOptions agreed;
+    agreed.version = std::min(local.version, remote.version);
+    agreed.format = std::min(local.format, remote.format);
+    agreed.compression = local.compression && remote.compression;
+    agreed.compressionThreshold = std::max(local.compressionThreshold, remote.compressionThreshold);
+    agreed.batching = local.batching && remote.batching;
+    agreed.streaming = local.streaming && remote.streaming;
+    agreed.maxFrameSize = std::min(local.maxFrameSize, remote.maxFrameSize);
+    agreed.tracing = local.tracing && remote.tracing;
+    agreed.typedPayloads = local.typedPayloads && remote.typedPayloads;
+    agreed.routing = local.routing && remote.routing;
+    agreed.nameDictionary = local.nameDictionary && remote.nameDictionary;
+    agreed.requestIds = local.requestIds && remote.requestIds;
+    agreed.checksums = local.checksums && remote.checksums;
+    return agreed;
+}
+
+// Name dictionary
+
+int NameDictionary::encode(std::string_view name, uint32_t& id) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) {
+        id = it->second;
+        return 0;
+    }
+    if (names_.size() >= MAX_NAME_DICTIONARY) {
+        return -1;
+    }
+    id = static_cast<uint32_t>(names_.size());
+    names_.emplace_back(name);
+    ids_.emplace(names_.back(), id);
+    return 1;
+}
+
+bool NameDictionary::define(uint32_t id, std::string_view name) {
+    if (id < names_.size()) {
+        return names_[id] == name;
+    }
+    if (id != names_.size() || id >= MAX_NAME_DICTIONARY) {
+        return false;
+    }
+    names_.emplace_back(name);
+    return true;
+}
+
+bool NameDictionary::resolve(uint32_t id, std::string_view& name) const {
+    if (id >= names_.size()) {
+        return false;
+    }
+    name = names_[id];
+    return true;
+}
+
+void NameDictionary::truncate(size_t size) {
+    while (names_.size() > size) {
+        ids_.erase(names_.back());
+        names_.pop_back();
+    }
+}
+
+// Routing
+
+void RouteHeader::applyTo(Message& msg) const {
+    msg.type = type;
+    msg.sender.assign(sender.data(), sender.size());
+    msg.receiver.assign(receiver.data(), receiver.size());
+    msg.asciiOnly = msg.asciiOnly && isAscii(sender) && isAscii(receiver);
+    if ((flags & ROUTE_FLAG_TIMESTAMP) != 0) {
+        msg.timestamp.assign(timestamp.data(), timestamp.size());
+        msg.asciiOnly = msg.asciiOnly && isAscii(timestamp);
+    }
+}
+
+void RouteHeader::applyTo(MessageView& view) const {
+    view.type = type;
+    view.sender = sender;
+    view.receiver = receiver;
+    view.asciiOnly = view.asciiOnly && isAscii(sender) && isAscii(receiver);
+    if ((flags & ROUTE_FLAG_TIMESTAMP) != 0) {
+        view.timestamp = timestamp;
+        view.asciiOnly = view.asciiOnly && isAscii(timestamp);
+    }
+}
+
+bool canForwardVerbatim(const RouteHeader& route, const WireOptions& from, const WireOptions& to) {
+    return to.routing && to.format == from.format && to.checksums == from.checksums &&
+           route.frameLength <= to.maxFrameSize;
+}
+
+// Latency histogram
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::record(uint64_t micros) {
+    int index = 0;
+    for (uint64_t v = micros; v != 0 && index < BUCKET_COUNT - 1; v >>= 1) {
+        ++index;
+    }
+    ++buckets_[index];
+    ++count_;
+    sum_ += micros;
+    max_ = std::max(max_, micros);
+}
+
+bool LatencyHistogram::recordTrace(const TraceStamps& trace, uint64_t nowMicros) {
+    if (trace.clientSend == 0) {
         return false;
     }
+    // Clocks of different hosts may disagree; clamp instead of wrapping
+    record(nowMicros > trace.clientSend ? nowMicros - trace.clientSend : 0);
+    return true;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(int index) {
+    if (index >= BUCKET_COUNT - 1) {
+        return UINT64_MAX;
+    }
+    return index == 0 ? 0 : (uint64_t(1) << index) - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    double rank = std::clamp(percent, 0.0, 100.0) / 100.0 * static_cast<double>(count_);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; ++i) {
+        seen += buckets_[i];
+        if (seen > 0 && static_cast<double>(seen) >= rank) {
+            return std::min(bucketUpperBound(i), max_);
+        }
+    }
+    return max_;
+}
+
+void LatencyHistogram::reset() {
+    std::fill(std::begin(buckets_), std::end(buckets_), uint64_t(0));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+// MessageBuffer implementation
+// Initial storage; grows by doubling when a frame does not fit
+static const size_t INITIAL_BUFFER_CAPACITY = 8192;
+
+// Flags a MessageBuffer knows how to handle
+#ifdef PROTOCOL_HAVE_ZLIB
+static const uint8_t SUPPORTED_FRAME_FLAGS =
+    FRAME_FLAG_ROUTED | FRAME_FLAG_MORE | FRAME_FLAG_CHUNK | FRAME_FLAG_BATCH | FRAME_FLAG_COMPRESSED;
+#else
+static const uint8_t SUPPORTED_FRAME_FLAGS =
+    FRAME_FLAG_ROUTED | FRAME_FLAG_MORE | FRAME_FLAG_CHUNK | FRAME_FLAG_BATCH;
+#endif
+
+// A lost connection gives up searching for the next good frame after
+// skipping or checksumming this many max-size frames' worth of bytes
+static const size_t RESYNC_BUDGET_FRAMES = 4;
+
+MessageBuffer::MessageBuffer()
+    : head_(0), tail_(0), pendingLength_(0), pendingFlags_(0), pendingKnown_(false), pendingVerified_(false),
+      batchOffset_(0), inflatedUsed_(0), frameInflated_(false), maxMessageSize_(MAX_MESSAGE_SIZE),
+      streaming_(false), format_(WireFormat::JSON), checksums_(false), resyncWork_(0), resyncCount_(0) {}
+
+void MessageBuffer::append(const uint8_t* data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    std::memcpy(prepareWrite(length), data, length);
+    tail_ += length;
+    resync();
+}
 
-    // Read length (big-endian)
-    uint32_t length = (static_cast<uint32_t>(buffer_[0]) << 24) |
-                      (static_cast<uint32_t>(buffer_[1]) << 16) |
-                      (static_cast<uint32_t>(buffer_[2]) << 8) |
-                      static_cast<uint32_t>(buffer_[3]);
+uint8_t* MessageBuffer::prepareWrite(size_t minSize) {
+    recycleInflated();
+    if (buffer_.size() - tail_ < minSize) {
+        size_t live = tail_ - head_;
+        if (head_ >= live && buffer_.size() - live >= minSize) {
+            // Compact in place: moves no more bytes than were consumed
+            std::memmove(buffer_.data(), buffer_.data() + head_, live);
+        } else {
+            // Grow, dropping the consumed prefix in the same copy
+            size_t capacity = std::max({buffer_.size() * 2, live + minSize, INITIAL_BUFFER_CAPACITY});
+            std::vector<uint8_t> grown(capacity);
+            if (live > 0) {
+                std::memcpy(grown.data(), buffer_.data() + head_, live);
+            }
+            buffer_.swap(grown);
+        }
+        head_ = 0;
+        tail_ = live;
+    }
+    return buffer_.data() + tail_;
+}
+
+void MessageBuffer::commitWrite(size_t length) {
+    tail_ += std::min(length, writableSize());
+    resync();
+}
+
+void MessageBuffer::configure(const WireOptions& options) {
+    format_ = options.format;
+    setMaxMessageSize(options.maxFrameSize);
+    if (checksums_ != options.checksums) {
+        checksums_ = options.checksums;
+        pendingVerified_ = false;
+        resync();
+    }
+}
+
+void MessageBuffer::setMaxMessageSize(uint32_t maxSize) {
+    maxMessageSize_ = std::min(maxSize, MAX_FRAME_LENGTH);
+}
+
+bool MessageBuffer::peekHeader(uint32_t& length, uint8_t& flags) const {
+    if (!pendingKnown_) {
+        // Need at least 4 bytes for length prefix
+        if (size() < 4) {
+            return false;
+        }
+
+        // Read flags and 24-bit length (big-endian)
+        const uint8_t* header = buffer_.data() + head_;
+        pendingFlags_ = header[0];
+        pendingLength_ = (static_cast<uint32_t>(header[1]) << 16) |
+                         (static_cast<uint32_t>(header[2]) << 8) |
+                         static_cast<uint32_t>(header[3]);
+        pendingKnown_ = true;
+    }
+    length = pendingLength_;
+    flags = pendingFlags_;
+    return true;
+}
 
+bool MessageBuffer::isAcceptable(uint32_t length, uint8_t flags) const {
     // Validate message length to prevent overflow and memory issues
-    if (length > MAX_MESSAGE_SIZE) {
-        return false;  // Invalid message, will be handled in extractMessage
+    if (length > maxMessageSize_ || (flags & ~SUPPORTED_FRAME_FLAGS) != 0) {
+        return false;
+    }
+    // Routed frames stand alone so relays can forward them untouched
+    if ((flags & FRAME_FLAG_ROUTED) != 0) {
+        return flags == FRAME_FLAG_ROUTED && length > 0;
+    }
+    // Chunks are raw bytes; compressed frames always carry a length and stream
+    if ((flags & FRAME_FLAG_COMPRESSED) != 0 && ((flags & FRAME_FLAG_CHUNK) != 0 || length == 0)) {
+        return false;
+    }
+    // Batches hold whole messages only and cannot be empty
+    if ((flags & FRAME_FLAG_BATCH) != 0) {
+        return (flags & (FRAME_FLAG_MORE | FRAME_FLAG_CHUNK)) == 0 && length > 0;
+    }
+    return true;
+}
+
+bool MessageBuffer::hasCompleteFrame() const {
+    uint32_t length;
+    uint8_t flags;
+    if (!peekHeader(length, flags) || !isAcceptable(length, flags)) {
+        return false;  // Invalid frames are handled in extractMessage
+    }
+    if (checksums_) {
+        return pendingVerified_;  // Set by resync() once the whole frame is in
+    }
+    return size() >= (4 + static_cast<size_t>(length));
+}
+
+void MessageBuffer::consume(uint32_t length) {
+    head_ += 4 + static_cast<size_t>(length) + (checksums_ ? CHECKSUM_SIZE : 0);
+    pendingKnown_ = false;
+    pendingVerified_ = false;
+    frameInflated_ = false;  // Its payload stays in the pool for outstanding views
+
+    // Rewind the cursors for free once everything has been consumed
+    if (head_ == tail_) {
+        head_ = 0;
+        tail_ = 0;
+    }
+    resync();
+}
+
+void MessageBuffer::resync() {
+    uint32_t length;
+    uint8_t flags;
+    if (!checksums_ || pendingVerified_ || !peekHeader(length, flags)) {
+        return;
+    }
+    if (resyncWork_ == 0) {
+        // In sync: the frame at the read cursor is the next one
+        if (isAcceptable(length, flags)) {
+            size_t frameSize = 4 + static_cast<size_t>(length);
+            if (size() < frameSize + CHECKSUM_SIZE) {
+                return;  // Judge it once the trailer is in
+            }
+            const uint8_t* frame = buffer_.data() + head_;
+            if (crc32c(frame, frameSize) == readBigEndian32(frame + frameSize)) {
+                pendingVerified_ = true;
+                return;
+            }
+        }
+        // Corrupt frame or garbage; whatever stream was in progress lost a frame
+        ++resyncCount_;
+        resyncWork_ = 1;
+        streaming_ = false;
+    }
+
+    // Lost: take the first position holding a whole frame that checks out.
+    // A plausible header whose frame is still incomplete does not hold up
+    // the search (a corrupt length could make it wait for a megabyte), but
+    // the read cursor stops there in case it turns out to be the real one.
+    size_t budget = RESYNC_BUDGET_FRAMES * (static_cast<size_t>(maxMessageSize_) + 8);
+    bool conclusive = true;
+    for (size_t p = head_; p + 4 + CHECKSUM_SIZE <= tail_; ++p) {
+        const uint8_t* frame = buffer_.data() + p;
+        uint32_t candidate = (static_cast<uint32_t>(frame[1]) << 16) |
+                             (static_cast<uint32_t>(frame[2]) << 8) |
+                             static_cast<uint32_t>(frame[3]);
+        ++resyncWork_;
+        if (isAcceptable(candidate, frame[0])) {
+            size_t frameSize = 4 + static_cast<size_t>(candidate);
+            if (p + frameSize + CHECKSUM_SIZE <= tail_) {
+                resyncWork_ += frameSize;
+                if (crc32c(frame, frameSize) == readBigEndian32(frame + frameSize)) {
+                    head_ = p;
+                    pendingKnown_ = false;
+                    pendingVerified_ = true;
+                    resyncWork_ = 0;
+                    return;
+                }
+            } else {
+                conclusive = false;
+            }
+        }
+        if (conclusive) {
+            head_ = p + 1;  // No frame can start at or before p
+        }
+        if (resyncWork_ > budget) {
+            head_ = tail_;  // Out of budget: drop what is buffered and start over on new data
+            resyncWork_ = 1;
+            break;
+        }
+    }
+    pendingKnown_ = false;
+    if (head_ == tail_) {
+        head_ = 0;
+        tail_ = 0;
+    }
+}
+
+bool MessageBuffer::hasCompleteMessage() const {
+    return hasCompleteFrame() && (pendingFlags_ & FRAME_FLAG_CHUNK) == 0;
+}
+
+const char* MessageBuffer::inflateFrame() const {
+    if (inflatedUsed_ == inflated_.size()) {
+        inflated_.emplace_back();
+    }
+    std::vector<uint8_t>& block = inflated_[inflatedUsed_];
+    const char* error = inflatePayload(buffer_.data() + head_ + 4, pendingLength_, maxMessageSize_, block);
+    if (error != nullptr) {
+        return error;
+    }
+    ++inflatedUsed_;
+    frameInflated_ = true;
+    return nullptr;
+}
+
+uint8_t* MessageBuffer::frameBody() const {
+    if (frameInflated_) {
+        return inflated_[inflatedUsed_ - 1].data();
+    }
+    return const_cast<uint8_t*>(buffer_.data()) + head_ + 4;
+}
+
+uint32_t MessageBuffer::frameBodyLength() const {
+    return frameInflated_ ? static_cast<uint32_t>(inflated_[inflatedUsed_ - 1].size()) : pendingLength_;
+}
+
+void MessageBuffer::recycleInflated() {
+    // Keep only the payload of a partly extracted compressed batch
+    if (frameInflated_) {
+        inflated_[0].swap(inflated_[inflatedUsed_ - 1]);
+        inflatedUsed_ = 1;
+    } else {
+        inflatedUsed_ = 0;
     }
+}
+
+const char* MessageBuffer::locateMessage(size_t& offset, uint32_t& length, RouteHeader* route) const {
+    if ((pendingFlags_ & FRAME_FLAG_COMPRESSED) != 0 && !frameInflated_) {
+        if (const char* error = inflateFrame()) {
+            return error;
+        }
+    }
+
+    uint32_t bodyLength = frameBodyLength();
+    if ((pendingFlags_ & FRAME_FLAG_ROUTED) != 0) {
+        RouteHeader header;
+        size_t headerLength = readRouteHeader(frameBody(), bodyLength, header);
+        if (headerLength == 0) {
+            return "Malformed route header";
+        }
+        header.frameLength = bodyLength;
+        if (route != nullptr) {
+            *route = header;
+        }
+        offset = headerLength;
+        length = static_cast<uint32_t>(bodyLength - headerLength);
+        return nullptr;
+    }
+    if ((pendingFlags_ & FRAME_FLAG_BATCH) == 0) {
+        offset = 0;
+        length = bodyLength;
+        return nullptr;
+    }
+
+    // Batch entry: [flags = 0][24-bit length][payload]
+    size_t remaining = bodyLength - batchOffset_;
+    if (remaining < 4) {
+        return "Malformed batch frame";
+    }
+    const uint8_t* entry = frameBody() + batchOffset_;
+    length = (static_cast<uint32_t>(entry[1]) << 16) |
+             (static_cast<uint32_t>(entry[2]) << 8) |
+             static_cast<uint32_t>(entry[3]);
+    if (entry[0] != 0 || length > remaining - 4) {
+        return "Malformed batch frame";
+    }
+    offset = batchOffset_ + 4;
+    return nullptr;
+}
+
+void MessageBuffer::consumeMessage(uint32_t length) {
+    if ((pendingFlags_ & FRAME_FLAG_BATCH) != 0) {
+        batchOffset_ += 4 + static_cast<size_t>(length);
+        if (batchOffset_ < frameBodyLength()) {
+            return;  // More entries left in this batch
+        }
+        batchOffset_ = 0;
+    }
+    streaming_ = (pendingFlags_ & FRAME_FLAG_MORE) != 0;
+    consume(pendingLength_);
+}
 
-    // Check if we have complete message
-    return buffer_.size() >= (4 + static_cast<size_t>(length));
+void MessageBuffer::dropFrame() {
+    batchOffset_ = 0;
+    consume(pendingLength_);
 }
 
 Message MessageBuffer::extractMessage() {
-    // Need at least 4 bytes for length prefix
-    if (buffer_.size() < 4) {
+    uint32_t length;
+    uint8_t flags;
+    if (!peekHeader(length, flags)) {
         return Message(MessageType::ERROR);
     }
 
-    // Read length
-    uint32_t length = (static_cast<uint32_t>(buffer_[0]) << 24) |
-                      (static_cast<uint32_t>(buffer_[1]) << 16) |
-                      (static_cast<uint32_t>(buffer_[2]) << 8) |
-                      static_cast<uint32_t>(buffer_[3]);
-
-    // Validate message length
-    if (length > MAX_MESSAGE_SIZE) {
-        // Invalid message - clear buffer and return error
-        buffer_.clear();
+    // Validate message length and flags
+    if (!isAcceptable(length, flags)) {
+        // Invalid message - drop the buffered bytes and return error
+        discardBuffered();
         Message msg(MessageType::ERROR);
         msg.content = "Message too large or invalid";
         return msg;
     }
 
-    // Check if we have the complete message
-    if (buffer_.size() < 4 + static_cast<size_t>(length)) {
+    // Check if we have the complete message (chunks go through extractChunk)
+    if (!hasCompleteMessage()) {
         return Message(MessageType::ERROR);
     }
 
-    // Parse message
-    Message msg = deserialize(buffer_.data() + 4, length);
+    size_t offset;
+    RouteHeader route;
+    if (const char* error = locateMessage(offset, length, &route)) {
+        dropFrame();
+        Message msg(MessageType::ERROR);
+        msg.content = error;
+        return msg;
+    }
 
-    // Remove processed data from buffer
-    buffer_.erase(buffer_.begin(), buffer_.begin() + 4 + static_cast<ptrdiff_t>(length));
+    // Parse message, then consume it. Routed bodies come from another
+    // connection, so they cannot reference this one's name dictionary.
+    bool routed = (flags & FRAME_FLAG_ROUTED) != 0;
+    MessageView view;
+    Message msg;
+    if (const char* error = decodePayloadView(frameBody() + offset, length, format_, view,
+                                              routed ? nullptr : &names_)) {
+        msg.type = MessageType::ERROR;
+        msg.content = std::string("Parse error: ") + error;
+    } else {
+        msg = view.toMessage();
+        if (routed) {
+            route.applyTo(msg);
+        }
+    }
+    consumeMessage(length);
 
     return msg;
 }
 
+ArenaMessage* MessageBuffer::extractMessage(MessageArena& arena) {
+    MessageView view;
+    if (!extractView(view)) {
+        return nullptr;
+    }
+    return &arena.materialize(view);
+}
+
+bool MessageBuffer::extractView(MessageView& view) {
+    uint32_t length;
+    uint8_t flags;
+    if (!peekHeader(length, flags)) {
+        return false;
+    }
+
+    if (!isAcceptable(length, flags)) {
+        discardBuffered();
+        view = MessageView();
+        view.type = MessageType::ERROR;
+        view.content = "Message too large or invalid";
+        return true;
+    }
+
+    if (!hasCompleteMessage()) {
+        return false;
+    }
+
+    size_t offset;
+    RouteHeader route;
+    if (const char* error = locateMessage(offset, length, &route)) {
+        dropFrame();
+        view = MessageView();
+        view.type = MessageType::ERROR;
+        view.content = error;
+        return true;
+    }
+
+    // Parse in place; the frame bytes stay put until the next write
+    uint8_t* payload = frameBody() + offset;
+    bool routed = (flags & FRAME_FLAG_ROUTED) != 0;
+    consumeMessage(length);
+    if (parseViewImpl(payload, length, view, format_, routed ? nullptr : &names_) != nullptr) {
+        view = MessageView();
+        view.type = MessageType::ERROR;
+        view.content = "Parse error: malformed payload";
+    } else if (routed) {
+        route.applyTo(view);
+    }
+    return true;
+}
+
+bool MessageBuffer::hasStreamChunk() const {
+    return hasCompleteFrame() && (pendingFlags_ & FRAME_FLAG_CHUNK) != 0;
+}
+
+bool MessageBuffer::extractChunk(StreamChunk& chunk) {
+    if (!hasStreamChunk()) {
+        return false;
+    }
+
+    uint32_t length = pendingLength_;
+    uint8_t flags = pendingFlags_;
+    const uint8_t* payload = buffer_.data() + head_ + 4;
+    consume(length);
+
+    // Chunks without a preceding stream head are dropped
+    if (!streaming_) {
+        return false;
+    }
+
+    chunk.data = payload;
+    chunk.size = length;
+    chunk.last = (flags & FRAME_FLAG_MORE) == 0;
+    streaming_ = !chunk.last;
+    return true;
+}
+
+bool MessageBuffer::peekFrame(const uint8_t*& payload, size_t& length) const {
+    size_t offset;
+    uint32_t messageLength;
+    if (!hasCompleteMessage() || locateMessage(offset, messageLength) != nullptr) {
+        return false;
+    }
+    payload = frameBody() + offset;
+    length = messageLength;
+    return true;
+}
+
+void MessageBuffer::skipFrame() {
+    if (!hasCompleteFrame()) {
+        return;
+    }
+
+    size_t offset;
+    uint32_t length;
+    if ((pendingFlags_ & FRAME_FLAG_CHUNK) == 0 && locateMessage(offset, length) == nullptr) {
+        consumeMessage(length);
+    } else {
+        dropFrame();
+    }
+}
+
+bool MessageBuffer::peekRoute(RouteHeader& route) const {
+    size_t offset;
+    uint32_t length;
+    return hasCompleteMessage() && (pendingFlags_ & FRAME_FLAG_ROUTED) != 0 &&
+           locateMessage(offset, length, &route) == nullptr;
+}
+
+size_t MessageBuffer::takeFrame(std::vector<uint8_t>& out) {
+    if (batchOffset_ != 0 || !hasCompleteFrame()) {
+        return 0;
+    }
+
+    size_t frameSize = 4 + static_cast<size_t>(pendingLength_) + (checksums_ ? CHECKSUM_SIZE : 0);
+    const uint8_t* frame = buffer_.data() + head_;
+    out.insert(out.end(), frame, frame + frameSize);
+    streaming_ = (pendingFlags_ & FRAME_FLAG_MORE) != 0;
+    consume(pendingLength_);
+    return frameSize;
+}
+
+void MessageBuffer::discardBuffered() {
+    head_ = 0;
+    tail_ = 0;
+    pendingKnown_ = false;
+    pendingVerified_ = false;
+    batchOffset_ = 0;
+    frameInflated_ = false;
+}
+
 void MessageBuffer::clear() {
-    buffer_.clear();
+    head_ = 0;
+    tail_ = 0;
+    pendingKnown_ = false;
+    pendingVerified_ = false;
+    resyncWork_ = 0;
+    batchOffset_ = 0;
+    inflatedUsed_ = 0;
+    frameInflated_ = false;
+    streaming_ = false;
+    names_.clear();
 }
 
 } // namespace Protocol
@@ -3,67 +3,290 @@
  * @brief Định nghĩa protocol cho giao tiếp client-server
  *
  * Protocol Format:
- * [4 bytes: message length][JSON payload]
+ * [4 bytes: message length][payload]
  *
- * Message Types:
+ * The high byte of the length prefix carries frame flags (see FRAME_FLAG_*),
+ * leaving 24 bits of length. Legacy frames are far below that limit, so
+ * their flag byte is always zero.
+ *
+ * Payload encodings (selected per connection, see WireFormat):
+ * - JSON:   {"content":..,"extra":..,"receiver":..,"sender":..,"timestamp":..,"type":N}
+ * - BINARY: [1 byte type][1 byte flags][sender][receiver][content][timestamp][extra]
+ *           where each string field is [varint length][UTF-8 bytes]
+ *
+ * Trace stamps (see TraceStamps) are optional: a "trace" object in JSON,
+ * three trailing varints in BINARY (flags bit 0x01). They are only sent on
+ * connections that agreed on tracing.
+ *
+ * Typed payloads (Message::fields) replace JSON-in-a-string for LOGIN,
+ * REGISTER, CHANGE_PASSWORD, ONLINE_LIST and USER_STATUS. In BINARY they
+ * follow extra as [varint size][[varint length][UTF-8 bytes]...] (flags bit
+ * 0x02) on connections that agreed on typed payloads; everywhere else the
+ * message is sent in its legacy form ({"username","password"} in content,
+ * a JSON array of names in extra, ...).
+ *
+ * Request ids (Message::requestId) let a client pipeline requests: the
+ * server copies the id of a request into the OK / ERROR answering it (see
+ * createOkResponse). JSON carries a non-zero id as "requestId", which
+ * older peers ignore; BINARY carries it as a varint after the typed fields
+ * (flags bit 0x08), only on connections that agreed on request ids.
+ *
+ * Name dictionary (see NameDictionary): on BINARY connections that agreed
+ * on it, flags bit 0x04 replaces the sender string with
+ * varint((id << 1) | define), followed by the name only when define is
+ * set. The first frame carrying a name defines its id, later ones just
+ * reference it. Routed frames never use it.
+ *
+ * Every string is UTF-8. Decoders reject a payload holding malformed
+ * UTF-8 before anything is allocated for it, and mark messages whose
+ * strings are all 7-bit ASCII (Message::asciiOnly).
+ *
+ * A compressed frame (FRAME_FLAG_COMPRESSED) carries
+ * [varint uncompressed length][zlib stream] in place of its payload; the
+ * inflated bytes are exactly what the uncompressed frame would hold.
+ *
+ * Checksums: on connections that agreed on them, every frame (batch and
+ * stream frames included) is followed by a 4-byte big-endian CRC-32C of
+ * its header and payload. The trailer is not counted in the length. A
+ * receiver that finds a bad checksum skips ahead to the next frame that
+ * checks out instead of dropping the connection (see MessageBuffer).
+ *
+ * A routed frame (FRAME_FLAG_ROUTED) starts its payload with a route header
+ * [1 byte type][1 byte route flags][sender][receiver] (string fields as in
+ * BINARY) ahead of the normal payload, so a relay can forward it without
+ * decoding the body. The route header is authoritative: its type, sender
+ * and receiver override the body's. Senders send route flags 0; a relay
+ * sets ROUTE_FLAG_TIMESTAMP and appends its own [timestamp] string, which
+ * overrides the one the sender wrote in the body. Routed frames are never
+ * batched, streamed or compressed; only MSG_PRIVATE is routed today.
+ *
+ * Message Types (full list in PROTOCOL_MESSAGE_TYPES):
  * - REGISTER, LOGIN, LOGOUT, CHANGE_PASSWORD
  * - MSG_GLOBAL, MSG_PRIVATE
  * - ONLINE_LIST, USER_STATUS
  * - OK, ERROR
+ * - HELLO, HELLO_ACK (capability negotiation)
+ * Payloads with a type outside that list are rejected as malformed.
+ *
+ * Handshake:
+ * A client that wants any wire feature beyond plain JSON sends HELLO as its
+ * first frame and waits for HELLO_ACK before sending anything else. Both
+ * frames are always JSON. The server switches to the agreed options right
+ * after sending HELLO_ACK, the client right after receiving it. Clients
+ * that never send HELLO keep the legacy format, and so does a client whose
+ * HELLO is answered with ERROR or not at all (servers that predate it).
+ * Options are agreed once per connection: the server answers a HELLO that
+ * is not the first frame with ERROR and keeps the current options.
  */
 
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory_resource>
+#include <optional>
+#include <deque>
+#include <unordered_map>
+#include <cstddef>
 #include <cstdint>
 #include <ctime>
 
 namespace Protocol {
 
+// Message schema: the single source of truth for every message type.
+// X(name, wire value, category, description) expands into the MessageType
+// enum and MESSAGE_SCHEMA below; python/message_types.py is generated from
+// this list by python/gen_message_types.py. Wire values must stay below 256
+// (the binary codec stores the type in one byte).
+#define PROTOCOL_MESSAGE_TYPES(X) \
+    /* Authentication */ \
+    X(REGISTER,         1,   AUTH,         "Create an account") \
+    X(LOGIN,            2,   AUTH,         "Log in") \
+    X(LOGOUT,           3,   AUTH,         "Log out") \
+    X(CHANGE_PASSWORD,  4,   AUTH,         "Change own password") \
+    /* Chat */ \
+    X(MSG_GLOBAL,       10,  CHAT,         "Message to everyone") \
+    X(MSG_PRIVATE,      11,  CHAT,         "Message to one user") \
+    /* User Management */ \
+    X(ONLINE_LIST,      20,  USER,         "Online users list") \
+    X(USER_STATUS,      21,  USER,         "User online/offline notification") \
+    X(USER_INFO,        22,  USER,         "Get user information") \
+    /* Member Management (Admin only) */ \
+    X(KICK_USER,        30,  ADMIN,        "Kick user from server") \
+    X(BAN_USER,         31,  ADMIN,        "Ban user (cannot login)") \
+    X(UNBAN_USER,       32,  ADMIN,        "Unban user") \
+    X(MUTE_USER,        33,  ADMIN,        "Mute user (cannot send messages)") \
+    X(UNMUTE_USER,      34,  ADMIN,        "Unmute user") \
+    X(PROMOTE_USER,     35,  ADMIN,        "Promote to admin") \
+    X(DEMOTE_USER,      36,  ADMIN,        "Demote to member") \
+    X(GET_ALL_USERS,    37,  ADMIN,        "Get all registered users") \
+    X(GET_BANNED_LIST,  38,  ADMIN,        "Get banned users list") \
+    X(GET_MUTED_LIST,   39,  ADMIN,        "Get muted users list") \
+    /* Notifications */ \
+    X(KICKED,           40,  NOTIFICATION, "You have been kicked") \
+    X(BANNED,           41,  NOTIFICATION, "You have been banned") \
+    X(MUTED,            42,  NOTIFICATION, "You have been muted") \
+    X(UNMUTED,          43,  NOTIFICATION, "You have been unmuted") \
+    /* Responses */ \
+    X(OK,               100, RESPONSE,     "Request succeeded") \
+    X(ERROR,            101, RESPONSE,     "Request failed") \
+    /* Heartbeat */ \
+    X(PING,             200, HEARTBEAT,    "Keep-alive probe") \
+    X(PONG,             201, HEARTBEAT,    "Keep-alive answer") \
+    /* Capability negotiation */ \
+    X(HELLO,            202, HANDSHAKE,    "Client offers its wire features") \
+    X(HELLO_ACK,        203, HANDSHAKE,    "Server answers with the agreed features")
+
 // Message Types
 enum class MessageType {
-    // Authentication
-    REGISTER = 1,
-    LOGIN = 2,
-    LOGOUT = 3,
-    CHANGE_PASSWORD = 4,
-
-    // Chat
-    MSG_GLOBAL = 10,
-    MSG_PRIVATE = 11,
-
-    // User Management
-    ONLINE_LIST = 20,
-    USER_STATUS = 21,  // User online/offline notification
-    USER_INFO = 22,    // Get user information
-
-    // Member Management (Admin only)
-    KICK_USER = 30,    // Kick user from server
-    BAN_USER = 31,     // Ban user (cannot login)
-    UNBAN_USER = 32,   // Unban user
-    MUTE_USER = 33,    // Mute user (cannot send messages)
-    UNMUTE_USER = 34,  // Unmute user
-    PROMOTE_USER = 35, // Promote to admin
-    DEMOTE_USER = 36,  // Demote to member
-    GET_ALL_USERS = 37,// Get all registered users
-    GET_BANNED_LIST = 38, // Get banned users list
-    GET_MUTED_LIST = 39,  // Get muted users list
-
-    // Notifications
-    KICKED = 40,       // You have been kicked
-    BANNED = 41,       // You have been banned
-    MUTED = 42,        // You have been muted
-    UNMUTED = 43,      // You have been unmuted
-
-    // Responses
-    OK = 100,
-    ERROR = 101,
-
-    // Heartbeat
-    PING = 200,
-    PONG = 201
+#define PROTOCOL_ENUM_ENTRY(name, value, category, description) name = value,
+    PROTOCOL_MESSAGE_TYPES(PROTOCOL_ENUM_ENTRY)
+#undef PROTOCOL_ENUM_ENTRY
+};
+
+// Message categories (used for coarse dispatch, e.g. admin-only checks)
+enum class MessageCategory : uint8_t {
+    AUTH,
+    CHAT,
+    USER,
+    ADMIN,
+    NOTIFICATION,
+    RESPONSE,
+    HEARTBEAT,
+    HANDSHAKE
+};
+
+/**
+ * @brief Compile-time description of one message type
+ */
+struct MessageSchema {
+    MessageType type;
+    std::string_view name;
+    MessageCategory category;
+    std::string_view description;
+};
+
+inline constexpr MessageSchema MESSAGE_SCHEMA[] = {
+#define PROTOCOL_SCHEMA_ENTRY(name, value, category, description) \
+    {MessageType::name, #name, MessageCategory::category, description},
+    PROTOCOL_MESSAGE_TYPES(PROTOCOL_SCHEMA_ENTRY)
+#undef PROTOCOL_SCHEMA_ENTRY
+};
+
+// Number of message types; slots are 0 .. MESSAGE_TYPE_COUNT - 1 in schema order
+inline constexpr size_t MESSAGE_TYPE_COUNT = sizeof(MESSAGE_SCHEMA) / sizeof(MESSAGE_SCHEMA[0]);
+
+namespace detail {
+
+// Wire value -> schema slot (-1: unknown), indexed by the one-byte type
+struct MessageSlotTable {
+    int8_t slot[256];
+};
+
+constexpr MessageSlotTable buildMessageSlotTable() {
+    MessageSlotTable table{};
+    for (size_t i = 0; i < 256; ++i) {
+        table.slot[i] = -1;
+    }
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) {
+        table.slot[static_cast<int>(MESSAGE_SCHEMA[i].type)] = static_cast<int8_t>(i);
+    }
+    return table;
+}
+
+constexpr bool messageSchemaIsValid() {
+    bool seen[256] = {};
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) {
+        int value = static_cast<int>(MESSAGE_SCHEMA[i].type);
+        if (value <= 0 || value > 255 || seen[value]) {
+            return false;
+        }
+        seen[value] = true;
+    }
+    return MESSAGE_TYPE_COUNT < 128;
+}
+
+static_assert(messageSchemaIsValid(), "message type values must be unique and in 1..255");
+
+inline constexpr MessageSlotTable MESSAGE_SLOTS = buildMessageSlotTable();
+
+} // namespace detail
+
+/**
+ * @brief Schema slot of a message type, O(1)
+ * @return Index into MESSAGE_SCHEMA, or -1 if the value is not a known type
+ */
+constexpr int messageTypeSlot(int value) {
+    return (value >= 0 && value < 256) ? detail::MESSAGE_SLOTS.slot[value] : -1;
+}
+
+constexpr int messageTypeSlot(MessageType type) {
+    return messageTypeSlot(static_cast<int>(type));
+}
+
+/**
+ * @brief Check whether a wire value names a known message type, O(1)
+ */
+constexpr bool isValidMessageType(int value) {
+    return messageTypeSlot(value) >= 0;
+}
+
+/**
+ * @brief Name of a message type ("UNKNOWN" for values outside the schema)
+ */
+constexpr std::string_view messageTypeName(MessageType type) {
+    int slot = messageTypeSlot(type);
+    return slot < 0 ? std::string_view("UNKNOWN") : MESSAGE_SCHEMA[slot].name;
+}
+
+/**
+ * @brief Schema entry of a message type
+ * @return nullptr for values outside the schema
+ */
+constexpr const MessageSchema* findMessageSchema(MessageType type) {
+    int slot = messageTypeSlot(type);
+    return slot < 0 ? nullptr : &MESSAGE_SCHEMA[slot];
+}
+
+/**
+ * @brief One T per message type, indexed in O(1) by MessageType
+ *
+ * Used for dispatch tables (handler per type) and per-type counters, so
+ * neither needs a switch over MessageType.
+ */
+template <typename T>
+class MessageTypeTable {
+public:
+    /**
+     * @brief Slot of a type; the type must be valid (see isValidMessageType)
+     */
+    T& operator[](MessageType type) { return slots_[messageTypeSlot(type)]; }
+    const T& operator[](MessageType type) const { return slots_[messageTypeSlot(type)]; }
+
+    /**
+     * @brief Slot of a type, or nullptr for values outside the schema
+     */
+    T* find(MessageType type) {
+        int slot = messageTypeSlot(type);
+        return slot < 0 ? nullptr : &slots_[slot];
+    }
+    const T* find(MessageType type) const {
+        int slot = messageTypeSlot(type);
+        return slot < 0 ? nullptr : &slots_[slot];
+    }
+
+    /**
+     * @brief Slot by schema index (0 .. MESSAGE_TYPE_COUNT - 1)
+     */
+    T& at(size_t slot) { return slots_[slot]; }
+    const T& at(size_t slot) const { return slots_[slot]; }
+
+    static constexpr size_t size() { return MESSAGE_TYPE_COUNT; }
+
+private:
+    T slots_[MESSAGE_TYPE_COUNT] = {};
 };
 
 // User Roles
@@ -78,6 +301,127 @@ enum class UserStatus {
     OFFLINE = 2
 };
 
+// Frame flags (high byte of the length prefix)
+const uint8_t FRAME_FLAG_ROUTED = 0x08;  // Payload starts with a route header (see RouteHeader)
+const uint8_t FRAME_FLAG_BATCH = 0x10;   // Payload holds several length-prefixed messages
+const uint8_t FRAME_FLAG_MORE = 0x20;    // More frames of this logical message follow
+const uint8_t FRAME_FLAG_CHUNK = 0x40;   // Raw content chunk continuing a streamed message
+const uint8_t FRAME_FLAG_COMPRESSED = 0x80;  // Payload is zlib-compressed (never set on chunks)
+
+// Largest payload a single frame can carry (24-bit length field)
+const uint32_t MAX_FRAME_LENGTH = 0x00FFFFFF;
+
+// Payload encoding used on a connection
+enum class WireFormat : uint8_t {
+    JSON = 0,      // Legacy format, understood by every client
+    BINARY = 1     // Compact format: type byte + varint-length fields
+};
+
+// Current protocol version announced in HELLO
+const uint32_t PROTOCOL_VERSION = 1;
+
+// Wire features offered by a peer (HELLO) or agreed for a connection (HELLO_ACK)
+struct WireOptions {
+    uint32_t version;
+    WireFormat format;              // Best payload encoding (offered) or the one in use
+    bool compression;               // Compressed frames
+    uint32_t compressionThreshold;  // Only compress payloads at least this large
+    bool batching;                  // Multi-message batch frames
+    bool streaming;                 // Chunked streamed messages
+    uint32_t maxFrameSize;          // Largest frame payload accepted
+    bool tracing;                   // Latency trace stamps in messages
+    bool typedPayloads;             // Message::fields on the wire (BINARY only)
+    bool routing;                   // Route headers on private messages
+    bool nameDictionary;            // Sender names as per-connection ids (BINARY only)
+    bool requestIds;                // Request ids in BINARY payloads (JSON always has them)
+    bool checksums;                 // CRC-32C trailer behind every frame
+
+    // Defaults describe a legacy peer: JSON only, no optional features
+    WireOptions();
+
+    /**
+     * @brief Get the features implemented by this build
+     * @return Options to offer in HELLO
+     */
+    static WireOptions supported();
+};
+
+// Latency trace of a message, wall-clock microseconds since the Unix epoch
+// (0 = not stamped). Epoch time lets stamps from different hosts be compared.
+struct TraceStamps {
+    uint64_t clientSend;   // Sending client handed the message to its socket
+    uint64_t serverRecv;   // Server extracted the frame
+    uint64_t serverSend;   // Server serialized it for this receiver
+
+    TraceStamps() : clientSend(0), serverRecv(0), serverSend(0) {}
+
+    bool empty() const { return clientSend == 0 && serverRecv == 0 && serverSend == 0; }
+};
+
+// Most names a NameDictionary holds; later names are sent as plain strings
+const uint32_t MAX_NAME_DICTIONARY = 4096;
+
+// Per-connection dictionary of sender names
+//
+// Each direction of a connection has its own: the sender keeps one next
+// to its WireOptions and passes it to serializeInto(), the receiver's
+// MessageBuffer keeps the other. Both see the same frames in the same
+// order, so ids never need to be acknowledged. An id is never reassigned.
+class NameDictionary {
+public:
+    NameDictionary() = default;
+
+    /**
+     * @brief Look up or assign the id of a name to send
+     * @param name Sender name
+     * @param id Receives its id
+     * @return 1 if the name is new and must be defined, 0 if known, -1 if the dictionary is full
+     */
+    int encode(std::string_view name, uint32_t& id);
+
+    /**
+     * @brief Record a name defined by the peer
+     *
+     * Ids arrive in order; defining a known id again is accepted only with
+     * the same name, so decoding a frame twice is harmless.
+     *
+     * @return false if the definition is out of order or conflicts
+     */
+    bool define(uint32_t id, std::string_view name);
+
+    /**
+     * @brief Resolve an id received from the peer
+     * @param id Id from the frame
+     * @param name Receives the name; stays valid until clear()
+     * @return false if the id was never defined
+     */
+    bool resolve(uint32_t id, std::string_view& name) const;
+
+    /**
+     * @brief Get number of names defined so far
+     * @return Dictionary size
+     */
+    size_t size() const { return names_.size(); }
+
+    /**
+     * @brief Forget the names defined after the first size ones
+     *
+     * Undoes encode() for a frame that could not be serialized.
+     *
+     * @param size Number of names to keep
+     */
+    void truncate(size_t size);
+
+    /**
+     * @brief Forget all names (new connection)
+     */
+    void clear() { truncate(0); }
+
+private:
+    std::deque<std::string> names_;                      // By id; deque keeps views stable
+    std::unordered_map<std::string_view, uint32_t> ids_; // Sending side: name -> id
+};
+
 // Message structure
 struct Message {
     MessageType type;
@@ -86,36 +430,385 @@ struct Message {
     std::string content;
     std::string timestamp;
     std::string extra;         // Additional data (JSON format)
+    std::vector<std::string> fields;  // Typed payload (see createLoginMessage etc.)
+    uint32_t requestId;        // Set by the client to match the OK / ERROR answer (0 = none)
+    bool asciiOnly;            // Set on receive when every string is 7-bit ASCII (false = unknown)
+    TraceStamps trace;         // Only carried on connections that agreed on tracing
+
+    Message() : type(MessageType::OK), requestId(0), asciiOnly(false) {}
+    Message(MessageType t) : type(t), requestId(0), asciiOnly(false) {}
+};
+
+// Non-owning view of a message; fields point into the frame storage
+struct MessageView {
+    MessageType type;
+    std::string_view sender;
+    std::string_view receiver;
+    std::string_view content;
+    std::string_view timestamp;
+    std::string_view extra;
+    std::string_view fields;   // Packed typed payload, read with FieldReader
+    uint32_t requestId;
+    bool asciiOnly;            // As Message::asciiOnly
+    TraceStamps trace;
+
+    MessageView() : type(MessageType::OK), requestId(0), asciiOnly(false) {}
+
+    /**
+     * @brief Copy the viewed fields into an owning Message
+     * @return Materialized message
+     */
+    Message toMessage() const;
+};
+
+/**
+ * @brief Iterates the packed typed payload of a MessageView
+ */
+class FieldReader {
+public:
+    explicit FieldReader(std::string_view packed)
+        : p_(reinterpret_cast<const uint8_t*>(packed.data())), end_(p_ + packed.size()) {}
 
-    Message() : type(MessageType::OK) {}
-    Message(MessageType t) : type(t) {}
+    /**
+     * @brief Read the next field
+     * @param field Receives the field (points into the packed data)
+     * @return false at the end or on malformed data
+     */
+    bool next(std::string_view& field);
+
+    /**
+     * @brief Check whether every field was read without error
+     */
+    bool done() const { return p_ == end_; }
+
+private:
+    const uint8_t* p_;
+    const uint8_t* end_;
+};
+
+// Message whose fields live in a MessageArena instead of owning heap strings
+struct ArenaMessage {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    MessageType type;
+    std::pmr::string sender;
+    std::pmr::string receiver;
+    std::pmr::string content;
+    std::pmr::string timestamp;
+    std::pmr::string extra;
+    std::pmr::string fields;   // Packed typed payload, as in MessageView
+    uint32_t requestId;
+    bool asciiOnly;
+    TraceStamps trace;
+
+    explicit ArenaMessage(const allocator_type& alloc = allocator_type());
+
+    /**
+     * @brief View of the fields (e.g. to re-serialize without copying)
+     */
+    MessageView view() const;
+
+    /**
+     * @brief Copy into an owning Message that outlives the arena
+     */
+    Message toMessage() const;
+};
+
+/**
+ * @brief Per-connection monotonic arena for decoded messages
+ *
+ * Decoding into a Message costs up to five heap allocations per frame; an
+ * ArenaMessage only bumps a pointer in a block owned by the arena. Call
+ * reset() after each batch of received frames has been handled: it frees
+ * every message at once, and grows the block to the batch's working set
+ * (up to 256 KiB) so later batches need no heap allocation at all.
+ *
+ * Not thread-safe; use one arena per connection or handler thread.
+ */
+class MessageArena {
+public:
+    /**
+     * @param initialSize Size of the first block in bytes
+     */
+    explicit MessageArena(size_t initialSize = 16 * 1024);
+
+    MessageArena(const MessageArena&) = delete;
+    MessageArena& operator=(const MessageArena&) = delete;
+
+    /**
+     * @brief Copy a view into a new message allocated in the arena
+     * @return Message valid until reset()
+     */
+    ArenaMessage& materialize(const MessageView& view);
+
+    /**
+     * @brief Free every message allocated since the last reset
+     */
+    void reset();
+
+    /**
+     * @brief Memory resource for other per-batch allocations
+     */
+    std::pmr::memory_resource* resource() { return &*arena_; }
+
+    /**
+     * @brief Size of the block reused across resets
+     */
+    size_t capacity() const { return storage_.size(); }
+
+private:
+    // Heap fallback that records how far a batch overflowed the block
+    struct Upstream : std::pmr::memory_resource {
+        size_t overflow = 0;
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+    };
+
+    std::vector<std::byte> storage_;
+    Upstream upstream_;
+    std::optional<std::pmr::monotonic_buffer_resource> arena_;
 };
 
 /**
  * @brief Serialize message to bytes with length prefix
  * @param msg Message to serialize
+ * @param format Payload encoding (JSON for legacy peers)
  * @return Vector of bytes ready to send
  */
-std::vector<uint8_t> serialize(const Message& msg);
+std::vector<uint8_t> serialize(const Message& msg, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Serialize message with the options agreed for a connection
+ * @param msg Message to serialize
+ * @param options Negotiated wire options (format, compression, tracing)
+ * @return Vector of bytes ready to send
+ */
+std::vector<uint8_t> serialize(const Message& msg, const WireOptions& options);
+
+/**
+ * @brief Serialize message with length prefix, appending to a caller-owned buffer
+ *
+ * The frame is encoded in place behind a reserved 4-byte header which is
+ * back-patched once the payload length is known. Reusing the same buffer
+ * across calls avoids any heap allocation once its capacity has grown.
+ *
+ * @param msg Message to serialize
+ * @param out Buffer the frame is appended to (existing contents are kept)
+ * @param format Payload encoding (JSON for legacy peers)
+ * @return Number of bytes appended (header + payload)
+ */
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Serialize message with the options agreed for a connection
+ *
+ * Like serializeInto(msg, out, options.format), but a payload of at least
+ * options.compressionThreshold bytes is compressed when the connection
+ * agreed on compression and doing so makes the frame smaller. Trace
+ * stamps are dropped unless the connection agreed on tracing. Private
+ * messages are sent as routed frames when the connection agreed on routing.
+ * The checksum trailer is appended when the connection agreed on checksums.
+ *
+ * @param msg Message to serialize
+ * @param out Buffer the frame is appended to
+ * @param options Negotiated wire options
+ * @return Number of bytes appended
+ */
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, const WireOptions& options);
+
+/**
+ * @brief Serialize message with the options agreed for a connection and its name dictionary
+ *
+ * The sender name goes out as a dictionary id when the connection agreed
+ * on a name dictionary. Frames must be sent in the order they are
+ * serialized, and names is only ever used for this one connection.
+ *
+ * @param msg Message to serialize
+ * @param out Buffer the frame is appended to
+ * @param options Negotiated wire options
+ * @param names Sending-side dictionary of this connection
+ * @return Number of bytes appended
+ */
+size_t serializeInto(const Message& msg, std::vector<uint8_t>& out, const WireOptions& options,
+                     NameDictionary& names);
+
+/**
+ * @brief Serialize a message view (e.g. ArenaMessage::view()) without copying it
+ * @param view Message fields
+ * @param out Buffer the frame is appended to
+ * @param format Payload encoding
+ * @return Number of bytes appended
+ */
+size_t serializeInto(const MessageView& view, std::vector<uint8_t>& out, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Serialize a message view with the options agreed for a connection
+ * @param view Message fields
+ * @param out Buffer the frame is appended to
+ * @param options Negotiated wire options
+ * @return Number of bytes appended
+ */
+size_t serializeInto(const MessageView& view, std::vector<uint8_t>& out, const WireOptions& options);
+
+/**
+ * @brief Pack several messages into one batch frame
+ *
+ * The batch payload is a sequence of ordinary frames (length prefix with
+ * no flags + payload), so the receiver's MessageBuffer hands them out one
+ * by one and N queued messages cost a single send(). Only use with peers
+ * that agreed on batching; a single message is written as a plain frame.
+ *
+ * @param messages Messages to pack, in delivery order
+ * @param out Buffer the frame is appended to
+ * @param format Payload encoding
+ * @return Number of bytes appended
+ */
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out,
+                          WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Pack several messages into one batch frame, compressed as agreed
+ *
+ * The batch is compressed as a whole, which also lets repeated field
+ * names and usernames across its messages share one dictionary.
+ *
+ * @param messages Messages to pack, in delivery order
+ * @param out Buffer the frame is appended to
+ * @param options Negotiated wire options
+ * @return Number of bytes appended
+ */
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out,
+                          const WireOptions& options);
+
+/**
+ * @brief Pack several messages into one batch frame, using the connection's name dictionary
+ * @param messages Messages to pack, in delivery order
+ * @param out Buffer the frame is appended to
+ * @param options Negotiated wire options
+ * @param names Sending-side dictionary of this connection
+ * @return Number of bytes appended
+ */
+size_t serializeBatchInto(const std::vector<Message>& messages, std::vector<uint8_t>& out,
+                          const WireOptions& options, NameDictionary& names);
+
+/**
+ * @brief Pack several messages into one batch frame
+ * @param messages Messages to pack, in delivery order
+ * @param format Payload encoding
+ * @return Vector of bytes ready to send
+ */
+std::vector<uint8_t> serializeBatch(const std::vector<Message>& messages, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Serialize the head of a streamed message
+ *
+ * Streaming moves payloads of any size with bounded memory: the head frame
+ * carries the message metadata (its content is normally left empty) and is
+ * followed by serializeStreamChunk() frames holding the content bytes. A
+ * sender must not interleave other frames until the last chunk is sent.
+ *
+ * @param msg Message metadata
+ * @param out Buffer the frame is appended to
+ * @param format Payload encoding
+ * @return Number of bytes appended
+ */
+size_t serializeStreamHead(const Message& msg, std::vector<uint8_t>& out, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Serialize one content chunk of a streamed message
+ * @param data Pointer to chunk data
+ * @param length Chunk length (at most the peer's max message size)
+ * @param last true for the final chunk of the message
+ * @param out Buffer the frame is appended to
+ * @return Number of bytes appended
+ */
+size_t serializeStreamChunk(const uint8_t* data, size_t length, bool last, std::vector<uint8_t>& out);
+
+/**
+ * @brief Compute the CRC-32C (Castagnoli) checksum used for frame trailers
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it.
+ *
+ * @param data Pointer to data
+ * @param length Length of data
+ * @param crc Result of the previous call when checksumming in pieces (0 to start)
+ * @return Checksum
+ */
+uint32_t crc32c(const uint8_t* data, size_t length, uint32_t crc = 0);
+
+/**
+ * @brief Append the checksum trailer to a frame
+ *
+ * serializeInto() and serializeBatchInto() already do this when given
+ * options that agreed on checksums; use it for stream frames.
+ *
+ * @param out Buffer holding the frame as its last bytes
+ * @param frameStart Offset of the frame's length prefix in out
+ */
+void appendFrameChecksum(std::vector<uint8_t>& out, size_t frameStart);
 
 /**
  * @brief Deserialize bytes to message
  * @param data Pointer to data buffer (without length prefix)
  * @param length Length of data
+ * @param format Payload encoding the peer is using
  * @return Parsed message
  */
-Message deserialize(const uint8_t* data, size_t length);
+Message deserialize(const uint8_t* data, size_t length, WireFormat format = WireFormat::JSON);
+
+/**
+ * @brief Deserialize bytes into a message allocated in an arena
+ * @param data Pointer to data buffer (without length prefix)
+ * @param length Length of data
+ * @param format Payload encoding the peer is using
+ * @param arena Arena that owns the result
+ * @return Parsed message (type ERROR with "Parse error: ..." content on failure),
+ *         valid until arena.reset()
+ */
+ArenaMessage& deserialize(const uint8_t* data, size_t length, WireFormat format, MessageArena& arena);
+
+/**
+ * @brief Parse a payload into a non-owning view without building a DOM
+ *
+ * String fields reference the payload bytes directly. JSON strings that
+ * contain escape sequences are unescaped in place, so the payload is
+ * modified and must outlive the view.
+ *
+ * @param data Pointer to payload (without length prefix)
+ * @param length Length of payload
+ * @param view Receives the parsed fields
+ * @param format Payload encoding the peer is using
+ * @return true on success, false if the payload is malformed
+ */
+bool parseView(uint8_t* data, size_t length, MessageView& view, WireFormat format = WireFormat::JSON);
 
 /**
  * @brief Get current timestamp as string (HH:MM:SS)
+ *
+ * Thread-safe. Each thread formats the local time once per second and
+ * serves later calls from that cache.
+ *
  * @return Formatted timestamp
  */
 std::string getCurrentTimestamp();
 
+/**
+ * @brief Get current wall-clock time in milliseconds since the Unix epoch
+ * @return Milliseconds since 1970-01-01 00:00:00 UTC
+ */
+int64_t getEpochMillis();
+
+/**
+ * @brief Get current wall-clock time in microseconds since the Unix epoch
+ * @return Microseconds since 1970-01-01 00:00:00 UTC (resolution of TraceStamps)
+ */
+uint64_t getEpochMicros();
+
 /**
  * @brief Convert MessageType to string for logging
  * @param type MessageType enum
- * @return String representation
+ * @return String representation (prefer messageTypeName, which does not allocate)
  */
 std::string messageTypeToString(MessageType type);
 
@@ -134,6 +827,23 @@ Message createOkResponse(const std::string& content = "", const std::string& ext
  */
 Message createErrorResponse(const std::string& content);
 
+/**
+ * @brief Create OK response answering a request
+ * @param request Request being answered; its requestId is echoed
+ * @param content Response content
+ * @param extra Extra data (optional)
+ * @return OK message
+ */
+Message createOkResponse(const Message& request, const std::string& content, const std::string& extra = "");
+
+/**
+ * @brief Create ERROR response answering a request
+ * @param request Request being answered; its requestId is echoed
+ * @param content Error description
+ * @return ERROR message
+ */
+Message createErrorResponse(const Message& request, const std::string& content);
+
 /**
  * @brief Create global chat message
  * @param sender Sender username
@@ -166,7 +876,207 @@ Message createOnlineListMessage(const std::vector<std::string>& users);
  */
 Message createUserStatusMessage(const std::string& username, UserStatus status);
 
+/**
+ * @brief Create LOGIN message (typed payload: username, password)
+ * @param username Username
+ * @param password Password
+ * @return Login message
+ */
+Message createLoginMessage(const std::string& username, const std::string& password);
+
+/**
+ * @brief Create REGISTER message (typed payload: username, password)
+ * @param username Username
+ * @param password Password
+ * @return Register message
+ */
+Message createRegisterMessage(const std::string& username, const std::string& password);
+
+/**
+ * @brief Create CHANGE_PASSWORD message (typed payload: old, new password)
+ * @param oldPassword Current password
+ * @param newPassword New password
+ * @return Change password message
+ */
+Message createChangePasswordMessage(const std::string& oldPassword, const std::string& newPassword);
+
+/**
+ * @brief Create an admin command (KICK_USER, BAN_USER, MUTE_USER, ...)
+ * @param type Admin message type
+ * @param target Username the command applies to (carried in receiver)
+ * @return Admin command message
+ */
+Message createAdminCommand(MessageType type, const std::string& target);
+
+/**
+ * @brief Read username and password from LOGIN / REGISTER
+ *
+ * Accepts both the typed payload and the legacy JSON content.
+ *
+ * @return false if the message is not LOGIN / REGISTER or is malformed
+ */
+bool parseCredentials(const Message& msg, std::string& username, std::string& password);
+
+/**
+ * @brief Read old and new password from CHANGE_PASSWORD (typed or legacy)
+ * @return false if the message is not CHANGE_PASSWORD or is malformed
+ */
+bool parsePasswordChange(const Message& msg, std::string& oldPassword, std::string& newPassword);
+
+/**
+ * @brief Read the user names from ONLINE_LIST (typed or legacy)
+ * @return false if the message is not ONLINE_LIST or is malformed
+ */
+bool parseOnlineList(const Message& msg, std::vector<std::string>& users);
+
+/**
+ * @brief Read the status from USER_STATUS (typed, content or legacy extra)
+ * @return false if the message is not USER_STATUS or is malformed
+ */
+bool parseUserStatus(const Message& msg, UserStatus& status);
+
+/**
+ * @brief Create HELLO message offering wire features
+ * @param offered Features this peer supports
+ * @return Hello message
+ */
+Message createHelloMessage(const WireOptions& offered = WireOptions::supported());
+
+/**
+ * @brief Create HELLO_ACK message carrying the agreed features
+ * @param agreed Result of negotiate()
+ * @return Hello acknowledgement message
+ */
+Message createHelloAckMessage(const WireOptions& agreed);
+
+/**
+ * @brief Read wire features from a HELLO or HELLO_ACK message
+ * @param msg Handshake message
+ * @param options Receives the features (legacy defaults for missing keys)
+ * @return true if msg is a well-formed handshake message
+ */
+bool parseWireOptions(const Message& msg, WireOptions& options);
+
+/**
+ * @brief Agree on features supported by both peers
+ * @param local Features of this side
+ * @param remote Features offered by the peer
+ * @return Options to use on the connection
+ */
+WireOptions negotiate(const WireOptions& local, const WireOptions& remote);
+
+// Latency histogram with power-of-two buckets in microseconds
+//
+// Bucket 0 counts zero latencies and bucket i (i > 0) counts
+// [2^(i-1), 2^i) us; the last bucket also takes everything larger.
+// Recording is O(1) with no allocation. Not synchronized: callers that
+// record and read from different threads must lock.
+class LatencyHistogram {
+public:
+    static const int BUCKET_COUNT = 32;  // Last regular bucket ends at ~18 minutes
+
+    LatencyHistogram();
+
+    /**
+     * @brief Record one latency sample
+     * @param micros Latency in microseconds
+     */
+    void record(uint64_t micros);
+
+    /**
+     * @brief Record the delivery latency of a traced message
+     * @param trace Stamps carried by the message
+     * @param nowMicros Receive time (getEpochMicros())
+     * @return true if the message had a client send stamp
+     */
+    bool recordTrace(const TraceStamps& trace, uint64_t nowMicros);
+
+    /**
+     * @brief Get an upper bound of the given percentile
+     * @param percent Percentile in [0, 100]
+     * @return Upper edge of the bucket holding it, capped at the max sample (0 if empty)
+     */
+    uint64_t percentile(double percent) const;
+
+    /**
+     * @brief Get the largest upper edge a bucket can report
+     * @param index Bucket index
+     * @return Largest latency (us) counted in that bucket
+     */
+    static uint64_t bucketUpperBound(int index);
+
+    uint64_t bucket(int index) const { return buckets_[index]; }
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ == 0 ? 0.0 : static_cast<double>(sum_) / count_; }
+
+    /**
+     * @brief Forget all samples
+     */
+    void reset();
+
+private:
+    uint64_t buckets_[BUCKET_COUNT];
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+const uint8_t ROUTE_FLAG_TIMESTAMP = 0x01;  // The relay's timestamp follows the receiver
+
+// Route header of a routed frame, pointing into a MessageBuffer
+struct RouteHeader {
+    MessageType type;
+    std::string_view sender;
+    std::string_view receiver;
+    std::string_view timestamp;  // Set by the relay (ROUTE_FLAG_TIMESTAMP)
+    uint8_t flags;               // ROUTE_FLAG_*; senders send 0
+    uint32_t frameLength;   // Payload length of the whole frame, route header included
+
+    RouteHeader() : type(MessageType::OK), flags(0), frameLength(0) {}
+
+    /**
+     * @brief Overwrite the addressing (and relay timestamp) of a decoded body with the route header's
+     * @param msg Message decoded from the same frame
+     */
+    void applyTo(Message& msg) const;
+    void applyTo(MessageView& view) const;
+};
+
+/**
+ * @brief Check if a routed frame can be relayed byte-for-byte
+ *
+ * The receiver must have agreed on routing and on the sender's payload
+ * encoding and checksum mode, and accept a frame of that size. Otherwise the relay decodes
+ * the message and serializes it again for the receiver.
+ *
+ * @param route Route header from MessageBuffer::peekRoute()
+ * @param from Options agreed with the sending peer
+ * @param to Options agreed with the receiving peer
+ * @return true if the raw frame can be sent to the receiver as is
+ */
+bool canForwardVerbatim(const RouteHeader& route, const WireOptions& from, const WireOptions& to);
+
+// Piece of a streamed message's content, pointing into a MessageBuffer
+struct StreamChunk {
+    const uint8_t* data;
+    size_t size;
+    bool last;
+
+    StreamChunk() : data(nullptr), size(0), last(false) {}
+};
+
 // Buffer class for handling TCP stream fragmentation
+//
+// Data lives between a read cursor and a write cursor in one contiguous
+// block. Extracting a frame only advances the read cursor; consumed bytes
+// are compacted away lazily when space is needed at the tail.
+//
+// With checksums configured, a frame is only reported complete once its
+// trailer checks out. A frame that fails is skipped by sliding forward one
+// byte at a time to the next header whose frame verifies; frames lost that
+// way may have defined dictionary names, so later messages from the same
+// sender can fail to decode until it is defined again.
 class MessageBuffer {
 public:
     MessageBuffer();
@@ -178,31 +1088,295 @@ public:
      */
     void append(const uint8_t* data, size_t length);
 
+    /**
+     * @brief Reserve writable space at the end of the buffer
+     *
+     * Lets callers recv() straight into the buffer instead of through a
+     * temporary array; follow with commitWrite(). May compact or grow the
+     * storage, which invalidates outstanding views.
+     *
+     * @param minSize Minimum number of writable bytes required
+     * @return Pointer to the writable tail (writableSize() bytes)
+     */
+    uint8_t* prepareWrite(size_t minSize);
+
+    /**
+     * @brief Get number of writable bytes at the tail
+     * @return Bytes available at prepareWrite()'s pointer
+     */
+    size_t writableSize() const { return buffer_.size() - tail_; }
+
+    /**
+     * @brief Mark bytes written into the tail as received data
+     * @param length Number of bytes written (at most writableSize())
+     */
+    void commitWrite(size_t length);
+
     /**
      * @brief Check if a complete message is available
+     *
+     * Returns false while the next frame is a stream chunk; drain those
+     * with extractChunk() first.
+     *
      * @return true if complete message available
      */
     bool hasCompleteMessage() const;
 
     /**
      * @brief Extract next complete message from buffer
+     *
+     * Batch frames are unpacked transparently, one message per call.
+     *
      * @return Parsed message (empty if no complete message)
      */
     Message extractMessage();
 
+    /**
+     * @brief Extract next complete message into an arena
+     *
+     * Same frames as extractMessage(), but the fields are copied into
+     * arena storage instead of fresh heap strings. Malformed frames yield
+     * a message of type ERROR.
+     *
+     * @param arena Arena that owns the result
+     * @return Message valid until arena.reset(), or nullptr if no message is complete
+     */
+    ArenaMessage* extractMessage(MessageArena& arena);
+
+    /**
+     * @brief Extract next complete message as a view into the buffer
+     *
+     * No field is copied. The view stays valid until the next append(),
+     * prepareWrite() or clear(); later extractions do not invalidate it.
+     * Compressed frames are inflated, and dictionary sender names kept, in
+     * storage owned by the buffer with the same lifetime. Malformed frames
+     * yield a view of type ERROR.
+     *
+     * @param view Receives the message fields
+     * @return true if a frame was consumed, false if none is complete
+     */
+    bool extractView(MessageView& view);
+
+    /**
+     * @brief Check if the next frame is a complete chunk of a streamed message
+     * @return true if extractChunk() will deliver data
+     */
+    bool hasStreamChunk() const;
+
+    /**
+     * @brief Extract next content chunk of the message being streamed
+     *
+     * The chunk points into the buffer and stays valid until the next
+     * append(), prepareWrite() or clear(). Only one frame is ever held, so
+     * memory stays bounded by the max message size regardless of how large
+     * the streamed payload is.
+     *
+     * @param chunk Receives the chunk
+     * @return true if a chunk was delivered
+     */
+    bool extractChunk(StreamChunk& chunk);
+
+    /**
+     * @brief Check if a streamed message is in progress
+     * @return true after a stream head until its last chunk is extracted
+     */
+    bool inStream() const { return streaming_; }
+
+    /**
+     * @brief Set the largest frame payload accepted on this connection
+     * @param maxSize Limit in bytes (capped at MAX_FRAME_LENGTH)
+     */
+    void setMaxMessageSize(uint32_t maxSize);
+
+    /**
+     * @brief Get the largest frame payload accepted on this connection
+     * @return Limit in bytes
+     */
+    uint32_t maxMessageSize() const { return maxMessageSize_; }
+
+    /**
+     * @brief Access the raw payload of the next complete frame
+     *
+     * BINARY payloads may reference this connection's name dictionary;
+     * decode them with extractMessage() or extractView(), not deserialize().
+     *
+     * @param payload Receives pointer to payload (without length prefix)
+     * @param length Receives payload length
+     * @return true if a complete frame is available
+     */
+    bool peekFrame(const uint8_t*& payload, size_t& length) const;
+
+    /**
+     * @brief Discard the next complete frame (message or chunk) without parsing it
+     */
+    void skipFrame();
+
+    /**
+     * @brief Read the route header of the next complete frame
+     *
+     * The strings point into the buffer with the same lifetime as a
+     * MessageView. The body is not looked at.
+     *
+     * @param route Receives the route header
+     * @return true if the next frame is complete, routed and well formed
+     */
+    bool peekRoute(RouteHeader& route) const;
+
+    /**
+     * @brief Move the next complete frame, length prefix included, to another buffer
+     *
+     * The bytes are appended exactly as received, e.g. to relay a routed
+     * frame (see canForwardVerbatim()). Not available in the middle of a
+     * batch.
+     *
+     * @param out Buffer the frame is appended to
+     * @return Number of bytes appended, 0 if no whole frame is available
+     */
+    size_t takeFrame(std::vector<uint8_t>& out);
+
     /**
      * @brief Clear the buffer
      */
     void clear();
 
+    /**
+     * @brief Apply options agreed in the handshake to the receive side
+     * @param options Negotiated wire options
+     */
+    void configure(const WireOptions& options);
+
+    /**
+     * @brief Select the payload encoding used by the peer
+     * @param format WireFormat agreed for this connection
+     */
+    void setWireFormat(WireFormat format) { format_ = format; }
+
+    /**
+     * @brief Get the payload encoding used by the peer
+     * @return WireFormat of this connection
+     */
+    WireFormat wireFormat() const { return format_; }
+
     /**
      * @brief Get current buffer size
      * @return Buffer size in bytes
      */
-    size_t size() const { return buffer_.size(); }
+    size_t size() const { return tail_ - head_; }
+
+    /**
+     * @brief Get the number of times a bad checksum made the buffer resynchronize
+     * @return Count since construction
+     */
+    uint64_t resyncCount() const { return resyncCount_; }
 
 private:
-    std::vector<uint8_t> buffer_;
+    /**
+     * @brief Read the length prefix of the frame at the read position
+     * @param length Receives the payload length (cached until consumed)
+     * @param flags Receives the frame flags
+     * @return true if the 4-byte header is available
+     */
+    bool peekHeader(uint32_t& length, uint8_t& flags) const;
+
+    /**
+     * @brief Check a frame header against the limits of this connection
+     * @return true if the frame can be accepted
+     */
+    bool isAcceptable(uint32_t length, uint8_t flags) const;
+
+    /**
+     * @brief Check if the pending frame is valid and fully received
+     * @return true if complete
+     */
+    bool hasCompleteFrame() const;
+
+    /**
+     * @brief Locate the next message: the whole frame or the current batch entry
+     *
+     * Inflates the pending frame first if it is compressed and skips the
+     * route header if it is routed.
+     *
+     * @param offset Receives the payload offset within frameBody()
+     * @param length Receives the payload length
+     * @param route Receives the route header of a routed frame (may be null)
+     * @return nullptr on success, otherwise why the frame is malformed
+     */
+    const char* locateMessage(size_t& offset, uint32_t& length, RouteHeader* route = nullptr) const;
+
+    /**
+     * @brief Inflate the pending compressed frame into inflated_
+     * @return nullptr on success, otherwise why the frame is malformed
+     */
+    const char* inflateFrame() const;
+
+    /**
+     * @brief Get the (inflated) payload of the pending frame
+     * @return Pointer to the first payload byte
+     */
+    uint8_t* frameBody() const;
+
+    /**
+     * @brief Get the (inflated) payload length of the pending frame
+     * @return Length in bytes
+     */
+    uint32_t frameBodyLength() const;
+
+    /**
+     * @brief Release inflated payloads no outstanding view can reference
+     */
+    void recycleInflated();
+
+    /**
+     * @brief Consume the message returned by locateMessage()
+     * @param length Its payload length
+     */
+    void consumeMessage(uint32_t length);
+
+    /**
+     * @brief Consume the whole pending frame, including unread batch entries
+     */
+    void dropFrame();
+
+    /**
+     * @brief Drop all buffered bytes and the pending header
+     *
+     * Unlike clear(), the name dictionary and stream state survive, since
+     * the connection itself carries on.
+     */
+    void discardBuffered();
+
+    /**
+     * @brief Advance the read cursor past the current frame
+     * @param length Payload length of the frame
+     */
+    void consume(uint32_t length);
+
+    /**
+     * @brief Skip data until the frame at the read cursor is verified or incomplete
+     *
+     * Only does anything with checksums configured. Work spent searching
+     * is bounded; once it runs out, all buffered data is dropped.
+     */
+    void resync();
+
+    std::vector<uint8_t> buffer_;     // Storage; size() is the capacity
+    size_t head_;                     // Read cursor: start of unconsumed data
+    size_t tail_;                     // Write cursor: end of received data
+    mutable uint32_t pendingLength_;  // Decoded header of the frame at head_
+    mutable uint8_t pendingFlags_;
+    mutable bool pendingKnown_;
+    bool pendingVerified_;            // Checksum of the frame at head_ matched
+    size_t batchOffset_;              // Next entry within a pending batch frame
+    mutable std::vector<std::vector<uint8_t>> inflated_;  // Pool of inflated payloads
+    mutable size_t inflatedUsed_;     // Pool entries holding live payloads
+    mutable bool frameInflated_;      // Pending frame's payload is inflated_[inflatedUsed_ - 1]
+    uint32_t maxMessageSize_;
+    bool streaming_;                  // Between a stream head and its last chunk
+    WireFormat format_;
+    NameDictionary names_;            // Sender names defined by the peer
+    bool checksums_;                  // Frames carry a CRC-32C trailer
+    size_t resyncWork_;               // Bytes skipped or checksummed since sync was lost
+    uint64_t resyncCount_;
 };
 
 } // namespace Protocol
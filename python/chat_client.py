@@ -7,19 +7,21 @@ GUI is implemented in Python with Tkinter.
 
 import threading
 import json
-import time
 import tkinter as tk
 from tkinter import ttk, messagebox, simpledialog
 from datetime import datetime
 from protocol import (
     Message, MessageType, serialize_to_dict, deserialize_from_dict,
     create_login_message, create_register_message, create_logout_message,
-    create_global_message, create_private_message, create_ping_message
+    create_global_message, create_private_message, create_ping_message,
+    create_admin_command, parse_online_list, parse_user_status, PendingRequests
 )
 
 # Import C++ socket wrapper
 try:
-    from socket_wrapper import SocketClient
+    from socket_wrapper import SocketClient, find_library, LIBRARY_NAME
+    if find_library() is None:
+        raise ImportError(f"{LIBRARY_NAME} has not been built")
     USE_CPP_SOCKET = True
 except ImportError as e:
     print(f"Warning: Could not load C++ socket DLL: {e}")
@@ -44,6 +46,7 @@ class ChatClient:
         self.ping_timer = None
         self.callbacks = {}
         self.running = False
+        self.pending = PendingRequests()  # Requests sent by send_request, by id
 
         # For Python fallback mode
         from protocol import MessageBuffer
@@ -58,6 +61,13 @@ class ChatClient:
                     error = self.cpp_socket.get_error()
                     self._trigger_callback('error', f"Connection failed: {error}")
                     return False
+                # Agree on wire features before any other frame is sent
+                # (older servers keep the connection on legacy JSON)
+                if not self.cpp_socket.negotiate():
+                    error = self.cpp_socket.get_error()
+                    self.cpp_socket.disconnect()
+                    self._trigger_callback('error', f"Handshake failed: {error}")
+                    return False
                 self.connected = True
             else:
                 # Fallback to Python socket
@@ -65,10 +75,17 @@ class ChatClient:
                 self.py_socket.connect((host, port))
                 self.connected = True
 
-            # Start receive thread
+            # Start receiving: the DLL's own thread calls back per message
             self.running = True
-            self.receive_thread = threading.Thread(target=self._receive_loop, daemon=True)
-            self.receive_thread.start()
+            if USE_CPP_SOCKET:
+                if not self.cpp_socket.start_receiver(self._on_cpp_message):
+                    error = self.cpp_socket.get_error()
+                    self.disconnect()
+                    self._trigger_callback('error', f"Receive thread failed: {error}")
+                    return False
+            else:
+                self.receive_thread = threading.Thread(target=self._receive_loop_python, daemon=True)
+                self.receive_thread.start()
 
             # Start ping timer
             self._start_ping_timer()
@@ -97,6 +114,7 @@ class ChatClient:
                 pass
             self.py_socket = None
 
+        self.pending.fail_all("Disconnected")
         self._trigger_callback('disconnected')
 
     def login(self, username: str, password: str):
@@ -125,6 +143,20 @@ class ChatClient:
         msg = create_private_message(self.username, receiver, content)
         self._send_message(msg)
 
+    def send_request(self, msg: Message, on_done):
+        """Send msg without waiting for earlier answers; on_done(answer) gets its OK / ERROR"""
+        if not self.connected:
+            on_done(Message(type=MessageType.ERROR, content="Not connected"))
+            return
+        self.pending.register(msg, on_done)
+        self._send_message(msg)  # A failed send disconnects, which fails the request
+
+    def send_admin_commands(self, msg_type: MessageType, targets: list, on_done):
+        """Pipeline one admin command per target; on_done(target, answer) for each"""
+        for target in targets:
+            self.send_request(create_admin_command(msg_type, target),
+                              lambda answer, target=target: on_done(target, answer))
+
     def set_callback(self, event: str, callback):
         self.callbacks[event] = callback
 
@@ -159,42 +191,21 @@ class ChatClient:
             self._trigger_callback('error', str(e))
             self.disconnect()
 
-    def _receive_loop(self):
-        """Receive messages from server"""
-        if USE_CPP_SOCKET:
-            self._receive_loop_cpp()
-        else:
-            self._receive_loop_python()
-
-    def _receive_loop_cpp(self):
-        """Receive loop using C++ DLL"""
-        while self.running and self.connected:
-            try:
-                if not self.cpp_socket or not self.cpp_socket.is_connected():
-                    break
-
-                # Non-blocking receive from C++ DLL
-                result = self.cpp_socket.recv_message()
-
-                if result is None:
-                    # No complete message yet, sleep briefly to avoid busy loop
-                    time.sleep(0.01)
-                    continue
-                elif isinstance(result, dict) and result.get("error"):
-                    # Error or disconnect
-                    break
-                else:
-                    # Got a message
-                    msg = deserialize_from_dict(result)
-                    if msg:
-                        self._handle_message(msg)
-
-            except Exception as e:
-                if self.running:
-                    self._trigger_callback('error', str(e))
-                break
-
-        self.disconnect()
+    def _on_cpp_message(self, result):
+        """Receive callback, runs on the C++ DLL's receive thread"""
+        if not self.running or not self.connected:
+            return
+        if result.get("error"):
+            # Error or disconnect
+            self.disconnect()
+            return
+        try:
+            msg = deserialize_from_dict(result)
+            if msg:
+                self._handle_message(msg)
+        except Exception as e:
+            self._trigger_callback('error', str(e))
+            self.disconnect()
 
     def _receive_loop_python(self):
         """Receive loop using Python socket (fallback)"""
@@ -221,6 +232,8 @@ class ChatClient:
         self.disconnect()
 
     def _handle_message(self, msg: Message):
+        if self.pending.complete(msg):
+            return  # Answer to a send_request; its callback handled it
         if msg.type == MessageType.OK:
             self._handle_ok(msg)
         elif msg.type == MessageType.ERROR:
@@ -230,17 +243,11 @@ class ChatClient:
         elif msg.type == MessageType.MSG_PRIVATE:
             self._trigger_callback('private_message', msg.sender, msg.receiver, msg.content, msg.timestamp)
         elif msg.type == MessageType.ONLINE_LIST:
-            try:
-                users = json.loads(msg.extra) if msg.extra else []
+            users = parse_online_list(msg)
+            if users is not None:
                 self._trigger_callback('online_list', users)
-            except:
-                pass
         elif msg.type == MessageType.USER_STATUS:
-            try:
-                data = json.loads(msg.extra) if msg.extra else {}
-                self._trigger_callback('user_status', msg.sender, data.get('status', 'offline'))
-            except:
-                pass
+            self._trigger_callback('user_status', msg.sender, parse_user_status(msg) or 'offline')
         elif msg.type == MessageType.PONG:
             pass  # Heartbeat response
         elif msg.type == MessageType.KICKED:
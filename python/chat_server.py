@@ -8,14 +8,21 @@ import json
 import tkinter as tk
 from tkinter import ttk, messagebox
 from datetime import datetime
-from typing import Dict
-from dataclasses import dataclass, field
+from typing import Dict, List
+from dataclasses import dataclass, field, replace
 from protocol import (
-    Message, MessageType, MessageBuffer, serialize,
-    create_global_message, create_private_message, set_socket_log_callback
+    Message, MessageType, MessageBuffer, WireOptions, serialize, serialize_batch,
+    create_global_message, create_private_message, set_socket_log_callback,
+    create_hello_ack_message, parse_wire_options, negotiate,
+    create_online_list_message, create_user_status_message, parse_credentials,
+    TraceStamps, LatencyHistogram, now_micros, RouteHeader, can_forward_verbatim,
+    restamp_routed_frame, NameDictionary
 )
 from database import Database, User
 
+# ASCII bytes that str.strip() keeps
+_PLAIN_EDGES = frozenset(byte for byte in range(0x80) if not chr(byte).isspace())
+
 
 @dataclass
 class ClientSession:
@@ -25,9 +32,16 @@ class ClientSession:
     username: str = ""
     display_name: str = ""
     authenticated: bool = False
+    muted: bool = False  # Mirrors the database while logged in, for the relay fast path
     active: bool = True
     buffer: MessageBuffer = field(default_factory=MessageBuffer)
     send_lock: threading.Lock = field(default_factory=threading.Lock)
+    wire: WireOptions = field(default_factory=WireOptions)  # Agreed in HELLO, legacy JSON until then
+    latency: LatencyHistogram = field(default_factory=LatencyHistogram)  # Client send -> server receive
+    send_names: NameDictionary = field(default_factory=NameDictionary)  # Sender names defined to this client
+    messages_handled: int = 0  # HELLO is only accepted as the first
+    outbox: List[Message] = field(default_factory=list)  # Queued messages, sent in order by _flush_outbox
+    outbox_lock: threading.Lock = field(default_factory=threading.Lock)
 
 
 class ChatServer:
@@ -42,12 +56,34 @@ class ChatServer:
         self.clients: Dict[int, ClientSession] = {}
         self.clients_lock = threading.Lock()
 
+        # Per handler thread: sessions whose fan-out is held until the
+        # current burst of received messages has been handled
+        self._deferred = threading.local()
+
         self.username_to_socket: Dict[str, int] = {}
         self.users_lock = threading.Lock()
 
         self.log_callback = None
         self.message_log_callback = None
 
+        # Handler per message type; types without one are ignored
+        self.handlers = {
+            MessageType.HELLO: lambda fd, session, msg: self._handle_hello(session, msg),
+            MessageType.REGISTER: lambda fd, session, msg: self._handle_register(session, msg),
+            MessageType.LOGIN: self._handle_login,
+            MessageType.LOGOUT: lambda fd, session, msg: self._handle_logout(fd, session, msg),
+            MessageType.MSG_GLOBAL: self._handle_global_message,
+            MessageType.MSG_PRIVATE: lambda fd, session, msg: self._handle_private_message(session, msg),
+            MessageType.PING: lambda fd, session, msg: self._send_to_client(session, Message(type=MessageType.PONG)),
+            MessageType.KICK_USER: lambda fd, session, msg: self._handle_kick(session, msg),
+            MessageType.BAN_USER: lambda fd, session, msg: self._handle_ban(session, msg),
+            MessageType.UNBAN_USER: lambda fd, session, msg: self._handle_unban(session, msg),
+            MessageType.MUTE_USER: lambda fd, session, msg: self._handle_mute(session, msg),
+            MessageType.UNMUTE_USER: lambda fd, session, msg: self._handle_unmute(session, msg),
+        }
+        # Messages received per type
+        self.message_counts: Dict[MessageType, int] = dict.fromkeys(MessageType, 0)
+
     def set_log_callback(self, callback):
         self.log_callback = callback
         # Also set protocol socket log callback to send to GUI
@@ -144,10 +180,22 @@ class ChatServer:
                 
                 self.log(f"[SOCKET-RECV] ← {session.address}: {len(data)} bytes")
                 session.buffer.append(data)
-                while session.buffer.has_complete_message():
-                    msg = session.buffer.extract_message()
-                    if msg:
-                        self._handle_message(fd, session, msg)
+                self._deferred.sessions = {}
+                try:
+                    while session.buffer.has_complete_message():
+                        route = session.buffer.peek_route()
+                        if route and self._relay_private(session, route):
+                            continue
+                        msg = session.buffer.extract_message()
+                        if msg:
+                            if session.wire.tracing:
+                                msg.trace.server_recv = now_micros()
+                                session.latency.record_trace(msg.trace, msg.trace.server_recv)
+                            self._handle_message(fd, session, msg)
+                finally:
+                    deferred, self._deferred.sessions = self._deferred.sessions, None
+                    for target in deferred.values():
+                        self._flush_outbox(target)
         except Exception as e:
             if session.active:
                 self.log(f"Error handling client {session.address}: {e}")
@@ -155,6 +203,8 @@ class ChatServer:
         # Client disconnected
         username = session.username
         self.log(f"Client disconnected: {session.address}" + (f" ({username})" if username else ""))
+        if session.latency.count:
+            self.log(f"[{session.address}] Uplink latency: {session.latency.summary()}")
 
         if username:
             self._broadcast_user_status(username, "offline")
@@ -169,125 +219,193 @@ class ChatServer:
         except:
             pass
 
+    def _stamp_send(self, session: ClientSession, msg: Message) -> Message:
+        """Stamp forwarded traced messages with their send time to this session"""
+        if session.wire.tracing and msg.trace.client_send:
+            return replace(msg, trace=replace(msg.trace, server_send=now_micros()))
+        return msg
+
     def _send_to_client(self, session: ClientSession, msg: Message) -> bool:
+        return self._send_many_to_client(session, [msg])
+
+    def _send_frame(self, session: ClientSession, frame: bytes) -> bool:
+        """Send an already serialized frame (relayed as received)"""
         try:
             with session.send_lock:
-                data = serialize(msg)
-                self.log(f"[SOCKET-SEND] → {session.address}: {len(data)} bytes")
-                session.socket.sendall(data)
+                self._write_outbox(session)
+                self.log(f"[SOCKET-SEND] → {session.address}: {len(frame)} bytes (relayed)")
+                session.socket.sendall(frame)
             return True
         except Exception as e:
             self.log(f"[SOCKET-ERROR] Failed to send to {session.address}: {e}")
             return False
 
-    def _send_error(self, session: ClientSession, error: str):
-        msg = Message(type=MessageType.ERROR, content=error)
+    def _send_many_to_client(self, session: ClientSession, msgs) -> bool:
+        """Send messages after any queued for the session, batched if the client agreed on batching"""
+        with session.outbox_lock:
+            session.outbox.extend(msgs)
+        return self._flush_outbox(session)
+
+    def _flush_outbox(self, session: ClientSession) -> bool:
+        try:
+            with session.send_lock:
+                self._write_outbox(session)
+            return True
+        except Exception as e:
+            self.log(f"[SOCKET-ERROR] Failed to send to {session.address}: {e}")
+            return False
+
+    def _write_outbox(self, session: ClientSession):
+        """Send everything queued for the session in one write; caller holds send_lock"""
+        with session.outbox_lock:
+            msgs, session.outbox = session.outbox, []
+        if not msgs:
+            return
+        msgs = [self._stamp_send(session, msg) for msg in msgs]
+        if session.wire.batching:
+            data = serialize_batch(msgs, session.wire, session.send_names)
+        else:
+            data = b"".join(serialize(msg, session.wire, session.send_names) for msg in msgs)
+        self.log(f"[SOCKET-SEND] → {session.address}: {len(data)} bytes ({len(msgs)} messages)")
+        session.socket.sendall(data)
+
+    def _send_error(self, session: ClientSession, request_id: int, error: str):
+        """Answer a request with ERROR; request_id is the id of the request being answered"""
+        msg = Message(type=MessageType.ERROR, content=error, request_id=request_id)
         self._send_to_client(session, msg)
 
-    def _send_ok(self, session: ClientSession, content: str = "", extra: str = ""):
-        msg = Message(type=MessageType.OK, content=content, extra=extra)
+    def _send_ok(self, session: ClientSession, request_id: int, content: str = "", extra: str = ""):
+        """Answer a request with OK; request_id is the id of the request being answered"""
+        msg = Message(type=MessageType.OK, content=content, extra=extra, request_id=request_id)
         self._send_to_client(session, msg)
 
     def _broadcast(self, msg: Message, exclude_fd: int = -1):
+        """Queue msg for every logged-in client
+
+        While a handler thread works through a burst of received messages
+        the queues are flushed once at its end, so each client gets the
+        burst's fan-out as one batch; otherwise they are flushed right away.
+        """
         with self.clients_lock:
-            for fd, session in self.clients.items():
-                if fd != exclude_fd and session.authenticated:
-                    self._send_to_client(session, msg)
+            targets = [session for fd, session in self.clients.items()
+                       if fd != exclude_fd and session.authenticated]
+        for session in targets:
+            with session.outbox_lock:
+                session.outbox.append(msg)
+        deferred = getattr(self._deferred, "sessions", None)
+        if deferred is None:
+            for session in targets:
+                self._flush_outbox(session)
+        else:
+            deferred.update((id(session), session) for session in targets)
 
-    def _send_to_user(self, username: str, msg: Message) -> bool:
+    def _session_of(self, username: str):
         with self.users_lock:
             fd = self.username_to_socket.get(username)
         if fd is None:
-            return False
+            return None
         with self.clients_lock:
-            session = self.clients.get(fd)
+            return self.clients.get(fd)
+
+    def _send_to_user(self, username: str, msg: Message) -> bool:
+        session = self._session_of(username)
         if session:
             return self._send_to_client(session, msg)
         return False
 
     def _broadcast_user_status(self, username: str, status: str):
-        msg = Message(
-            type=MessageType.USER_STATUS,
-            sender=username,
-            extra=json.dumps({"status": status})
-        )
-        self._broadcast(msg)
+        self._broadcast(create_user_status_message(username, status))
 
     def _handle_message(self, fd: int, session: ClientSession, msg: Message):
         self.log(f"[{session.address}] Received: {MessageType(msg.type).name}")
+        self.message_counts[msg.type] += 1
+        session.messages_handled += 1
 
+        handler = self.handlers.get(msg.type)
+        if handler is None:
+            return
+        # Answers carry the request's id so pipelined requests can be matched
         try:
-            if msg.type == MessageType.REGISTER:
-                self._handle_register(session, msg)
-            elif msg.type == MessageType.LOGIN:
-                self._handle_login(fd, session, msg)
-            elif msg.type == MessageType.LOGOUT:
-                self._handle_logout(fd, session)
-            elif msg.type == MessageType.MSG_GLOBAL:
-                self._handle_global_message(fd, session, msg)
-            elif msg.type == MessageType.MSG_PRIVATE:
-                self._handle_private_message(session, msg)
-            elif msg.type == MessageType.PING:
-                self._send_to_client(session, Message(type=MessageType.PONG))
-            elif msg.type == MessageType.KICK_USER:
-                self._handle_kick(session, msg)
-            elif msg.type == MessageType.BAN_USER:
-                self._handle_ban(session, msg)
-            elif msg.type == MessageType.UNBAN_USER:
-                self._handle_unban(session, msg)
-            elif msg.type == MessageType.MUTE_USER:
-                self._handle_mute(session, msg)
-            elif msg.type == MessageType.UNMUTE_USER:
-                self._handle_unmute(session, msg)
+            handler(fd, session, msg)
         except Exception as e:
             self.log(f"Error handling message: {e}")
-            self._send_error(session, "Internal server error")
+            self._send_error(session, msg.request_id, "Internal server error")
+
+    def _handle_hello(self, session: ClientSession, msg: Message):
+        # The peer would still be decoding with the old options when a
+        # renegotiated HELLO_ACK arrived
+        if session.messages_handled > 1:
+            self._send_error(session, msg.request_id, "HELLO must be the first message")
+            return
+
+        offered = parse_wire_options(msg)
+        if offered is None:
+            self._send_error(session, msg.request_id, "Invalid HELLO")
+            return
+
+        agreed = negotiate(WireOptions.supported(), offered)
+        ack = create_hello_ack_message(agreed)
+
+        # HELLO_ACK goes out in JSON; switch under the send lock so no frame
+        # can slip out in the old format after it
+        with session.send_lock:
+            data = serialize(ack)
+            self.log(f"[SOCKET-SEND] → {session.address}: {len(data)} bytes")
+            session.socket.sendall(data)
+            session.wire = agreed
+        session.buffer.configure(agreed)
+        self.log(f"[{session.address}] Negotiated wire format: {agreed.format.name}")
 
     def _handle_register(self, session: ClientSession, msg: Message):
-        try:
-            data = json.loads(msg.content)
-            username = data.get("username", "").strip()
-            password = data.get("password", "")
+        credentials = parse_credentials(msg)
+        if credentials is None:
+            self._send_error(session, msg.request_id, "Invalid request format")
+            return
+        username, password = credentials[0].strip(), credentials[1]
 
+        try:
             if len(username) < 3 or len(username) > 20:
-                self._send_error(session, "Username must be 3-20 characters")
+                self._send_error(session, msg.request_id, "Username must be 3-20 characters")
                 return
             if len(password) < 4:
-                self._send_error(session, "Password must be at least 4 characters")
+                self._send_error(session, msg.request_id, "Password must be at least 4 characters")
                 return
 
             if self.db.register_user(username, password):
                 self.log(f"User registered: {username}")
-                self._send_ok(session, "Registration successful")
+                self._send_ok(session, msg.request_id, "Registration successful")
             else:
-                self._send_error(session, "Username already exists")
+                self._send_error(session, msg.request_id, "Username already exists")
         except:
-            self._send_error(session, "Invalid request format")
+            self._send_error(session, msg.request_id, "Invalid request format")
 
     def _handle_login(self, fd: int, session: ClientSession, msg: Message):
         if session.authenticated:
-            self._send_error(session, "Already logged in")
+            self._send_error(session, msg.request_id, "Already logged in")
             return
 
-        try:
-            data = json.loads(msg.content)
-            username = data.get("username", "")
-            password = data.get("password", "")
+        credentials = parse_credentials(msg)
+        if credentials is None:
+            self._send_error(session, msg.request_id, "Invalid request format")
+            return
+        username, password = credentials
 
+        try:
             # Check if already online
             with self.users_lock:
                 if username in self.username_to_socket:
-                    self._send_error(session, "User already logged in from another location")
+                    self._send_error(session, msg.request_id, "User already logged in from another location")
                     return
 
             if self.db.is_banned(username):
-                self._send_error(session, "Your account has been banned")
+                self._send_error(session, msg.request_id, "Your account has been banned")
                 return
 
             if self.db.authenticate(username, password):
                 user = self.db.get_user(username)
                 session.username = username
                 session.display_name = user.display_name
+                session.muted = bool(user.is_muted)
                 session.authenticated = True
 
                 with self.users_lock:
@@ -302,23 +420,23 @@ class ChatServer:
                     "role": user.role,
                     "isMuted": user.is_muted
                 })
-                self._send_ok(session, "Login successful", extra)
+                ok_msg = Message(type=MessageType.OK, content="Login successful", extra=extra,
+                                 request_id=msg.request_id)
+
+                # Send success and online list together
+                online_msg = create_online_list_message(self.get_online_users())
+                self._send_many_to_client(session, [ok_msg, online_msg])
 
                 # Broadcast user online
                 self._broadcast_user_status(username, "online")
-
-                # Send online list
-                online_users = self.get_online_users()
-                online_msg = Message(type=MessageType.ONLINE_LIST, extra=json.dumps(online_users))
-                self._send_to_client(session, online_msg)
             else:
-                self._send_error(session, "Invalid username or password")
+                self._send_error(session, msg.request_id, "Invalid username or password")
         except:
-            self._send_error(session, "Invalid request format")
+            self._send_error(session, msg.request_id, "Invalid request format")
 
-    def _handle_logout(self, fd: int, session: ClientSession):
+    def _handle_logout(self, fd: int, session: ClientSession, msg: Message):
         if not session.authenticated:
-            self._send_error(session, "Not logged in")
+            self._send_error(session, msg.request_id, "Not logged in")
             return
 
         username = session.username
@@ -333,15 +451,15 @@ class ChatServer:
         session.display_name = ""
         session.authenticated = False
 
-        self._send_ok(session, "Logged out successfully")
+        self._send_ok(session, msg.request_id, "Logged out successfully")
 
     def _handle_global_message(self, fd: int, session: ClientSession, msg: Message):
         if not session.authenticated:
-            self._send_error(session, "Must be logged in to send messages")
+            self._send_error(session, msg.request_id, "Must be logged in to send messages")
             return
 
         if self.db.is_muted(session.username):
-            self._send_error(session, "You are muted and cannot send messages")
+            self._send_error(session, msg.request_id, "You are muted and cannot send messages")
             return
 
         content = msg.content.strip()
@@ -352,15 +470,16 @@ class ChatServer:
         self.message_log(f"[GLOBAL] {session.username}: {content}")
 
         broadcast_msg = create_global_message(session.username, content)
+        broadcast_msg.trace = TraceStamps(client_send=msg.trace.client_send, server_recv=msg.trace.server_recv)
         self._broadcast(broadcast_msg)
 
     def _handle_private_message(self, session: ClientSession, msg: Message):
         if not session.authenticated:
-            self._send_error(session, "Must be logged in to send messages")
+            self._send_error(session, msg.request_id, "Must be logged in to send messages")
             return
 
         if self.db.is_muted(session.username):
-            self._send_error(session, "You are muted and cannot send messages")
+            self._send_error(session, msg.request_id, "You are muted and cannot send messages")
             return
 
         receiver = msg.receiver
@@ -370,29 +489,71 @@ class ChatServer:
             return
 
         if receiver == session.username:
-            self._send_error(session, "Cannot send message to yourself")
+            self._send_error(session, msg.request_id, "Cannot send message to yourself")
             return
 
         self.log(f"Private message from {session.username} to {receiver}")
         self.message_log(f"[PRIVATE] {session.username} → {receiver}: {content}")
 
         private_msg = create_private_message(session.username, receiver, content)
+        private_msg.trace = TraceStamps(client_send=msg.trace.client_send, server_recv=msg.trace.server_recv)
 
         if not self._send_to_user(receiver, private_msg):
-            self._send_error(session, f"User not online: {receiver}")
+            self._send_error(session, msg.request_id, f"User not online: {receiver}")
             return
 
         # Also send to sender
         self._send_to_client(session, private_msg)
 
+    def _relay_private(self, session: ClientSession, route: RouteHeader) -> bool:
+        """Forward a routed private message without decoding or re-encoding its body
+
+        Receivers take addressing from the route header, so checking its sender
+        is enough. Of the body only the content is looked at, for the checks
+        and the message log. The route header is rewritten to carry the
+        server's timestamp, which receivers use instead of the sender's.
+        Returns False to send the frame down the normal path instead: for
+        anything that needs an error reply, a dropped or trimmed message, or
+        a re-encoded copy.
+        """
+        if (route.type != MessageType.MSG_PRIVATE or not session.authenticated or session.muted
+                or route.sender != session.username or route.receiver == session.username):
+            return False
+        target = self._session_of(route.receiver)
+        if (target is None or not target.authenticated
+                or not can_forward_verbatim(route, session.wire, target.wire)
+                or not can_forward_verbatim(route, session.wire, session.wire)):
+            return False
+        timestamp = datetime.now().strftime("%Y-%m-%d %H:%M:%S")
+        if route.frame_length + 1 + len(timestamp) > min(target.wire.max_frame_size, session.wire.max_frame_size):
+            return False
+        peeked = session.buffer.peek_routed_content(route)
+        # Content that is empty or would be trimmed takes the normal path;
+        # edges outside ASCII might be Unicode whitespace, so they do too
+        if peeked is None or not peeked[0] or peeked[0][0] not in _PLAIN_EDGES or peeked[0][-1] not in _PLAIN_EDGES:
+            return False
+        content, request_id = peeked
+
+        frame = restamp_routed_frame(session.buffer.take_frame(), route, timestamp, target.wire)
+        self.message_counts[route.type] += 1
+        self.log(f"Private message from {route.sender} to {route.receiver} (relayed)")
+        self.message_log(f"[PRIVATE] {route.sender} → {route.receiver}: {content.decode('utf-8', 'replace')}")
+        if not self._send_frame(target, frame):
+            self._send_error(session, request_id, f"User not online: {route.receiver}")
+            return True
+
+        # Also send to sender
+        self._send_frame(session, frame)
+        return True
+
     def _handle_kick(self, session: ClientSession, msg: Message):
         if not session.authenticated or not self.db.is_admin(session.username):
-            self._send_error(session, "Admin privileges required")
+            self._send_error(session, msg.request_id, "Admin privileges required")
             return
 
         target = msg.receiver
         if not target or target == session.username:
-            self._send_error(session, "Invalid target")
+            self._send_error(session, msg.request_id, "Invalid target")
             return
 
         # Send kick notification
@@ -402,20 +563,20 @@ class ChatServer:
         # Disconnect user
         self._kick_user(target)
         self.log(f"User kicked: {target} by {session.username}")
-        self._send_ok(session, f"User kicked: {target}")
+        self._send_ok(session, msg.request_id, f"User kicked: {target}")
 
     def _handle_ban(self, session: ClientSession, msg: Message):
         if not session.authenticated or not self.db.is_admin(session.username):
-            self._send_error(session, "Admin privileges required")
+            self._send_error(session, msg.request_id, "Admin privileges required")
             return
 
         target = msg.receiver
         if not target:
-            self._send_error(session, "Target user not specified")
+            self._send_error(session, msg.request_id, "Target user not specified")
             return
 
         if self.db.is_admin(target):
-            self._send_error(session, "Cannot ban an admin")
+            self._send_error(session, msg.request_id, "Cannot ban an admin")
             return
 
         if self.db.ban_user(target):
@@ -424,53 +585,60 @@ class ChatServer:
             self._send_to_user(target, ban_msg)
             self._kick_user(target)
             self.log(f"User banned: {target} by {session.username}")
-            self._send_ok(session, f"User banned: {target}")
+            self._send_ok(session, msg.request_id, f"User banned: {target}")
         else:
-            self._send_error(session, "User not found")
+            self._send_error(session, msg.request_id, "User not found")
 
     def _handle_unban(self, session: ClientSession, msg: Message):
         if not session.authenticated or not self.db.is_admin(session.username):
-            self._send_error(session, "Admin privileges required")
+            self._send_error(session, msg.request_id, "Admin privileges required")
             return
 
         target = msg.receiver
         if self.db.unban_user(target):
             self.log(f"User unbanned: {target} by {session.username}")
-            self._send_ok(session, f"User unbanned: {target}")
+            self._send_ok(session, msg.request_id, f"User unbanned: {target}")
         else:
-            self._send_error(session, "User not found")
+            self._send_error(session, msg.request_id, "User not found")
 
     def _handle_mute(self, session: ClientSession, msg: Message):
         if not session.authenticated or not self.db.is_admin(session.username):
-            self._send_error(session, "Admin privileges required")
+            self._send_error(session, msg.request_id, "Admin privileges required")
             return
 
         target = msg.receiver
         if self.db.is_admin(target):
-            self._send_error(session, "Cannot mute an admin")
+            self._send_error(session, msg.request_id, "Cannot mute an admin")
             return
 
         if self.db.mute_user(target):
+            self._set_muted(target, True)
             mute_msg = Message(type=MessageType.MUTED, content=f"You have been muted by {session.username}")
             self._send_to_user(target, mute_msg)
             self.log(f"User muted: {target} by {session.username}")
-            self._send_ok(session, f"User muted: {target}")
+            self._send_ok(session, msg.request_id, f"User muted: {target}")
         else:
-            self._send_error(session, "User not found")
+            self._send_error(session, msg.request_id, "User not found")
+
+    def _set_muted(self, username: str, muted: bool):
+        target = self._session_of(username)
+        if target:
+            target.muted = muted
 
     def _handle_unmute(self, session: ClientSession, msg: Message):
         if not session.authenticated or not self.db.is_admin(session.username):
-            self._send_error(session, "Admin privileges required")
+            self._send_error(session, msg.request_id, "Admin privileges required")
             return
 
         target = msg.receiver
         if self.db.unmute_user(target):
+            self._set_muted(target, False)
             unmute_msg = Message(type=MessageType.UNMUTED, content=f"You have been unmuted by {session.username}")
             self._send_to_user(target, unmute_msg)
             self.log(f"User unmuted: {target} by {session.username}")
-            self._send_ok(session, f"User unmuted: {target}")
+            self._send_ok(session, msg.request_id, f"User unmuted: {target}")
         else:
-            self._send_error(session, "User not found")
+            self._send_error(session, msg.request_id, "User not found")
 
     def _kick_user(self, username: str):
         with self.users_lock:
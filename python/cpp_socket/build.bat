@@ -4,7 +4,8 @@ REM Run this from MSYS2 UCRT64 terminal or with MinGW in PATH
 
 echo Building socket_client.dll...
 
-g++ -shared -o socket_client.dll socket_client.cpp -lws2_32 -static -O2
+REM Frame compression needs zlib (pacman -S mingw-w64-ucrt-x86_64-zlib)
+g++ -shared -o socket_client.dll socket_client.cpp ../../common/Protocol.cpp -I../.. -I../../thirdparty -DPROTOCOL_HAVE_ZLIB -lz -lws2_32 -static -O2 -std=c++17
 
 if %ERRORLEVEL% EQU 0 (
     echo.
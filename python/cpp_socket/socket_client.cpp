@@ -1,48 +1,214 @@
 /**
  * @file socket_client.cpp
- * @brief C++ Socket Client Library - Winsock Implementation
+ * @brief C++ Socket Client Library - Winsock and POSIX Implementation
  *
- * This is the core socket code using Winsock2.
- * Compiled as DLL to be called from Python via ctypes.
+ * This is the core socket code: Winsock2 on Windows, BSD sockets with
+ * poll() everywhere else. Compiled as a DLL / shared object to be called
+ * from Python via ctypes.
  */
 
 #define SOCKET_CLIENT_EXPORTS
 
 #include "socket_client.h"
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "common/Protocol.h"
+#include <chrono>
 #include <cstring>
 #include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <exception>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+// Keep <wingdi.h> out: its ERROR macro clashes with MessageType::ERROR
+#define NOGDI
+#include <winsock2.h>
+#include <ws2tcpip.h>
 
 #pragma comment(lib, "ws2_32.lib")
 
-// ==================== Global State ====================
+static const int SEND_FLAGS = 0;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+
+// Winsock names for the few things both APIs share
+typedef int SOCKET;
+static const SOCKET INVALID_SOCKET = -1;
+static const int SOCKET_ERROR = -1;
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+
+// A peer that went away must not kill the Python process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+#endif
+
+// ==================== Connection State ====================
+
+static const size_t RECV_CHUNK_SIZE = 4096;
+
+// Receive result when the next message does not fit the caller's buffer
+static const int BUFFER_TOO_SMALL = -2;
+
+// Longest a receive thread waits before it notices sc_stop_receiver()
+// (a disconnect wakes it straight away)
+static const int RECEIVER_WAIT_MS = 100;
+
+// Arenas start small: a process may hold thousands of connections, and an
+// arena grows on its own the first time a large message passes through
+static const size_t CONN_ARENA_SIZE = 4 * 1024;
+
+// Everything one connection owns. The socket_* API works on a single
+// default instance; sc_open() allocates one per connection.
+struct sc_conn {
+    // Read without the lock by receivers while a disconnect may reset it
+    std::atomic<SOCKET> socket{INVALID_SOCKET};
+    std::atomic<bool> connected{false};
+    std::string last_error;
+    std::mutex mutex;
+
+    // Message buffer for handling TCP stream (recv() writes straight into its tail)
+    Protocol::MessageBuffer recv_buffer;
+    std::mutex buffer_mutex;
+
+    // Reusable frame buffer for outgoing messages (no allocation once grown)
+    std::vector<uint8_t> send_buffer;
+    std::mutex send_mutex;
+
+    // Wire options agreed with the server (legacy JSON until negotiation)
+    Protocol::WireOptions wire;
+
+    // Scratch buffer for converting binary frames back to JSON for Python
+    std::vector<uint8_t> json_scratch;
+
+    // Message taken by socket_recv_messages() that did not fit the caller's
+    // buffer; handed out first by the next receive (guarded by buffer_mutex)
+    std::string carry;
+    bool carry_pending = false;
+
+    // Decoded fields of frames being converted or re-encoded, reset per frame
+    // (recv side guarded by buffer_mutex, send side by send_mutex)
+    Protocol::MessageArena recv_arena{CONN_ARENA_SIZE};
+    Protocol::MessageArena send_arena{CONN_ARENA_SIZE};
+
+    // Delivery latency of traced messages (guarded by buffer_mutex)
+    bool recv_tracing = false;
+    Protocol::LatencyHistogram latency;
+
+    // Native receive thread delivering messages to a callback
+    std::thread receiver;
+    std::atomic<bool> receiver_stop{false};
+    sc_message_callback receiver_callback = nullptr;
+    void* receiver_user_data = nullptr;
+    bool receiver_owns_conn = false;  // sc_close() ran inside the callback
+
+    ~sc_conn() {
+        // Only the static default connection can get here with a running
+        // thread (at process exit); there is nothing left to join it to
+        if (receiver.joinable()) {
+            receiver.detach();
+        }
+    }
+};
 
-static SOCKET g_socket = INVALID_SOCKET;
+// Connection behind the socket_* functions
+static sc_conn g_default;
 static bool g_initialized = false;
-static bool g_connected = false;
-static std::string g_last_error;
-static std::mutex g_mutex;
+static std::mutex g_init_mutex;
 
-// Message buffer for handling TCP stream
-static std::vector<char> g_recv_buffer;
-static std::mutex g_buffer_mutex;
+// Why the last sc_open() on this thread failed (there is no handle to ask)
+static thread_local std::string t_open_error;
 
 // ==================== Helper Functions ====================
 
-static void set_error(const std::string& error) {
-    g_last_error = error;
+static void set_error(sc_conn& conn, const std::string& error) {
+    conn.last_error = error;
 }
 
-static void set_winsock_error(const std::string& prefix) {
+static void set_socket_error(sc_conn& conn, const std::string& prefix) {
+#ifdef _WIN32
     int err = WSAGetLastError();
-    g_last_error = prefix + " (WSA Error: " + std::to_string(err) + ")";
+    conn.last_error = prefix + " (WSA Error: " + std::to_string(err) + ")";
+#else
+    int err = errno;
+    conn.last_error = prefix + " (" + std::strerror(err) + ")";
+#endif
+}
+
+// True if the last socket call failed only because it would have blocked
+static bool would_block(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static int set_blocking_mode(SOCKET sock, bool non_blocking) {
+#ifdef _WIN32
+    u_long mode = non_blocking ? 1 : 0;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(sock, F_SETFL, flags) == 0 ? 0 : -1;
+#endif
+}
+
+// Wait until the socket is readable (or writable): 1 ready, 0 timeout, -1 error.
+// A negative timeout waits forever.
+static int wait_socket(sc_conn& conn, bool for_write, int timeout_ms) {
+    SOCKET sock = conn.socket;
+#ifdef _WIN32
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int result = select(0, for_write ? nullptr : &fds, for_write ? &fds : nullptr, nullptr,
+                        timeout_ms < 0 ? nullptr : &timeout);
+    if (result == SOCKET_ERROR) {
+        set_socket_error(conn, "Select failed");
+        return -1;
+    }
+#else
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = for_write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+
+    int result = poll(&pfd, 1, timeout_ms);
+    if (result < 0) {
+        if (errno == EINTR) {
+            return 0;  // Interrupted by a signal: callers loop or retry
+        }
+        set_socket_error(conn, "Poll failed");
+        return -1;
+    }
+#endif
+    return result > 0 ? 1 : 0;
 }
 
 // ==================== DLL Entry Point ====================
 
+#ifdef _WIN32
 BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
     switch (fdwReason) {
         case DLL_PROCESS_ATTACH:
@@ -56,53 +222,40 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {
     }
     return TRUE;
 }
+#endif
 
-// ==================== API Implementation ====================
-
-SOCKET_API int socket_init(void) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-
-    if (g_initialized) {
-        return 0;  // Already initialized
-    }
+// ==================== Connection Operations ====================
 
-    WSADATA wsaData;
-    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (result != 0) {
-        set_error("WSAStartup failed with error: " + std::to_string(result));
-        return -1;
+// Reset per-connection protocol state to the legacy wire format
+static void reset_protocol(sc_conn& conn, bool reset_latency) {
+    {
+        std::lock_guard<std::mutex> buf_lock(conn.buffer_mutex);
+        conn.recv_buffer.clear();
+        conn.recv_buffer.configure(Protocol::WireOptions());
+        conn.carry_pending = false;
+        conn.recv_tracing = false;
+        if (reset_latency) {
+            conn.latency.reset();
+        }
     }
-
-    g_initialized = true;
-    return 0;
-}
-
-SOCKET_API void socket_cleanup(void) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-
-    if (g_initialized) {
-        WSACleanup();
-        g_initialized = false;
+    {
+        std::lock_guard<std::mutex> send_lock(conn.send_mutex);
+        conn.wire = Protocol::WireOptions();
     }
 }
 
-SOCKET_API int socket_connect(const char* host, int port) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-
-    if (!g_initialized) {
-        set_error("Socket not initialized. Call socket_init() first.");
-        return -1;
-    }
+static int conn_connect(sc_conn& conn, const char* host, int port) {
+    std::lock_guard<std::mutex> lock(conn.mutex);
 
-    if (g_connected) {
-        set_error("Already connected. Disconnect first.");
+    if (conn.connected) {
+        set_error(conn, "Already connected. Disconnect first.");
         return -1;
     }
 
     // Create socket
-    g_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (g_socket == INVALID_SOCKET) {
-        set_winsock_error("Failed to create socket");
+    conn.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn.socket == INVALID_SOCKET) {
+        set_socket_error(conn, "Failed to create socket");
         return -1;
     }
 
@@ -116,70 +269,108 @@ SOCKET_API int socket_connect(const char* host, int port) {
     std::string port_str = std::to_string(port);
     int res = getaddrinfo(host, port_str.c_str(), &hints, &result);
     if (res != 0) {
-        set_error("Failed to resolve hostname: " + std::string(host));
-        closesocket(g_socket);
-        g_socket = INVALID_SOCKET;
+        set_error(conn, "Failed to resolve hostname: " + std::string(host));
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
         return -1;
     }
 
     // Connect
-    res = connect(g_socket, result->ai_addr, (int)result->ai_addrlen);
+    res = connect(conn.socket, result->ai_addr, (int)result->ai_addrlen);
     freeaddrinfo(result);
 
     if (res == SOCKET_ERROR) {
-        set_winsock_error("Failed to connect to " + std::string(host) + ":" + std::to_string(port));
-        closesocket(g_socket);
-        g_socket = INVALID_SOCKET;
+        set_socket_error(conn, "Failed to connect to " + std::string(host) + ":" + std::to_string(port));
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
         return -1;
     }
 
-    g_connected = true;
-
-    // Clear receive buffer
-    {
-        std::lock_guard<std::mutex> buf_lock(g_buffer_mutex);
-        g_recv_buffer.clear();
+#ifndef _WIN32
+    // Reads never block; sends wait in poll() when the socket buffer is full
+    if (set_blocking_mode(conn.socket, true) != 0) {
+        set_socket_error(conn, "Failed to set non-blocking mode");
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
+        return -1;
     }
+#endif
+
+    conn.connected = true;
+
+    // Clear receive buffer and fall back to the legacy wire format
+    reset_protocol(conn, true);
 
     return 0;
 }
 
-SOCKET_API void socket_disconnect(void) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+// Stop the receive thread; from inside its own callback it only flags it
+static void conn_stop_receiver(sc_conn& conn) {
+    conn.receiver_stop = true;
+    if (conn.receiver.joinable() && conn.receiver.get_id() != std::this_thread::get_id()) {
+        conn.receiver.join();
+    }
+}
 
-    if (g_socket != INVALID_SOCKET) {
-        shutdown(g_socket, SD_BOTH);
-        closesocket(g_socket);
-        g_socket = INVALID_SOCKET;
+static void conn_disconnect(sc_conn& conn) {
+    // A deliberate disconnect gets no disconnect callback. The shutdown
+    // wakes the receive thread, which must be gone before the socket is
+    // closed so its recv() never sees a closed (or reused) descriptor.
+    // It is joined without the lock, which its callback may need.
+    // The shutdown itself takes no lock either: a sender waiting for room
+    // holds conn.mutex, and the shutdown is what wakes it up.
+    conn.receiver_stop = true;
+    conn.connected = false;
+    SOCKET sock = conn.socket;
+    if (sock != INVALID_SOCKET) {
+        shutdown(sock, SD_BOTH);
     }
-    g_connected = false;
+    conn_stop_receiver(conn);
 
-    // Clear buffer
-    {
-        std::lock_guard<std::mutex> buf_lock(g_buffer_mutex);
-        g_recv_buffer.clear();
+    // Every read of the socket (recv, poll) runs under the buffer lock, so
+    // none is in flight on the descriptor while it is closed and reused
+    std::lock_guard<std::mutex> lock(conn.mutex);
+    std::lock_guard<std::mutex> buf_lock(conn.buffer_mutex);
+
+    if (conn.socket != INVALID_SOCKET) {
+        closesocket(conn.socket);
+        conn.socket = INVALID_SOCKET;
     }
-}
 
-SOCKET_API int socket_is_connected(void) {
-    std::lock_guard<std::mutex> lock(g_mutex);
-    return g_connected ? 1 : 0;
+    // Clear buffer
+    conn.recv_buffer.clear();
+    conn.recv_buffer.configure(Protocol::WireOptions());
+    conn.carry_pending = false;
+    conn.recv_tracing = false;
 }
 
-SOCKET_API int socket_send_raw(const char* data, int length) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+static int conn_send_raw(sc_conn& conn, const char* data, int length) {
+    std::lock_guard<std::mutex> lock(conn.mutex);
 
-    if (!g_connected || g_socket == INVALID_SOCKET) {
-        set_error("Not connected");
+    if (!conn.connected || conn.socket == INVALID_SOCKET) {
+        set_error(conn, "Not connected");
         return -1;
     }
 
     int total_sent = 0;
     while (total_sent < length) {
-        int sent = send(g_socket, data + total_sent, length - total_sent, 0);
+        int sent = (int)send(conn.socket, data + total_sent, length - total_sent, SEND_FLAGS);
         if (sent == SOCKET_ERROR) {
-            set_winsock_error("Send failed");
-            g_connected = false;
+            if (would_block()) {
+                // Nonblocking socket with a full send buffer: wait for room
+                // (a disconnect from another thread wakes this up)
+                if (wait_socket(conn, true, -1) < 0) {
+                    conn.connected = false;
+                    return -1;
+                }
+                if (!conn.connected) {
+                    set_error(conn, "Disconnected while sending");
+                    return -1;
+                }
+                continue;
+            }
+            set_socket_error(conn, "Send failed");
+            conn.connected = false;
             return -1;
         }
         total_sent += sent;
@@ -188,139 +379,722 @@ SOCKET_API int socket_send_raw(const char* data, int length) {
     return total_sent;
 }
 
-SOCKET_API int socket_recv_raw(char* buffer, int max_length) {
-    // Don't lock g_mutex here - we want non-blocking behavior
-    if (!g_connected || g_socket == INVALID_SOCKET) {
+// Caller must hold conn.buffer_mutex (see conn_disconnect)
+static int conn_recv_raw(sc_conn& conn, char* buffer, int max_length) {
+    // Don't lock conn.mutex here - we want non-blocking behavior
+    SOCKET sock = conn.socket;
+    if (!conn.connected || sock == INVALID_SOCKET) {
         return -1;
     }
 
+#ifdef _WIN32
     // Use select to check if data is available (non-blocking)
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(g_socket, &read_fds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;  // Immediate return
-
-    int result = select(0, &read_fds, nullptr, nullptr, &timeout);
-    if (result == 0) {
-        return 0;  // No data available
-    }
-    if (result == SOCKET_ERROR) {
-        set_winsock_error("Select failed");
-        return -1;
+    int ready = wait_socket(conn, false, 0);
+    if (ready <= 0) {
+        return ready;  // No data available, or select failed
     }
 
     // Data available - receive it
-    int received = recv(g_socket, buffer, max_length, 0);
+    int received = recv(sock, buffer, max_length, 0);
+#else
+    // The socket is nonblocking (MSG_DONTWAIT even if the caller switched
+    // it back), so an empty socket is just EAGAIN: no readiness probe
+    int received = (int)recv(sock, buffer, max_length, MSG_DONTWAIT);
+#endif
     if (received == 0) {
         // Connection closed gracefully
-        g_connected = false;
+        conn.connected = false;
         return -1;
     }
     if (received == SOCKET_ERROR) {
-        int err = WSAGetLastError();
-        if (err == WSAEWOULDBLOCK) {
+        if (would_block()) {
             return 0;  // No data
         }
-        set_winsock_error("Recv failed");
-        g_connected = false;
+        set_socket_error(conn, "Recv failed");
+        conn.connected = false;
         return -1;
     }
 
     return received;
 }
 
-SOCKET_API int socket_send_message(const char* json_data) {
+static int conn_send_message(sc_conn& conn, const char* json_data) {
     if (!json_data) {
-        set_error("Null data");
+        set_error(conn, "Null data");
         return -1;
     }
 
-    int json_length = (int)strlen(json_data);
-
-    // Create message with 4-byte length prefix (big-endian)
-    std::vector<char> message(4 + json_length);
+    size_t text_length = strlen(json_data);
+    // The top header byte holds frame flags, leaving 24 bits for the length
+    if (text_length > Protocol::MAX_FRAME_LENGTH) {
+        set_error(conn, "Message too large (" + std::to_string(text_length) + " bytes)");
+        return -1;
+    }
+    int json_length = (int)text_length;
 
-    // Write length in big-endian
-    message[0] = (json_length >> 24) & 0xFF;
-    message[1] = (json_length >> 16) & 0xFF;
-    message[2] = (json_length >> 8) & 0xFF;
-    message[3] = json_length & 0xFF;
+    std::lock_guard<std::mutex> lock(conn.send_mutex);
 
-    // Copy JSON data
-    memcpy(message.data() + 4, json_data, json_length);
+    if (conn.wire.format == Protocol::WireFormat::JSON && !conn.wire.compression && !conn.wire.tracing) {
+        if ((uint32_t)json_length > conn.wire.maxFrameSize) {
+            set_error(conn, "Message too large (" + std::to_string(json_length) + " bytes)");
+            return -1;
+        }
+        // Frame message into the reusable buffer: 4-byte length prefix (big-endian)
+        conn.send_buffer.resize(4 + json_length);
+
+        // Write length in big-endian
+        conn.send_buffer[0] = (json_length >> 24) & 0xFF;
+        conn.send_buffer[1] = (json_length >> 16) & 0xFF;
+        conn.send_buffer[2] = (json_length >> 8) & 0xFF;
+        conn.send_buffer[3] = json_length & 0xFF;
+
+        // Copy JSON data
+        memcpy(conn.send_buffer.data() + 4, json_data, json_length);
+        if (conn.wire.checksums) {
+            Protocol::appendFrameChecksum(conn.send_buffer, 0);
+        }
+    } else {
+        // Re-encode the message in the negotiated format and compression
+        Protocol::ArenaMessage& msg = Protocol::deserialize(
+            reinterpret_cast<const uint8_t*>(json_data), json_length, Protocol::WireFormat::JSON, conn.send_arena);
+        if (msg.type == Protocol::MessageType::ERROR && msg.content.rfind("Parse error:", 0) == 0) {
+            set_error(conn, "Invalid JSON message: " + std::string(msg.content));
+            conn.send_arena.reset();
+            return -1;
+        }
+        if (conn.wire.tracing) {
+            msg.trace.clientSend = Protocol::getEpochMicros();
+        }
+        conn.send_buffer.clear();
+        try {
+            Protocol::serializeInto(msg.view(), conn.send_buffer, conn.wire);
+        } catch (const std::exception& e) {
+            // Re-encoding can grow a message past the frame length limit;
+            // nothing may propagate out of the C API
+            set_error(conn, std::string("Cannot encode message: ") + e.what());
+            conn.send_arena.reset();
+            return -1;
+        }
+        conn.send_arena.reset();
+    }
 
     // Send
-    int result = socket_send_raw(message.data(), (int)message.size());
+    int result = conn_send_raw(conn, reinterpret_cast<const char*>(conn.send_buffer.data()),
+                               (int)conn.send_buffer.size());
     return (result > 0) ? 0 : -1;
 }
 
-SOCKET_API int socket_recv_message(char* buffer, int max_length) {
-    // First, try to receive more data into our buffer
-    char temp_buffer[4096];
-    int received = socket_recv_raw(temp_buffer, sizeof(temp_buffer));
-
+// Receive available data directly into the tail of the frame buffer.
+// Caller must hold conn.buffer_mutex.
+static int fill_recv_buffer(sc_conn& conn) {
+    uint8_t* tail = conn.recv_buffer.prepareWrite(RECV_CHUNK_SIZE);
+    int received = conn_recv_raw(conn, reinterpret_cast<char*>(tail), (int)conn.recv_buffer.writableSize());
     if (received > 0) {
-        std::lock_guard<std::mutex> lock(g_buffer_mutex);
-        g_recv_buffer.insert(g_recv_buffer.end(), temp_buffer, temp_buffer + received);
-    } else if (received < 0) {
+        conn.recv_buffer.commitWrite(received);
+    }
+    return received;
+}
+
+// Take the next complete frame as JSON: 1 if one was taken, 0 if none.
+// The payload stays valid until the next call or recv.
+// Caller must hold conn.buffer_mutex.
+static int next_message(sc_conn& conn, const uint8_t*& payload, size_t& msg_length) {
+    if (conn.carry_pending) {
+        conn.carry_pending = false;
+        payload = reinterpret_cast<const uint8_t*>(conn.carry.data());
+        msg_length = conn.carry.size();
+        return 1;
+    }
+    if (!conn.recv_buffer.peekFrame(payload, msg_length)) {
+        if (conn.recv_buffer.hasCompleteMessage()) {
+            // Complete but undecodable (corrupt batch or compressed frame)
+            conn.recv_buffer.skipFrame();
+            set_error(conn, "Dropped malformed frame");
+        }
+        return 0;  // Header or payload not complete yet
+    }
+
+    // Python expects JSON. Frames in another format, routed frames (whose
+    // route header overrides the body's addressing) and traced frames are
+    // decoded through the buffer, which resolves the name dictionary and
+    // consumes the frame, then re-encoded; plain JSON is passed through.
+    Protocol::RouteHeader route;
+    bool convert = conn.recv_tracing || conn.recv_buffer.peekRoute(route) ||
+                   conn.recv_buffer.wireFormat() != Protocol::WireFormat::JSON;
+    if (convert) {
+        Protocol::ArenaMessage* msg = conn.recv_buffer.extractMessage(conn.recv_arena);
+        if (conn.recv_tracing) {
+            conn.latency.recordTrace(msg->trace, Protocol::getEpochMicros());
+        }
+        conn.json_scratch.clear();
+        Protocol::serializeInto(msg->view(), conn.json_scratch);
+        payload = conn.json_scratch.data() + 4;
+        msg_length = conn.json_scratch.size() - 4;
+        conn.recv_arena.reset();
+    } else {
+        conn.recv_buffer.skipFrame();  // Payload stays readable until the next recv
+    }
+    return 1;
+}
+
+// Keep a taken message that did not fit for the next receive
+// (payload may already be the carried message itself).
+// Caller must hold conn.buffer_mutex.
+static int keep_message(sc_conn& conn, const uint8_t* payload, size_t msg_length) {
+    if (payload != reinterpret_cast<const uint8_t*>(conn.carry.data())) {
+        conn.carry.assign(reinterpret_cast<const char*>(payload), msg_length);
+    }
+    conn.carry_pending = true;
+    set_error(conn, "Message too large for buffer (" + std::to_string(msg_length) + " bytes)");
+    return BUFFER_TOO_SMALL;
+}
+
+// Copy the next complete frame to the caller as JSON.
+// Caller must hold conn.buffer_mutex.
+static int pop_message(sc_conn& conn, char* buffer, int max_length) {
+    const uint8_t* payload;
+    size_t msg_length;
+    if (!next_message(conn, payload, msg_length)) {
+        return 0;
+    }
+
+    // Check buffer size (room for the null terminator too)
+    if (msg_length >= (size_t)max_length) {
+        return keep_message(conn, payload, msg_length);
+    }
+
+    // Copy message to output buffer
+    memcpy(buffer, payload, msg_length);
+    buffer[msg_length] = '\0';  // Null-terminate
+
+    return (int)msg_length;
+}
+
+static int conn_recv_message(sc_conn& conn, char* buffer, int max_length) {
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+
+    // First, try to receive more data into our buffer
+    if (fill_recv_buffer(conn) < 0) {
         return -1;  // Error or disconnect
     }
 
     // Check if we have a complete message
-    std::lock_guard<std::mutex> lock(g_buffer_mutex);
+    return pop_message(conn, buffer, max_length);
+}
 
-    if (g_recv_buffer.size() < 4) {
-        return 0;  // Not enough data for header
+static int conn_recv_messages(sc_conn& conn, char* buffer, int capacity,
+                              int* offsets, int* lengths, int max_count) {
+    if (!buffer || capacity <= 0 || !offsets || !lengths || max_count <= 0) {
+        set_error(conn, "Invalid batch buffer");
+        return -1;
     }
 
-    // Read length from header (big-endian)
-    uint32_t msg_length =
-        ((uint8_t)g_recv_buffer[0] << 24) |
-        ((uint8_t)g_recv_buffer[1] << 16) |
-        ((uint8_t)g_recv_buffer[2] << 8) |
-        ((uint8_t)g_recv_buffer[3]);
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+
+    // Drain what the socket has, but not much more than the caller can
+    // take: the rest stays in the kernel until the next call
+    int received;
+    do {
+        received = fill_recv_buffer(conn);
+    } while (received > 0 && conn.recv_buffer.size() < (size_t)capacity);
+
+    int count = 0;
+    size_t used = 0;
+    while (count < max_count) {
+        const uint8_t* payload;
+        size_t msg_length;
+        if (!next_message(conn, payload, msg_length)) {
+            break;
+        }
+        if (used + msg_length > (size_t)capacity) {
+            // Keep it for the next call, which may need a larger buffer
+            int kept = keep_message(conn, payload, msg_length);
+            if (count == 0) {
+                return kept;
+            }
+            break;
+        }
+        memcpy(buffer + used, payload, msg_length);
+        offsets[count] = (int)used;
+        lengths[count] = (int)msg_length;
+        used += msg_length;
+        ++count;
+    }
+
+    // Messages already buffered go out before a disconnect is reported
+    if (count == 0 && received < 0) {
+        return -1;
+    }
+    return count;
+}
+
+static int conn_wait_message(sc_conn& conn, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    // The wait holds the buffer lock like every other read of the socket,
+    // so a disconnect cannot close it underneath; its shutdown() ends the
+    // wait first. Sends take other locks and go on.
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    for (;;) {
+        if (conn.carry_pending || conn.recv_buffer.hasCompleteMessage()) {
+            return 1;
+        }
+        if (fill_recv_buffer(conn) < 0) {
+            return -1;  // Error or disconnect
+        }
+        if (conn.recv_buffer.hasCompleteMessage()) {
+            return 1;
+        }
 
-    if (g_recv_buffer.size() < 4 + msg_length) {
-        return 0;  // Message not complete yet
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0) {
+                return 0;
+            }
+            wait_ms = (int)remaining;
+        }
+        if (wait_socket(conn, false, wait_ms) < 0) {
+            return -1;
+        }
     }
+}
 
-    // Check buffer size
-    if ((int)msg_length >= max_length) {
-        set_error("Message too large for buffer");
+static void receiver_main(sc_conn* conn) {
+    // Messages are handed over from here, so the callback runs without the
+    // buffer lock and the buffer is reused (grown only for larger messages)
+    std::vector<char> message;
+    while (!conn->receiver_stop) {
+        int ready = conn_wait_message(*conn, RECEIVER_WAIT_MS);
+        if (ready < 0) {
+            if (!conn->receiver_stop) {
+                conn->receiver_callback(conn->receiver_user_data, nullptr, -1);
+            }
+            break;
+        }
+        while (ready > 0 && !conn->receiver_stop) {
+            size_t msg_length = 0;
+            {
+                std::lock_guard<std::mutex> lock(conn->buffer_mutex);
+                const uint8_t* payload;
+                if (!next_message(*conn, payload, msg_length)) {
+                    break;
+                }
+                message.resize(msg_length + 1);
+                memcpy(message.data(), payload, msg_length);
+                message[msg_length] = '\0';
+            }
+            conn->receiver_callback(conn->receiver_user_data, message.data(), (int)msg_length);
+        }
+    }
+
+    if (conn->receiver_owns_conn) {
+        delete conn;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+}
+
+static int conn_start_receiver(sc_conn& conn, sc_message_callback callback, void* user_data) {
+    std::lock_guard<std::mutex> lock(conn.mutex);
+
+    if (!callback) {
+        set_error(conn, "Null callback");
         return -1;
     }
+    if (!conn.connected) {
+        set_error(conn, "Not connected");
+        return -1;
+    }
+    if (conn.receiver.joinable()) {
+        if (!conn.receiver_stop) {
+            set_error(conn, "Receiver already running");
+            return -1;
+        }
+        conn.receiver.join();  // Stopped from inside its own callback
+    }
 
-    // Copy message to output buffer
-    memcpy(buffer, g_recv_buffer.data() + 4, msg_length);
-    buffer[msg_length] = '\0';  // Null-terminate
+    conn.receiver_stop = false;
+    conn.receiver_callback = callback;
+    conn.receiver_user_data = user_data;
+    conn.receiver = std::thread(receiver_main, &conn);
+    return 0;
+}
 
-    // Remove processed message from buffer
-    g_recv_buffer.erase(g_recv_buffer.begin(), g_recv_buffer.begin() + 4 + msg_length);
+// Features offered in HELLO: everything the protocol library implements
+// except streaming, since next_message() cannot deliver chunk frames
+static Protocol::WireOptions client_wire_options() {
+    Protocol::WireOptions offered = Protocol::WireOptions::supported();
+    offered.streaming = false;
+    return offered;
+}
 
-    return (int)msg_length;
+static int conn_negotiate(sc_conn& conn, int timeout_ms) {
+    if (!conn.connected || conn.socket == INVALID_SOCKET) {
+        set_error(conn, "Not connected");
+        return -1;
+    }
+
+    // HELLO always goes out as JSON
+    {
+        std::lock_guard<std::mutex> lock(conn.send_mutex);
+        conn.send_buffer.clear();
+        Protocol::serializeInto(Protocol::createHelloMessage(client_wire_options()), conn.send_buffer);
+        if (conn_send_raw(conn, reinterpret_cast<const char*>(conn.send_buffer.data()),
+                          (int)conn.send_buffer.size()) < 0) {
+            return -1;
+        }
+    }
+
+    // Wait for HELLO_ACK, then switch both directions to the agreed options
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    for (;;) {
+        while (conn.recv_buffer.hasCompleteMessage()) {
+            Protocol::Message msg = conn.recv_buffer.extractMessage();
+            if (msg.type == Protocol::MessageType::HELLO_ACK) {
+                Protocol::WireOptions agreed;
+                if (!Protocol::parseWireOptions(msg, agreed)) {
+                    set_error(conn, "Malformed HELLO_ACK");
+                    return -1;
+                }
+                {
+                    std::lock_guard<std::mutex> send_lock(conn.send_mutex);
+                    conn.wire = agreed;
+                }
+                conn.recv_buffer.configure(agreed);
+                conn.recv_tracing = agreed.tracing;
+                return 0;
+            }
+            if (msg.type == Protocol::MessageType::ERROR) {
+                // Server without HELLO support: keep the legacy format
+                set_error(conn, "Handshake rejected: " + msg.content);
+                return 1;
+            }
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) {
+            // Older servers drop HELLO silently: keep the legacy format
+            set_error(conn, "Handshake timed out");
+            return 1;
+        }
+
+        int ready = wait_socket(conn, false, (int)remaining);
+        if (ready < 0) {
+            return -1;
+        }
+        if (ready > 0 && fill_recv_buffer(conn) < 0) {
+            return -1;
+        }
+    }
 }
 
-SOCKET_API const char* socket_get_error(void) {
-    return g_last_error.c_str();
+static unsigned long long conn_latency_count(sc_conn& conn) {
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    return conn.latency.count();
 }
 
-SOCKET_API int socket_set_nonblocking(int non_blocking) {
-    std::lock_guard<std::mutex> lock(g_mutex);
+static unsigned long long conn_latency_percentile(sc_conn& conn, double percent) {
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    return conn.latency.percentile(percent);
+}
+
+static int conn_latency_histogram(sc_conn& conn, unsigned long long* buckets, int max_buckets) {
+    if (!buckets || max_buckets <= 0) {
+        set_error(conn, "Invalid histogram buffer");
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    int count = max_buckets < Protocol::LatencyHistogram::BUCKET_COUNT
+                    ? max_buckets : Protocol::LatencyHistogram::BUCKET_COUNT;
+    for (int i = 0; i < count; ++i) {
+        buckets[i] = conn.latency.bucket(i);
+    }
+    return count;
+}
+
+static void conn_latency_reset(sc_conn& conn) {
+    std::lock_guard<std::mutex> lock(conn.buffer_mutex);
+    conn.latency.reset();
+}
+
+static int conn_set_nonblocking(sc_conn& conn, int non_blocking) {
+    std::lock_guard<std::mutex> lock(conn.mutex);
 
-    if (g_socket == INVALID_SOCKET) {
-        set_error("No socket");
+    if (conn.socket == INVALID_SOCKET) {
+        set_error(conn, "No socket");
         return -1;
     }
 
-    u_long mode = non_blocking ? 1 : 0;
-    int result = ioctlsocket(g_socket, FIONBIO, &mode);
+    if (set_blocking_mode(conn.socket, non_blocking != 0) != 0) {
+        set_socket_error(conn, "Failed to set non-blocking mode");
+        return -1;
+    }
+
+    return 0;
+}
+
+// ==================== Default Connection API ====================
+
+SOCKET_API int socket_init(void) {
+    std::lock_guard<std::mutex> lock(g_init_mutex);
+
+    if (g_initialized) {
+        return 0;  // Already initialized
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (result != 0) {
-        set_winsock_error("Failed to set non-blocking mode");
+        set_error(g_default, "WSAStartup failed with error: " + std::to_string(result));
         return -1;
     }
+#endif
 
+    g_initialized = true;
     return 0;
 }
+
+SOCKET_API void socket_cleanup(void) {
+    std::lock_guard<std::mutex> lock(g_init_mutex);
+
+    if (g_initialized) {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        g_initialized = false;
+    }
+}
+
+SOCKET_API int socket_connect(const char* host, int port) {
+    {
+        std::lock_guard<std::mutex> lock(g_init_mutex);
+        if (!g_initialized) {
+            set_error(g_default, "Socket not initialized. Call socket_init() first.");
+            return -1;
+        }
+    }
+    return conn_connect(g_default, host, port);
+}
+
+SOCKET_API void socket_disconnect(void) {
+    conn_disconnect(g_default);
+}
+
+SOCKET_API int socket_is_connected(void) {
+    return g_default.connected ? 1 : 0;
+}
+
+SOCKET_API int socket_send_raw(const char* data, int length) {
+    return conn_send_raw(g_default, data, length);
+}
+
+SOCKET_API int socket_recv_raw(char* buffer, int max_length) {
+    std::lock_guard<std::mutex> lock(g_default.buffer_mutex);
+    return conn_recv_raw(g_default, buffer, max_length);
+}
+
+SOCKET_API int socket_send_message(const char* json_data) {
+    return conn_send_message(g_default, json_data);
+}
+
+SOCKET_API int socket_recv_message(char* buffer, int max_length) {
+    return conn_recv_message(g_default, buffer, max_length);
+}
+
+SOCKET_API int socket_recv_messages(char* buffer, int capacity, int* offsets, int* lengths, int max_count) {
+    return conn_recv_messages(g_default, buffer, capacity, offsets, lengths, max_count);
+}
+
+SOCKET_API int socket_wait_message(int timeout_ms) {
+    return conn_wait_message(g_default, timeout_ms);
+}
+
+SOCKET_API int socket_start_receiver(sc_message_callback callback, void* user_data) {
+    return conn_start_receiver(g_default, callback, user_data);
+}
+
+SOCKET_API void socket_stop_receiver(void) {
+    conn_stop_receiver(g_default);
+}
+
+SOCKET_API int socket_negotiate(int timeout_ms) {
+    return conn_negotiate(g_default, timeout_ms);
+}
+
+SOCKET_API unsigned long long socket_latency_count(void) {
+    return conn_latency_count(g_default);
+}
+
+SOCKET_API unsigned long long socket_latency_percentile(double percent) {
+    return conn_latency_percentile(g_default, percent);
+}
+
+SOCKET_API int socket_latency_histogram(unsigned long long* buckets, int max_buckets) {
+    return conn_latency_histogram(g_default, buckets, max_buckets);
+}
+
+SOCKET_API void socket_latency_reset(void) {
+    conn_latency_reset(g_default);
+}
+
+SOCKET_API const char* socket_get_error(void) {
+    return g_default.last_error.c_str();
+}
+
+SOCKET_API int socket_set_nonblocking(int non_blocking) {
+    return conn_set_nonblocking(g_default, non_blocking);
+}
+
+SOCKET_API unsigned int socket_crc32c(const char* data, int length, unsigned int crc) {
+    if (!data || length <= 0) {
+        return crc;
+    }
+    return Protocol::crc32c(reinterpret_cast<const uint8_t*>(data), static_cast<size_t>(length), crc);
+}
+
+// ==================== Handle API ====================
+
+// Calls on a null handle fail like calls on a closed connection
+#define CHECK_HANDLE(conn, fail)              \
+    if (!(conn)) {                            \
+        t_open_error = "Invalid handle";      \
+        return fail;                          \
+    }
+
+SOCKET_API sc_conn* sc_open(const char* host, int port) {
+    if (!host) {
+        t_open_error = "Null host";
+        return nullptr;
+    }
+
+#ifdef _WIN32
+    // WSAStartup is reference counted: one per handle, undone in sc_close()
+    WSADATA wsaData;
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0) {
+        t_open_error = "WSAStartup failed with error: " + std::to_string(result);
+        return nullptr;
+    }
+#endif
+
+    sc_conn* conn = new (std::nothrow) sc_conn();
+    if (!conn || conn_connect(*conn, host, port) != 0) {
+        t_open_error = conn ? conn->last_error : "Out of memory";
+        delete conn;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return nullptr;
+    }
+    return conn;
+}
+
+SOCKET_API void sc_close(sc_conn* conn) {
+    if (!conn) {
+        return;
+    }
+    conn_disconnect(*conn);  // Also stops the receive thread
+    if (conn->receiver.joinable()) {
+        // Called from the receive callback: the thread frees the
+        // connection itself once the callback returns
+        conn->receiver_owns_conn = true;
+        conn->receiver.detach();
+        return;
+    }
+    delete conn;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+SOCKET_API void sc_disconnect(sc_conn* conn) {
+    if (conn) {
+        conn_disconnect(*conn);
+    }
+}
+
+SOCKET_API int sc_is_connected(sc_conn* conn) {
+    return conn && conn->connected ? 1 : 0;
+}
+
+SOCKET_API int sc_send_raw(sc_conn* conn, const char* data, int length) {
+    CHECK_HANDLE(conn, -1);
+    return conn_send_raw(*conn, data, length);
+}
+
+SOCKET_API int sc_recv_raw(sc_conn* conn, char* buffer, int max_length) {
+    CHECK_HANDLE(conn, -1);
+    std::lock_guard<std::mutex> lock(conn->buffer_mutex);
+    return conn_recv_raw(*conn, buffer, max_length);
+}
+
+SOCKET_API int sc_send(sc_conn* conn, const char* json_data) {
+    CHECK_HANDLE(conn, -1);
+    return conn_send_message(*conn, json_data);
+}
+
+SOCKET_API int sc_recv(sc_conn* conn, char* buffer, int max_length) {
+    CHECK_HANDLE(conn, -1);
+    return conn_recv_message(*conn, buffer, max_length);
+}
+
+SOCKET_API int sc_recv_messages(sc_conn* conn, char* buffer, int capacity,
+                                int* offsets, int* lengths, int max_count) {
+    CHECK_HANDLE(conn, -1);
+    return conn_recv_messages(*conn, buffer, capacity, offsets, lengths, max_count);
+}
+
+SOCKET_API int sc_wait_message(sc_conn* conn, int timeout_ms) {
+    CHECK_HANDLE(conn, -1);
+    return conn_wait_message(*conn, timeout_ms);
+}
+
+SOCKET_API int sc_start_receiver(sc_conn* conn, sc_message_callback callback, void* user_data) {
+    CHECK_HANDLE(conn, -1);
+    return conn_start_receiver(*conn, callback, user_data);
+}
+
+SOCKET_API void sc_stop_receiver(sc_conn* conn) {
+    CHECK_HANDLE(conn, );
+    conn_stop_receiver(*conn);
+}
+
+SOCKET_API int sc_negotiate(sc_conn* conn, int timeout_ms) {
+    CHECK_HANDLE(conn, -1);
+    return conn_negotiate(*conn, timeout_ms);
+}
+
+SOCKET_API unsigned long long sc_latency_count(sc_conn* conn) {
+    CHECK_HANDLE(conn, 0);
+    return conn_latency_count(*conn);
+}
+
+SOCKET_API unsigned long long sc_latency_percentile(sc_conn* conn, double percent) {
+    CHECK_HANDLE(conn, 0);
+    return conn_latency_percentile(*conn, percent);
+}
+
+SOCKET_API int sc_latency_histogram(sc_conn* conn, unsigned long long* buckets, int max_buckets) {
+    CHECK_HANDLE(conn, -1);
+    return conn_latency_histogram(*conn, buckets, max_buckets);
+}
+
+SOCKET_API void sc_latency_reset(sc_conn* conn) {
+    CHECK_HANDLE(conn, );
+    conn_latency_reset(*conn);
+}
+
+SOCKET_API const char* sc_get_error(sc_conn* conn) {
+    return conn ? conn->last_error.c_str() : t_open_error.c_str();
+}
+
+SOCKET_API int sc_set_nonblocking(sc_conn* conn, int non_blocking) {
+    CHECK_HANDLE(conn, -1);
+    return conn_set_nonblocking(*conn, non_blocking);
+}
@@ -2,7 +2,14 @@
  * @file socket_client.h
  * @brief C++ Socket Client Library - DLL Export Header
  *
- * This library provides Winsock socket functionality that can be called from Python via ctypes.
+ * This library provides socket functionality that can be called from Python via ctypes:
+ * socket_client.dll (Winsock, build.bat) on Windows, socket_client.so (BSD sockets,
+ * CMake target socket_client) elsewhere.
+ *
+ * Two APIs share one implementation:
+ * - socket_*: a single connection per process (the original API)
+ * - sc_*: any number of connections, each behind an opaque sc_conn handle
+ *   with its own buffers, error string and locks
  */
 
 #ifndef SOCKET_CLIENT_H
@@ -22,14 +29,31 @@
 extern "C" {
 #endif
 
+/** @brief Opaque connection handle (see the Handle API below) */
+typedef struct sc_conn sc_conn;
+
+/**
+ * @brief Called by the receive thread once per complete message
+ *
+ * Runs on the library's own thread. json_data is the message as
+ * null-terminated JSON and is only valid during the call. After a
+ * disconnect or error the callback runs once more with json_data NULL and
+ * length -1, and the thread exits.
+ *
+ * @param user_data Pointer given when the receiver was started
+ * @param json_data Message JSON, NULL on disconnect
+ * @param length Length of json_data, -1 on disconnect
+ */
+typedef void (*sc_message_callback)(void* user_data, const char* json_data, int length);
+
 /**
- * @brief Initialize Winsock library
+ * @brief Initialize the socket library (WSAStartup on Windows)
  * @return 0 on success, -1 on failure
  */
 SOCKET_API int socket_init(void);
 
 /**
- * @brief Cleanup Winsock library
+ * @brief Cleanup the socket library (WSACleanup on Windows)
  */
 SOCKET_API void socket_cleanup(void);
 
@@ -71,7 +95,8 @@ SOCKET_API int socket_recv_raw(char* buffer, int max_length);
 /**
  * @brief Send a protocol message (with length prefix)
  * @param json_data JSON string to send
- * @return 0 on success, -1 on failure
+ * @return 0 on success, -1 on failure (including a message too large to
+ *         frame for this connection)
  */
 SOCKET_API int socket_send_message(const char* json_data);
 
@@ -79,10 +104,117 @@ SOCKET_API int socket_send_message(const char* json_data);
  * @brief Receive a complete protocol message
  * @param buffer Buffer to store JSON message
  * @param max_length Maximum buffer length
- * @return Length of message received, 0 if no complete message, -1 on error
+ * @return Length of message received, 0 if no complete message, -1 on error,
+ *         -2 if the message does not fit (it is kept: retry with a larger
+ *         buffer, socket_get_error() tells the size)
  */
 SOCKET_API int socket_recv_message(char* buffer, int max_length);
 
+/**
+ * @brief Receive every complete protocol message in one call
+ *
+ * Drains the socket (reading up to about capacity bytes) and packs the
+ * messages back to back into buffer as JSON, without null terminators.
+ * A message that no longer fits is kept for the next call.
+ *
+ * @param buffer Buffer receiving the messages
+ * @param capacity Size of buffer
+ * @param offsets Receives the offset of each message in buffer
+ * @param lengths Receives the length of each message
+ * @param max_count Capacity of offsets and lengths
+ * @return Number of messages, 0 if none is complete, -1 on error/disconnect
+ *         (only once every buffered message has been returned), -2 if the
+ *         first message alone does not fit (it is kept, as for
+ *         socket_recv_message())
+ */
+SOCKET_API int socket_recv_messages(char* buffer, int capacity, int* offsets, int* lengths, int max_count);
+
+/**
+ * @brief Block until a complete message is buffered
+ *
+ * Waits in poll() (select() on Windows) instead of spinning, so callers
+ * need no sleep between empty socket_recv_message() calls. The message
+ * itself is then taken with socket_recv_message().
+ *
+ * @param timeout_ms Maximum time to wait, negative to wait forever
+ * @return 1 if a message is ready, 0 on timeout, -1 on error/disconnect
+ */
+SOCKET_API int socket_wait_message(int timeout_ms);
+
+/**
+ * @brief Start a receive thread that calls back once per message
+ *
+ * Replaces polling with socket_recv_message() / socket_wait_message(),
+ * which must not be used while the receiver runs. Sending is unaffected.
+ * The callback may call socket_stop_receiver() or disconnect, and with
+ * the handle API even sc_close() on its own handle.
+ *
+ * @param callback Function receiving each message
+ * @param user_data Passed through to the callback
+ * @return 0 on success, -1 on failure (not connected or already running)
+ */
+SOCKET_API int socket_start_receiver(sc_message_callback callback, void* user_data);
+
+/**
+ * @brief Stop the receive thread
+ *
+ * Returns once the thread has exited (within ~100 ms), unless called from
+ * the callback itself. Disconnecting stops it as well. The disconnect
+ * callback is only made when the connection is lost, not for a stop.
+ */
+SOCKET_API void socket_stop_receiver(void);
+
+/**
+ * @brief Negotiate wire features with the server (HELLO / HELLO_ACK)
+ *
+ * Must be called right after connecting, before any other message is
+ * sent. On success, socket_send_message() and socket_recv_message() keep
+ * taking and returning JSON but use the agreed encoding on the wire.
+ * A server that answers HELLO with ERROR or not at all within timeout_ms
+ * predates the handshake: the connection stays up on legacy JSON.
+ * Streaming is not offered; chunk frames cannot be delivered as JSON.
+ *
+ * @param timeout_ms Maximum time to wait for HELLO_ACK
+ * @return 0 if negotiated, 1 if staying on legacy JSON (see
+ *         socket_get_error() for why), -1 on failure (connection should
+ *         be dropped)
+ */
+SOCKET_API int socket_negotiate(int timeout_ms);
+
+/**
+ * @brief Get number of traced messages received on this connection
+ *
+ * Only messages stamped by their sender are counted, and only after
+ * socket_negotiate() agreed on tracing. Latency is measured from the
+ * sender's socket_send_message() to the receive here (epoch clocks).
+ *
+ * @return Sample count
+ */
+SOCKET_API unsigned long long socket_latency_count(void);
+
+/**
+ * @brief Get a delivery latency percentile
+ * @param percent Percentile in [0, 100] (e.g. 50, 99)
+ * @return Upper bound in microseconds, 0 if no samples
+ */
+SOCKET_API unsigned long long socket_latency_percentile(double percent);
+
+/**
+ * @brief Copy the delivery latency histogram
+ *
+ * Bucket 0 counts zero latencies, bucket i counts [2^(i-1), 2^i) us.
+ *
+ * @param buckets Array receiving the bucket counts
+ * @param max_buckets Capacity of buckets
+ * @return Number of buckets written, -1 on error
+ */
+SOCKET_API int socket_latency_histogram(unsigned long long* buckets, int max_buckets);
+
+/**
+ * @brief Clear the delivery latency histogram
+ */
+SOCKET_API void socket_latency_reset(void);
+
 /**
  * @brief Get last error message
  * @return Error message string
@@ -91,11 +223,116 @@ SOCKET_API const char* socket_get_error(void);
 
 /**
  * @brief Set socket to non-blocking mode
+ *
+ * Receives never block either way. POSIX sockets start out non-blocking.
+ *
  * @param non_blocking 1 for non-blocking, 0 for blocking
  * @return 0 on success, -1 on failure
  */
 SOCKET_API int socket_set_nonblocking(int non_blocking);
 
+/**
+ * @brief Compute the CRC-32C of frame checksum trailers (Protocol::crc32c)
+ *
+ * Needs no connection; lets the Python protocol module checksum frames
+ * natively.
+ *
+ * @param data Pointer to data
+ * @param length Length of data
+ * @param crc Result of the previous call when checksumming in pieces (0 to start)
+ * @return Checksum
+ */
+SOCKET_API unsigned int socket_crc32c(const char* data, int length, unsigned int crc);
+
+// ==================== Handle API ====================
+
+/**
+ * @brief Open a connection to the server
+ *
+ * No socket_init() is needed. A handle may be used from several threads,
+ * but must not be closed while another thread is still using it (its own
+ * receive thread excepted).
+ *
+ * @param host Server hostname or IP address
+ * @param port Server port
+ * @return Connection handle, NULL on failure (see sc_get_error(NULL))
+ */
+SOCKET_API sc_conn* sc_open(const char* host, int port);
+
+/**
+ * @brief Disconnect and free a connection handle
+ * @param conn Handle from sc_open() (NULL is ignored)
+ */
+SOCKET_API void sc_close(sc_conn* conn);
+
+/**
+ * @brief Disconnect a handle but keep it allocated
+ *
+ * Safe while another thread is blocked in sc_wait_message() or sc_recv()
+ * on the same handle: the wait wakes up and fails. A receive thread is
+ * stopped first (without a disconnect callback). Calls on the handle keep
+ * failing until it is freed with sc_close().
+ *
+ * @param conn Handle from sc_open() (NULL is ignored)
+ */
+SOCKET_API void sc_disconnect(sc_conn* conn);
+
+/**
+ * @brief Check if a handle is still connected
+ * @return 1 if connected, 0 if not
+ */
+SOCKET_API int sc_is_connected(sc_conn* conn);
+
+/** @brief socket_send_raw() on a handle */
+SOCKET_API int sc_send_raw(sc_conn* conn, const char* data, int length);
+
+/** @brief socket_recv_raw() on a handle */
+SOCKET_API int sc_recv_raw(sc_conn* conn, char* buffer, int max_length);
+
+/** @brief socket_send_message() on a handle */
+SOCKET_API int sc_send(sc_conn* conn, const char* json_data);
+
+/** @brief socket_recv_message() on a handle */
+SOCKET_API int sc_recv(sc_conn* conn, char* buffer, int max_length);
+
+/** @brief socket_recv_messages() on a handle */
+SOCKET_API int sc_recv_messages(sc_conn* conn, char* buffer, int capacity,
+                                int* offsets, int* lengths, int max_count);
+
+/** @brief socket_wait_message() on a handle */
+SOCKET_API int sc_wait_message(sc_conn* conn, int timeout_ms);
+
+/** @brief socket_start_receiver() on a handle */
+SOCKET_API int sc_start_receiver(sc_conn* conn, sc_message_callback callback, void* user_data);
+
+/** @brief socket_stop_receiver() on a handle */
+SOCKET_API void sc_stop_receiver(sc_conn* conn);
+
+/** @brief socket_negotiate() on a handle */
+SOCKET_API int sc_negotiate(sc_conn* conn, int timeout_ms);
+
+/** @brief socket_latency_count() on a handle */
+SOCKET_API unsigned long long sc_latency_count(sc_conn* conn);
+
+/** @brief socket_latency_percentile() on a handle */
+SOCKET_API unsigned long long sc_latency_percentile(sc_conn* conn, double percent);
+
+/** @brief socket_latency_histogram() on a handle */
+SOCKET_API int sc_latency_histogram(sc_conn* conn, unsigned long long* buckets, int max_buckets);
+
+/** @brief socket_latency_reset() on a handle */
+SOCKET_API void sc_latency_reset(sc_conn* conn);
+
+/**
+ * @brief Get the last error of a handle
+ * @param conn Handle, or NULL for why the last sc_open() on this thread failed
+ * @return Error message string
+ */
+SOCKET_API const char* sc_get_error(sc_conn* conn);
+
+/** @brief socket_set_nonblocking() on a handle */
+SOCKET_API int sc_set_nonblocking(sc_conn* conn, int non_blocking);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,113 @@
+"""
+gen_message_types.py - Generate message_types.py from common/Protocol.h
+
+The C++ PROTOCOL_MESSAGE_TYPES list is the single source of truth for
+message type values; this script turns it into the Python MessageType enum
+so both sides cannot drift apart.
+
+Usage:
+    python gen_message_types.py           (rewrite message_types.py)
+    python gen_message_types.py --check   (exit 1 if it is out of date)
+"""
+
+import os
+import re
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+HEADER = os.path.join(HERE, "..", "common", "Protocol.h")
+OUTPUT = os.path.join(HERE, "message_types.py")
+
+_ENTRY = re.compile(r'X\(\s*(\w+)\s*,\s*(\d+)\s*,\s*(\w+)\s*,\s*"([^"]*)"\s*\)')
+_COMMENT = re.compile(r'/\*\s*(.*?)\s*\*/')
+
+
+def parse_header(text: str):
+    """Return (categories, entries) where entries are (name, value, category,
+    description) tuples or section comments (str)"""
+    start = text.index("#define PROTOCOL_MESSAGE_TYPES(X)")
+    lines = []
+    for line in text[start:].splitlines()[1:]:
+        lines.append(line)
+        if not line.rstrip().endswith("\\"):
+            break
+
+    entries = []
+    for line in lines:
+        comment = _COMMENT.search(line)
+        entry = _ENTRY.search(line)
+        if entry:
+            name, value, category, description = entry.groups()
+            entries.append((name, int(value), category, description))
+        elif comment:
+            entries.append(comment.group(1))
+
+    block = re.search(r"enum class MessageCategory[^{]*\{([^}]*)\}", text)
+    categories = [c.strip() for c in block.group(1).split(",") if c.strip()]
+    return categories, entries
+
+
+def render(categories, entries) -> str:
+    out = [
+        '"""',
+        "message_types.py - Message types shared with the C++ protocol",
+        "",
+        "GENERATED by gen_message_types.py from PROTOCOL_MESSAGE_TYPES in",
+        "common/Protocol.h. Do not edit; change the header and re-run the script.",
+        '"""',
+        "",
+        "from enum import IntEnum",
+        "",
+        "",
+        "class MessageCategory(IntEnum):",
+        '    """Message categories matching C++ Protocol::MessageCategory"""',
+    ]
+    for index, category in enumerate(categories):
+        out.append(f"    {category} = {index}")
+
+    out += ["", "", "class MessageType(IntEnum):", '    """Message types matching C++ Protocol.h"""']
+    first = True
+    for entry in entries:
+        if isinstance(entry, str):
+            if not first:
+                out.append("")
+            out.append(f"    # {entry}")
+        else:
+            name, value, _, description = entry
+            out.append(f"    {name} = {value}  # {description}")
+        first = False
+
+    out += ["", "", "# Category of every message type (e.g. ADMIN for permission checks)",
+            "MESSAGE_CATEGORY = {"]
+    for entry in entries:
+        if not isinstance(entry, str):
+            name, _, category, _ = entry
+            out.append(f"    MessageType.{name}: MessageCategory.{category},")
+    out += ["}", ""]
+    return "\n".join(out)
+
+
+def main() -> int:
+    with open(HEADER, encoding="utf-8") as f:
+        categories, entries = parse_header(f.read())
+    text = render(categories, entries)
+
+    if "--check" in sys.argv[1:]:
+        try:
+            with open(OUTPUT, encoding="utf-8") as f:
+                current = f.read()
+        except FileNotFoundError:
+            current = None
+        if current != text:
+            print(f"{OUTPUT} is out of date; run gen_message_types.py")
+            return 1
+        return 0
+
+    with open(OUTPUT, "w", encoding="utf-8", newline="\n") as f:
+        f.write(text)
+    print(f"Wrote {OUTPUT}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
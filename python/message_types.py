@@ -0,0 +1,102 @@
+"""
+message_types.py - Message types shared with the C++ protocol
+
+GENERATED by gen_message_types.py from PROTOCOL_MESSAGE_TYPES in
+common/Protocol.h. Do not edit; change the header and re-run the script.
+"""
+
+from enum import IntEnum
+
+
+class MessageCategory(IntEnum):
+    """Message categories matching C++ Protocol::MessageCategory"""
+    AUTH = 0
+    CHAT = 1
+    USER = 2
+    ADMIN = 3
+    NOTIFICATION = 4
+    RESPONSE = 5
+    HEARTBEAT = 6
+    HANDSHAKE = 7
+
+
+class MessageType(IntEnum):
+    """Message types matching C++ Protocol.h"""
+    # Authentication
+    REGISTER = 1  # Create an account
+    LOGIN = 2  # Log in
+    LOGOUT = 3  # Log out
+    CHANGE_PASSWORD = 4  # Change own password
+
+    # Chat
+    MSG_GLOBAL = 10  # Message to everyone
+    MSG_PRIVATE = 11  # Message to one user
+
+    # User Management
+    ONLINE_LIST = 20  # Online users list
+    USER_STATUS = 21  # User online/offline notification
+    USER_INFO = 22  # Get user information
+
+    # Member Management (Admin only)
+    KICK_USER = 30  # Kick user from server
+    BAN_USER = 31  # Ban user (cannot login)
+    UNBAN_USER = 32  # Unban user
+    MUTE_USER = 33  # Mute user (cannot send messages)
+    UNMUTE_USER = 34  # Unmute user
+    PROMOTE_USER = 35  # Promote to admin
+    DEMOTE_USER = 36  # Demote to member
+    GET_ALL_USERS = 37  # Get all registered users
+    GET_BANNED_LIST = 38  # Get banned users list
+    GET_MUTED_LIST = 39  # Get muted users list
+
+    # Notifications
+    KICKED = 40  # You have been kicked
+    BANNED = 41  # You have been banned
+    MUTED = 42  # You have been muted
+    UNMUTED = 43  # You have been unmuted
+
+    # Responses
+    OK = 100  # Request succeeded
+    ERROR = 101  # Request failed
+
+    # Heartbeat
+    PING = 200  # Keep-alive probe
+    PONG = 201  # Keep-alive answer
+
+    # Capability negotiation
+    HELLO = 202  # Client offers its wire features
+    HELLO_ACK = 203  # Server answers with the agreed features
+
+
+# Category of every message type (e.g. ADMIN for permission checks)
+MESSAGE_CATEGORY = {
+    MessageType.REGISTER: MessageCategory.AUTH,
+    MessageType.LOGIN: MessageCategory.AUTH,
+    MessageType.LOGOUT: MessageCategory.AUTH,
+    MessageType.CHANGE_PASSWORD: MessageCategory.AUTH,
+    MessageType.MSG_GLOBAL: MessageCategory.CHAT,
+    MessageType.MSG_PRIVATE: MessageCategory.CHAT,
+    MessageType.ONLINE_LIST: MessageCategory.USER,
+    MessageType.USER_STATUS: MessageCategory.USER,
+    MessageType.USER_INFO: MessageCategory.USER,
+    MessageType.KICK_USER: MessageCategory.ADMIN,
+    MessageType.BAN_USER: MessageCategory.ADMIN,
+    MessageType.UNBAN_USER: MessageCategory.ADMIN,
+    MessageType.MUTE_USER: MessageCategory.ADMIN,
+    MessageType.UNMUTE_USER: MessageCategory.ADMIN,
+    MessageType.PROMOTE_USER: MessageCategory.ADMIN,
+    MessageType.DEMOTE_USER: MessageCategory.ADMIN,
+    MessageType.GET_ALL_USERS: MessageCategory.ADMIN,
+    MessageType.GET_BANNED_LIST: MessageCategory.ADMIN,
+    MessageType.GET_MUTED_LIST: MessageCategory.ADMIN,
+    MessageType.KICKED: MessageCategory.NOTIFICATION,
+    MessageType.BANNED: MessageCategory.NOTIFICATION,
+    MessageType.MUTED: MessageCategory.NOTIFICATION,
+    MessageType.UNMUTED: MessageCategory.NOTIFICATION,
+    MessageType.OK: MessageCategory.RESPONSE,
+    MessageType.ERROR: MessageCategory.RESPONSE,
+    MessageType.PING: MessageCategory.HEARTBEAT,
+    MessageType.PONG: MessageCategory.HEARTBEAT,
+    MessageType.HELLO: MessageCategory.HANDSHAKE,
+    MessageType.HELLO_ACK: MessageCategory.HANDSHAKE,
+}
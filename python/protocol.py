@@ -1,15 +1,22 @@
 """
 protocol.py - Shared protocol for TCP Chat Application
-Compatible with C++ server protocol (length-prefixed JSON)
+Compatible with C++ server protocol (length-prefixed JSON or binary payload)
 """
 
 import json
 import struct
+import threading
+import time
+import zlib
+from collections import deque
 from enum import IntEnum
-from dataclasses import dataclass
-from typing import Optional
+from dataclasses import dataclass, field, replace
+from typing import Callable, Dict, List, Optional, Tuple, Union
 from datetime import datetime
 
+# Generated from common/Protocol.h (see gen_message_types.py)
+from message_types import MessageType, MessageCategory, MESSAGE_CATEGORY
+
 
 # Global socket log callback
 _socket_log_callback = None
@@ -32,42 +39,97 @@ def socket_log(tag: str, message: str, color_code: str = ""):
         _socket_log_callback(log_msg)
 
 
-class MessageType(IntEnum):
-    """Message types matching C++ Protocol.h"""
-    REGISTER = 1
-    LOGIN = 2
-    LOGOUT = 3
-    CHANGE_PASSWORD = 4
+class WireFormat(IntEnum):
+    """Payload encodings matching C++ Protocol::WireFormat"""
+    JSON = 0
+    BINARY = 1
+
+
+PROTOCOL_VERSION = 1
+MAX_MESSAGE_SIZE = 1024 * 1024
+MAX_REQUEST_ID = 0xFFFFFFFF
+
+# Frame flags in the high byte of the length prefix (C++ FRAME_FLAG_*)
+FRAME_FLAG_ROUTED = 0x08
+FRAME_FLAG_BATCH = 0x10
+FRAME_FLAG_MORE = 0x20
+FRAME_FLAG_CHUNK = 0x40
+FRAME_FLAG_COMPRESSED = 0x80
+FRAME_LENGTH_MASK = 0x00FFFFFF
+_KNOWN_FRAME_FLAGS = (FRAME_FLAG_ROUTED | FRAME_FLAG_BATCH | FRAME_FLAG_MORE |
+                      FRAME_FLAG_CHUNK | FRAME_FLAG_COMPRESSED)
+
+# Checksum trailer (big-endian CRC-32C) behind frames on connections that agreed on it
+CHECKSUM_SIZE = 4
+# A lost buffer gives up searching for the next good frame after this many max-size frames
+_RESYNC_BUDGET_FRAMES = 4
+
+# Payloads below this size are not worth compressing
+COMPRESSION_THRESHOLD = 512
 
-    MSG_GLOBAL = 10
-    MSG_PRIVATE = 11
 
-    ONLINE_LIST = 20
-    USER_STATUS = 21
-    USER_INFO = 22
+@dataclass
+class WireOptions:
+    """Wire features offered in HELLO or agreed in HELLO_ACK (C++ Protocol::WireOptions)"""
+    version: int = PROTOCOL_VERSION
+    format: WireFormat = WireFormat.JSON
+    compression: bool = False
+    compression_threshold: int = 0
+    batching: bool = False
+    streaming: bool = False
+    max_frame_size: int = MAX_MESSAGE_SIZE
+    tracing: bool = False
+    typed_payloads: bool = False  # Message.fields on the wire (BINARY only)
+    routing: bool = False  # Route headers on private messages
+    name_dictionary: bool = False  # Sender names as per-connection ids (BINARY only)
+    request_ids: bool = False  # Message.request_id in BINARY payloads (JSON always has it)
+    checksums: bool = False  # CRC-32C trailer behind every frame
+
+    @classmethod
+    def supported(cls) -> 'WireOptions':
+        """Features implemented by this module"""
+        return cls(format=WireFormat.BINARY, compression=True,
+                   compression_threshold=COMPRESSION_THRESHOLD, batching=True, tracing=True,
+                   typed_payloads=True, routing=True, name_dictionary=True, request_ids=True,
+                   checksums=CRC32C_ACCELERATED)
 
-    KICK_USER = 30
-    BAN_USER = 31
-    UNBAN_USER = 32
-    MUTE_USER = 33
-    UNMUTE_USER = 34
-    PROMOTE_USER = 35
-    DEMOTE_USER = 36
+    def to_json(self, offer: bool) -> str:
+        codecs = []
+        if offer or self.format == WireFormat.JSON:
+            codecs.append("json")
+        if self.format == WireFormat.BINARY:
+            codecs.append("binary")
+        return json.dumps({
+            "version": self.version,
+            "codecs": codecs,
+            "compression": self.compression,
+            "compressionThreshold": self.compression_threshold,
+            "batching": self.batching,
+            "streaming": self.streaming,
+            "maxFrameSize": self.max_frame_size,
+            "tracing": self.tracing,
+            "typedPayloads": self.typed_payloads,
+            "routing": self.routing,
+            "nameDictionary": self.name_dictionary,
+            "requestIds": self.request_ids,
+            "checksums": self.checksums
+        })
 
-    GET_ALL_USERS = 40
-    GET_BANNED_LIST = 41
-    GET_MUTED_LIST = 42
 
-    KICKED = 50
-    BANNED = 51
-    MUTED = 52
-    UNMUTED = 53
+def now_micros() -> int:
+    """Wall-clock microseconds since the Unix epoch (resolution of TraceStamps)"""
+    return time.time_ns() // 1000
 
-    OK = 100
-    ERROR = 101
 
-    PING = 200
-    PONG = 201
+@dataclass
+class TraceStamps:
+    """Latency trace in epoch microseconds, 0 = not stamped (C++ Protocol::TraceStamps)"""
+    client_send: int = 0
+    server_recv: int = 0
+    server_send: int = 0
+
+    def empty(self) -> bool:
+        return not (self.client_send or self.server_recv or self.server_send)
 
 
 @dataclass
@@ -79,9 +141,16 @@ class Message:
     content: str = ""
     timestamp: str = ""
     extra: str = ""
+    fields: List[str] = field(default_factory=list)  # Typed payload (see create_login_message etc.)
+    trace: TraceStamps = field(default_factory=TraceStamps)  # Only sent if tracing was agreed
+    request_id: int = 0  # Set by the client to match the OK / ERROR answer (0 = none)
+    ascii_only: bool = False  # Set on receive when every string is 7-bit ASCII (False = unknown)
 
-    def to_dict(self) -> dict:
-        return {
+    def to_dict(self, with_trace: bool = True) -> dict:
+        """JSON form; typed fields are lowered to their legacy content / extra"""
+        if self.fields:
+            return _legacy_form(self).to_dict(with_trace)
+        data = {
             "type": int(self.type),
             "sender": self.sender,
             "receiver": self.receiver,
@@ -89,37 +158,615 @@ class Message:
             "timestamp": self.timestamp,
             "extra": self.extra
         }
+        if self.request_id:
+            data["requestId"] = self.request_id
+        if with_trace and not self.trace.empty():
+            data["trace"] = {
+                "clientSend": self.trace.client_send,
+                "serverRecv": self.trace.server_recv,
+                "serverSend": self.trace.server_send
+            }
+        return data
 
     @classmethod
     def from_dict(cls, data: dict) -> 'Message':
-        return cls(
+        trace = data.get("trace")
+        if not isinstance(trace, dict):
+            trace = {}
+        request_id = data.get("requestId", 0)
+        if not isinstance(request_id, int) or not 0 <= request_id <= MAX_REQUEST_ID:
+            raise ValueError("malformed request id")
+        msg = cls(
             type=MessageType(data.get("type", 0)),
             sender=data.get("sender", ""),
             receiver=data.get("receiver", ""),
             content=data.get("content", ""),
             timestamp=data.get("timestamp", ""),
-            extra=data.get("extra", "")
+            extra=data.get("extra", ""),
+            trace=TraceStamps(
+                client_send=int(trace.get("clientSend", 0)),
+                server_recv=int(trace.get("serverRecv", 0)),
+                server_send=int(trace.get("serverSend", 0))
+            ),
+            request_id=request_id
         )
+        msg.ascii_only = _is_ascii(msg)
+        return msg
+
+
+class LatencyHistogram:
+    """Power-of-two latency buckets in microseconds (C++ Protocol::LatencyHistogram)
+
+    Bucket 0 counts zero latencies, bucket i counts [2^(i-1), 2^i) us and
+    the last bucket also takes everything larger.
+    """
+    BUCKET_COUNT = 32
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.buckets = [0] * self.BUCKET_COUNT
+        self.count = 0
+        self.total = 0
+        self.max = 0
+
+    def record(self, micros: int):
+        micros = max(micros, 0)
+        self.buckets[min(micros.bit_length(), self.BUCKET_COUNT - 1)] += 1
+        self.count += 1
+        self.total += micros
+        self.max = max(self.max, micros)
+
+    def record_trace(self, trace: TraceStamps, now: int) -> bool:
+        """Record now - client_send; False if the message was not stamped by its sender"""
+        if not trace.client_send:
+            return False
+        self.record(now - trace.client_send)
+        return True
+
+    def percentile(self, percent: float) -> int:
+        """Upper bound of the given percentile (0 if empty)"""
+        if not self.count:
+            return 0
+        rank = min(max(percent, 0.0), 100.0) / 100.0 * self.count
+        seen = 0
+        for index, n in enumerate(self.buckets):
+            seen += n
+            if seen and seen >= rank:
+                if index == self.BUCKET_COUNT - 1:
+                    return self.max
+                return min((1 << index) - 1, self.max)
+        return self.max
+
+    def summary(self) -> str:
+        return (f"n={self.count} p50={self.percentile(50)}us p99={self.percentile(99)}us "
+                f"max={self.max}us")
+
+
+class PendingRequests:
+    """Requests sent with an id and still waiting for their OK / ERROR
+
+    Lets a client pipeline requests instead of waiting for each answer:
+    register() stamps the message with a free id, complete() hands the
+    answer to that request's callback.
+    """
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._next_id = 1
+        self._callbacks: Dict[int, Callable[[Message], None]] = {}
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._callbacks)
+
+    def register(self, msg: Message, callback: Callable[[Message], None]) -> int:
+        """Give msg a request id (1..MAX_REQUEST_ID, skipping ids in flight)"""
+        with self._lock:
+            while self._next_id in self._callbacks:
+                self._next_id = self._next_id % MAX_REQUEST_ID + 1
+            msg.request_id = self._next_id
+            self._callbacks[msg.request_id] = callback
+            self._next_id = self._next_id % MAX_REQUEST_ID + 1
+            return msg.request_id
+
+    def cancel(self, request_id: int):
+        """Forget a request whose frame never went out"""
+        with self._lock:
+            self._callbacks.pop(request_id, None)
+
+    def complete(self, msg: Message) -> bool:
+        """Run the callback an OK / ERROR answers; False if it answers no pending request"""
+        if msg.type not in (MessageType.OK, MessageType.ERROR) or not msg.request_id:
+            return False
+        with self._lock:
+            callback = self._callbacks.pop(msg.request_id, None)
+        if callback is None:
+            return False
+        callback(msg)
+        return True
+
+    def fail_all(self, reason: str):
+        """Answer every pending request with an ERROR (e.g. on disconnect)"""
+        with self._lock:
+            pending = list(self._callbacks.items())
+            self._callbacks.clear()
+        for request_id, callback in pending:
+            callback(Message(type=MessageType.ERROR, content=reason, request_id=request_id))
+
+
+def _is_ascii(msg: Message) -> bool:
+    """Whether every string is 7-bit ASCII; str.isascii() is O(1), the decoder already knows"""
+    return (msg.sender.isascii() and msg.receiver.isascii() and msg.content.isascii() and
+            msg.timestamp.isascii() and msg.extra.isascii() and all(f.isascii() for f in msg.fields))
+
+
+def _legacy_form(msg: Message) -> Message:
+    """What peers without typed payloads expect (C++ legacyForm)"""
+    f = msg.fields
+    lowered = replace(msg, fields=[])
+    if msg.type in (MessageType.LOGIN, MessageType.REGISTER) and len(f) >= 2:
+        lowered.content = json.dumps({"username": f[0], "password": f[1]})
+    elif msg.type == MessageType.CHANGE_PASSWORD and len(f) >= 2:
+        lowered.content = json.dumps({"oldPassword": f[0], "newPassword": f[1]})
+    elif msg.type == MessageType.ONLINE_LIST:
+        lowered.extra = json.dumps(f)
+    elif msg.type == MessageType.USER_STATUS and f:
+        lowered.content = f[0]
+        lowered.extra = json.dumps({"status": f[0]})
+    return lowered
+
+
+# Binary payload: [type][flags][sender][receiver][content][timestamp][extra][fields][trace]
+# where each string is [varint length][UTF-8 bytes] (see C++ Protocol.h)
+_BINARY_FIELDS = ("sender", "receiver", "content", "timestamp", "extra")
+_BINARY_FLAG_TRACE = 0x01   # Trailing varints: client_send, server_recv, server_send
+_BINARY_FLAG_FIELDS = 0x02  # Typed payload: [varint size][[varint length][bytes]...]
+_BINARY_FLAG_NAME = 0x04    # Sender is varint((id << 1) | define) [+ name if define]
+_BINARY_FLAG_REQUEST = 0x08  # Varint request_id after the typed fields
+
+MAX_NAME_DICTIONARY = 4096
+
+
+class NameDictionary:
+    """Per-connection dictionary of sender names (C++ Protocol::NameDictionary)
+
+    Each direction of a connection has its own: the sender passes one to
+    serialize(), the receiver's MessageBuffer keeps the other. Ids are
+    never reassigned.
+    """
+
+    def __init__(self):
+        self.names: List[str] = []
+        self.ids: Dict[str, int] = {}
+
+    def encode(self, name: str):
+        """Return (id, define) for a name to send, or None if the dictionary is full"""
+        name_id = self.ids.get(name)
+        if name_id is not None:
+            return name_id, False
+        if len(self.names) >= MAX_NAME_DICTIONARY:
+            return None
+        name_id = len(self.names)
+        self.names.append(name)
+        self.ids[name] = name_id
+        return name_id, True
+
+    def define(self, name_id: int, name: str) -> bool:
+        """Record a name defined by the peer; ids arrive in order"""
+        if name_id < len(self.names):
+            return self.names[name_id] == name
+        if name_id != len(self.names) or name_id >= MAX_NAME_DICTIONARY:
+            return False
+        self.names.append(name)
+        return True
+
+    def resolve(self, name_id: int) -> str:
+        if name_id >= len(self.names):
+            raise ValueError("invalid name reference")
+        return self.names[name_id]
+
+    def clear(self):
+        self.names.clear()
+        self.ids.clear()
+
+
+def _write_varint(out: bytearray, value: int):
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def _read_varint(data: bytes, pos: int):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(data) or shift >= 64:
+            raise ValueError("truncated binary payload")
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, pos
+        shift += 7
+
+
+def _encode_binary(msg: Message, with_trace: bool = True, typed: bool = False,
+                   names: Optional[NameDictionary] = None, request_ids: bool = True) -> bytes:
+    traced = with_trace and not msg.trace.empty()
+    with_fields = typed and bool(msg.fields)
+    with_request = request_ids and bool(msg.request_id)
+    entry = names.encode(msg.sender) if names is not None and msg.sender else None
+    flags = ((_BINARY_FLAG_TRACE if traced else 0) | (_BINARY_FLAG_FIELDS if with_fields else 0) |
+             (_BINARY_FLAG_NAME if entry else 0) | (_BINARY_FLAG_REQUEST if with_request else 0))
+    out = bytearray((int(msg.type), flags))
+    for name in _BINARY_FIELDS:
+        raw = getattr(msg, name).encode('utf-8')
+        if name == "sender" and entry:
+            _write_varint(out, (entry[0] << 1) | entry[1])
+            if not entry[1]:
+                continue
+        _write_varint(out, len(raw))
+        out += raw
+    if with_fields:
+        packed = bytearray()
+        for value in msg.fields:
+            raw = value.encode('utf-8')
+            _write_varint(packed, len(raw))
+            packed += raw
+        _write_varint(out, len(packed))
+        out += packed
+    if with_request:
+        _write_varint(out, msg.request_id)
+    if traced:
+        _write_varint(out, msg.trace.client_send)
+        _write_varint(out, msg.trace.server_recv)
+        _write_varint(out, msg.trace.server_send)
+    return bytes(out)
+
+
+def _decode_binary(data: bytes, names: Optional[NameDictionary] = None) -> Message:
+    if len(data) < 2:
+        raise ValueError("truncated binary payload")
+    flags = data[1]
+    if flags & ~(_BINARY_FLAG_TRACE | _BINARY_FLAG_FIELDS | _BINARY_FLAG_NAME | _BINARY_FLAG_REQUEST):
+        raise ValueError("unsupported binary flags")
+    msg = Message(type=MessageType(data[0]))
+    pos = 2
+    for name in _BINARY_FIELDS:
+        if name == "sender" and flags & _BINARY_FLAG_NAME:
+            if names is None:
+                raise ValueError("name reference outside a name dictionary")
+            code, pos = _read_varint(data, pos)
+            if not code & 1:
+                msg.sender = names.resolve(code >> 1)
+                continue
+            length, pos = _read_varint(data, pos)
+            if pos + length > len(data):
+                raise ValueError("truncated binary payload")
+            msg.sender = data[pos:pos + length].decode('utf-8')
+            if not names.define(code >> 1, msg.sender):
+                raise ValueError("invalid name definition")
+            pos += length
+            continue
+        length, pos = _read_varint(data, pos)
+        if pos + length > len(data):
+            raise ValueError("truncated binary payload")
+        setattr(msg, name, data[pos:pos + length].decode('utf-8'))
+        pos += length
+    if flags & _BINARY_FLAG_FIELDS:
+        size, pos = _read_varint(data, pos)
+        end = pos + size
+        if end > len(data):
+            raise ValueError("truncated binary payload")
+        while pos < end:
+            length, pos = _read_varint(data, pos)
+            if pos + length > end:
+                raise ValueError("malformed typed payload")
+            msg.fields.append(data[pos:pos + length].decode('utf-8'))
+            pos += length
+    if flags & _BINARY_FLAG_REQUEST:
+        msg.request_id, pos = _read_varint(data, pos)
+        if msg.request_id > MAX_REQUEST_ID:
+            raise ValueError("request id out of range")
+    if flags & _BINARY_FLAG_TRACE:
+        msg.trace.client_send, pos = _read_varint(data, pos)
+        msg.trace.server_recv, pos = _read_varint(data, pos)
+        msg.trace.server_send, pos = _read_varint(data, pos)
+    msg.ascii_only = _is_ascii(msg)
+    return msg
+
+
+@dataclass
+class RouteHeader:
+    """Route header of a routed frame (C++ Protocol::RouteHeader)"""
+    type: MessageType
+    sender: str = ""
+    receiver: str = ""
+    flags: int = 0          # ROUTE_FLAG_*; senders send 0
+    timestamp: str = ""     # Set by the relay (ROUTE_FLAG_TIMESTAMP)
+    frame_length: int = 0   # Payload length of the whole frame, route header included
+    header_length: int = 0  # Length of the route header itself
+
+    def apply_to(self, msg: Message):
+        """The route header is authoritative over the body's addressing and relay timestamp"""
+        msg.type = self.type
+        msg.sender = self.sender
+        msg.receiver = self.receiver
+        msg.ascii_only = msg.ascii_only and self.sender.isascii() and self.receiver.isascii()
+        if self.flags & ROUTE_FLAG_TIMESTAMP:
+            msg.timestamp = self.timestamp
+            msg.ascii_only = msg.ascii_only and self.timestamp.isascii()
+
+
+# Route header: [type][route flags][sender][receiver][timestamp if stamped], strings as in BINARY
+ROUTE_FLAG_TIMESTAMP = 0x01  # The relay's timestamp follows the receiver
+
+
+def _is_routable(msg: Message) -> bool:
+    return msg.type == MessageType.MSG_PRIVATE and bool(msg.receiver)
+
+
+def _encode_route_header(msg: Message, timestamp: Optional[str] = None) -> bytes:
+    out = bytearray((int(msg.type), 0 if timestamp is None else ROUTE_FLAG_TIMESTAMP))
+    for value in (msg.sender, msg.receiver) if timestamp is None else (msg.sender, msg.receiver, timestamp):
+        raw = value.encode('utf-8')
+        _write_varint(out, len(raw))
+        out += raw
+    return bytes(out)
+
+
+def _decode_route_header(data: bytes, start: int, end: int):
+    """Decode the route header of the payload data[start:end] without copying the body
+
+    Returns (RouteHeader, body offset in data); raises ValueError if malformed.
+    """
+    if end - start < 2:
+        raise ValueError("malformed route header")
+    route = RouteHeader(type=MessageType(data[start]), flags=data[start + 1], frame_length=end - start)
+    if route.flags & ~ROUTE_FLAG_TIMESTAMP:
+        raise ValueError("unsupported route flags")
+    pos = start + 2
+    names = []
+    for _ in range(3 if route.flags & ROUTE_FLAG_TIMESTAMP else 2):
+        length, pos = _read_varint(data, pos)
+        if pos + length > end:
+            raise ValueError("malformed route header")
+        names.append(data[pos:pos + length].decode('utf-8'))
+        pos += length
+    route.sender, route.receiver = names[:2]
+    if len(names) == 3:
+        route.timestamp = names[2]
+    route.header_length = pos - start
+    return route, pos
+
+
+def _locate_binary_content(data, start: int, end: int) -> Optional[Tuple[int, int, int]]:
+    """Find the content of the BINARY payload data[start:end] without decoding it
+
+    Returns (content start, content end, request id), or None if the payload
+    is malformed or refers to a name dictionary.
+    """
+    try:
+        if end - start < 2 or data[start + 1] & ~(_BINARY_FLAG_TRACE | _BINARY_FLAG_FIELDS | _BINARY_FLAG_REQUEST):
+            return None
+        flags = data[start + 1]
+        pos = start + 2
+        spans = {}
+        for name in _BINARY_FIELDS:
+            length, pos = _read_varint(data, pos)
+            spans[name] = (pos, pos + length)
+            pos += length
+        if flags & _BINARY_FLAG_FIELDS:
+            size, pos = _read_varint(data, pos)
+            pos += size
+        request_id = 0
+        if flags & _BINARY_FLAG_REQUEST:
+            request_id, pos = _read_varint(data, pos)
+        if pos > end:
+            return None
+        content_start, content_end = spans["content"]
+        return content_start, content_end, request_id
+    except ValueError:
+        return None
+
+
+def restamp_routed_frame(frame: bytes, route: RouteHeader, timestamp: str, options: WireOptions) -> bytes:
+    """Rebuild a frame from MessageBuffer.take_frame() with the relay's timestamp in its route header
+
+    The body is copied untouched; only the headers and the checksum trailer
+    are written anew.
+    """
+    payload = _encode_route_header(route, timestamp) + frame[4 + route.header_length:4 + route.frame_length]
+    return _checksum_frame(struct.pack('>I', (FRAME_FLAG_ROUTED << 24) | len(payload)) + payload, options)
+
+
+def can_forward_verbatim(route: RouteHeader, sender: WireOptions, receiver: WireOptions) -> bool:
+    """True if a routed frame can be relayed to the receiver byte-for-byte"""
+    return (receiver.routing and receiver.format == sender.format and receiver.checksums == sender.checksums
+            and route.frame_length <= receiver.max_frame_size)
+
+
+def _make_crc32c_table() -> List[int]:
+    table = []
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = (crc >> 1) ^ (0x82F63B78 if crc & 1 else 0)
+        table.append(crc)
+    return table
+
+
+_CRC32C_TABLE = _make_crc32c_table()
 
 
-def serialize(msg: Message) -> bytes:
-    """Serialize message to bytes with 4-byte length prefix (big-endian)"""
-    json_str = json.dumps(msg.to_dict())
-    payload = json_str.encode('utf-8')
+def _crc32c_python(data: bytes, crc: int = 0) -> int:
+    table = _CRC32C_TABLE
+    crc ^= 0xFFFFFFFF
+    for byte in data:
+        crc = (crc >> 8) ^ table[(crc ^ byte) & 0xFF]
+    return crc ^ 0xFFFFFFFF
+
+
+def _load_native_crc32c() -> Optional[Callable[[bytes, int], int]]:
+    """CRC-32C from the optional crc32c module, else from the native socket library"""
+    try:
+        import crc32c as module
+        return lambda data, crc=0: module.crc32c(data, crc)
+    except ImportError:
+        pass
+    try:
+        import ctypes
+        from socket_wrapper import find_library
+        path = find_library()
+        function = ctypes.CDLL(path).socket_crc32c if path else None
+    except (ImportError, OSError, AttributeError):
+        function = None
+    if function is None:
+        return None
+    function.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_uint]
+    function.restype = ctypes.c_uint
+    return lambda data, crc=0: function(bytes(data), len(data), crc)
+
+
+_CRC32C_NATIVE = _load_native_crc32c()
+
+# The per-byte Python loop costs tens of microseconds per small frame, so
+# checksums are only offered when a native implementation was found
+CRC32C_ACCELERATED = _CRC32C_NATIVE is not None
+
+
+def crc32c(data: bytes, crc: int = 0) -> int:
+    """CRC-32C (Castagnoli) of data, continuing from crc (C++ Protocol::crc32c)"""
+    if _CRC32C_NATIVE is not None:
+        return _CRC32C_NATIVE(data, crc)
+    return _crc32c_python(data, crc)
+
+
+def _checksum_frame(frame: bytes, options: Optional[WireOptions]) -> bytes:
+    """Append the checksum trailer if the connection agreed on checksums"""
+    if options is None or not options.checksums:
+        return frame
+    return frame + struct.pack('>I', crc32c(frame))
+
+
+def _compress_frame(frame: bytes, options: Optional[WireOptions]) -> bytes:
+    """Compress a frame as [varint raw length][zlib stream] if the connection agreed on it"""
+    payload = frame[4:]
+    if options is None or not options.compression or not payload or len(payload) < options.compression_threshold:
+        return frame
+    out = bytearray()
+    _write_varint(out, len(payload))
+    out += zlib.compress(payload, 1)
+    if len(out) >= len(payload):
+        return frame  # Incompressible: keep the plain frame
+    socket_log("[COMPRESS]", f"{len(payload)} -> {len(out)} bytes")
+    return struct.pack('>I', ((frame[0] | FRAME_FLAG_COMPRESSED) << 24) | len(out)) + bytes(out)
+
+
+def _inflate_payload(payload: bytes, limit: int) -> bytes:
+    raw_length, pos = _read_varint(payload, 0)
+    if raw_length == 0 or raw_length > limit:
+        raise ValueError("decompressed frame too large")
+    inflater = zlib.decompressobj()
+    raw = inflater.decompress(payload[pos:], raw_length)
+    if len(raw) != raw_length or not inflater.eof or inflater.unconsumed_tail or inflater.unused_data:
+        raise ValueError("corrupt compressed frame")
+    return raw
+
+
+def serialize(msg: Message, fmt: Union[WireFormat, WireOptions] = WireFormat.JSON,
+              names: Optional[NameDictionary] = None) -> bytes:
+    """Serialize message to bytes with 4-byte length prefix (big-endian)
+
+    fmt is either a payload encoding or the WireOptions agreed for the
+    connection, in which case large payloads are compressed as agreed.
+    names is the connection's sending-side NameDictionary; frames must be
+    sent in the order they are serialized.
+    """
+    options = fmt if isinstance(fmt, WireOptions) else None
+    with_trace = options is None or options.tracing
+    if options is not None:
+        fmt = options.format
+    typed = options is not None and options.typed_payloads and fmt == WireFormat.BINARY
+    if msg.fields and not typed:
+        msg = _legacy_form(msg)
+    routed = options is not None and options.routing and _is_routable(msg)
+    if fmt == WireFormat.BINARY:
+        # Routed frames are relayed to other connections: never use this one's names
+        use_names = options is not None and options.name_dictionary and not routed
+        request_ids = options is None or options.request_ids
+        payload = _encode_binary(msg, with_trace, typed, names if use_names else None, request_ids)
+    else:
+        json_str = json.dumps(msg.to_dict(with_trace))
+        payload = json_str.encode('utf-8')
+    if routed:
+        payload = _encode_route_header(msg) + payload
     length = len(payload)
-    header = struct.pack('>I', length)  # Big-endian unsigned int
+    flags = FRAME_FLAG_ROUTED if routed else 0
+    header = struct.pack('>I', (flags << 24) | length)  # Big-endian unsigned int
     full_msg = header + payload
     
     # Detailed logs to terminal/GUI
     socket_log("[SERIALIZE]", f"{MessageType(msg.type).name}: {len(full_msg)} bytes (4 header + {length} payload)")
-    socket_log("[JSON]", f"{json_str}")
-    
-    return full_msg
+    if fmt == WireFormat.JSON:
+        socket_log("[JSON]", f"{json_str}")
+
+    if routed:
+        return _checksum_frame(full_msg, options)  # Relays read the route header as is
+    return _checksum_frame(_compress_frame(full_msg, options), options)
+
+
+def serialize_batch(messages: List[Message], fmt: Union[WireFormat, WireOptions] = WireFormat.JSON,
+                    names: Optional[NameDictionary] = None) -> bytes:
+    """Pack several messages into batch frames (peer must have agreed on batching)
 
+    Messages go into as few batch frames as the peer's max frame size
+    allows; one that fills a frame on its own is sent as a plain frame.
+    """
+    if len(messages) == 1:
+        return serialize(messages[0], fmt, names)
+    options = fmt if isinstance(fmt, WireOptions) else None
+    if options is not None:
+        # Entries are plain frames; each batch as a whole gets compressed below
+        entry = WireOptions(format=options.format, tracing=options.tracing,
+                            typed_payloads=options.typed_payloads,
+                            name_dictionary=options.name_dictionary,
+                            request_ids=options.request_ids)
+        entries = [serialize(msg, entry, names) for msg in messages]
+        limit = min(options.max_frame_size, FRAME_LENGTH_MASK)
+    else:
+        entries = [serialize(msg, fmt) for msg in messages]
+        limit = MAX_MESSAGE_SIZE
 
-def deserialize(data: bytes) -> Optional[Message]:
-    """Deserialize bytes to Message"""
+    out = []
+    group: List[bytes] = []
+    size = 0
+    for frame in entries + [None]:
+        if group and (frame is None or size + len(frame) > limit):
+            if len(group) == 1:
+                out.append(group[0])  # Already a plain uncompressed frame
+            else:
+                out.append(struct.pack('>I', (FRAME_FLAG_BATCH << 24) | size) + b"".join(group))
+            group, size = [], 0
+        if frame is not None:
+            group.append(frame)
+            size += len(frame)
+    socket_log("[SERIALIZE]", f"BATCH: {len(messages)} messages in {len(out)} frames")
+    return b"".join(_checksum_frame(_compress_frame(frame, options), options) for frame in out)
+
+
+def deserialize(data: bytes, fmt: WireFormat = WireFormat.JSON,
+                names: Optional[NameDictionary] = None) -> Optional[Message]:
+    """Deserialize bytes to Message (names: the connection's receiving-side NameDictionary)"""
     try:
+        if fmt == WireFormat.BINARY:
+            msg = _decode_binary(data, names)
+            socket_log("[DESERIALIZE]", f"{MessageType(msg.type).name}: {len(data)} bytes (binary)")
+            return msg
+
         json_str = data.decode('utf-8')
         payload = json.loads(json_str)
         msg = Message.from_dict(payload)
@@ -127,7 +774,7 @@ def deserialize(data: bytes) -> Optional[Message]:
         socket_log("[DESERIALIZE]", f"{MessageType(msg.type).name}: {len(data)} bytes")
         socket_log("[JSON]", f"{json_str}")
         return msg
-    except (json.JSONDecodeError, UnicodeDecodeError) as e:
+    except (json.JSONDecodeError, UnicodeDecodeError, ValueError) as e:
         socket_log("[DESERIALIZE-ERROR]", f"{e}")
         return None
 
@@ -146,45 +793,278 @@ def deserialize_from_dict(data: dict) -> Optional[Message]:
 
 
 class MessageBuffer:
-    """Buffer for handling TCP stream fragmentation"""
+    """Buffer for handling TCP stream fragmentation
+
+    With checksums configured, a frame is only reported complete once its
+    trailer checks out; after a bad one the buffer skips ahead to the first
+    frame that does (see the C++ MessageBuffer).
+    """
 
     def __init__(self):
-        self.buffer = b""
+        self.buffer = bytearray()
+        self.head = 0  # Read cursor: start of unconsumed data in buffer
+        self.pending = deque()  # Messages unpacked from a batch frame
+        self.format = WireFormat.JSON
+        self.max_message_size = MAX_MESSAGE_SIZE
+        self.names = NameDictionary()  # Sender names defined by the peer
+        self.checksums = False
+        self.verified = False  # Checksum of the frame at the front matched
+        self.resync_work = 0  # Bytes skipped or checksummed since sync was lost (0 = in sync)
+        self.resync_count = 0
+
+    def configure(self, options: WireOptions):
+        """Apply options agreed in the handshake to the receive side"""
+        self.format = options.format
+        self.max_message_size = options.max_frame_size
+        if self.checksums != options.checksums:
+            self.checksums = options.checksums
+            self.verified = False
+            self._resync()
 
     def append(self, data: bytes):
+        if self.head and self.head * 2 >= len(self.buffer):
+            # Compact lazily: the unread rest is never longer than what was consumed
+            del self.buffer[:self.head]
+            self.head = 0
         self.buffer += data
-        socket_log("[BUFFER]", f"Appended {len(data)} bytes, total: {len(self.buffer)} bytes")
+        self._resync()
+
+    def _size(self) -> int:
+        return len(self.buffer) - self.head
+
+    def _trailer_size(self) -> int:
+        return CHECKSUM_SIZE if self.checksums else 0
+
+    def _consume(self, size: int):
+        self.head += size
+        if self.head == len(self.buffer):
+            self.buffer.clear()
+            self.head = 0
+        self.verified = False
+        self._resync()
+
+    def _resync(self):
+        """With checksums, drop data until the front frame checks out or is still incomplete"""
+        if not self.checksums or self.verified:
+            return
+        buf = self.buffer
+        budget = _RESYNC_BUDGET_FRAMES * (self.max_message_size + 8)
+        start = self.head  # No frame can start before this
+        conclusive = True
+        pos = self.head
+        while pos + 4 + CHECKSUM_SIZE <= len(buf):
+            value = struct.unpack_from('>I', buf, pos)[0]
+            length = value & FRAME_LENGTH_MASK
+            checked = 0
+            if length <= self.max_message_size and not (value >> 24) & ~_KNOWN_FRAME_FLAGS:
+                end = pos + 4 + length
+                if end + CHECKSUM_SIZE > len(buf):
+                    if not self.resync_work:
+                        return  # In sync: judge it once the trailer is in
+                    conclusive = False
+                elif crc32c(bytes(buf[pos:end])) == struct.unpack_from('>I', buf, end)[0]:
+                    self.head = pos
+                    self.verified = True
+                    self.resync_work = 0
+                    return
+                else:
+                    checked = end - pos
+            if not self.resync_work:
+                self.resync_count += 1
+                socket_log("[BUFFER-ERROR]", "Frame checksum mismatch, resynchronizing")
+            self.resync_work += checked + 1
+            if conclusive:
+                start = pos + 1
+            if self.resync_work > budget:
+                start = len(buf)  # Out of budget: drop what is buffered and start over on new data
+                self.resync_work = 1
+                break
+            pos += 1
+        self.head = start
+        if self.head == len(buf):
+            buf.clear()
+            self.head = 0
+
+    def _read_header(self):
+        value = struct.unpack_from('>I', self.buffer, self.head)[0]
+        return value >> 24, value & FRAME_LENGTH_MASK
 
     def has_complete_message(self) -> bool:
-        if len(self.buffer) < 4:
+        if self.pending:
+            return True
+        if self._size() < 4:
             return False
-        length = struct.unpack('>I', self.buffer[:4])[0]
-        return len(self.buffer) >= 4 + length
+        _, length = self._read_header()
+        if self.checksums:
+            return self.verified
+        return self._size() >= 4 + length
 
     def extract_message(self) -> Optional[Message]:
+        if self.pending:
+            return self.pending.popleft()
         if not self.has_complete_message():
             return None
 
-        length = struct.unpack('>I', self.buffer[:4])[0]
-        payload = self.buffer[4:4+length]
-        self.buffer = self.buffer[4+length:]
-        
-        socket_log("[BUFFER]", f"Extracted {4+length} bytes, remaining: {len(self.buffer)} bytes")
-        return deserialize(payload)
+        flags, length = self._read_header()
+        start = self.head + 4
+        payload = bytes(self.buffer[start:start + length])
+        self._consume(4 + length + self._trailer_size())
+
+        socket_log("[BUFFER]", f"Extracted {4+length} bytes, remaining: {self._size()} bytes")
+        if flags == FRAME_FLAG_ROUTED:
+            return self._decode_routed(payload)
+        if flags & FRAME_FLAG_COMPRESSED and not flags & FRAME_FLAG_CHUNK:
+            try:
+                payload = _inflate_payload(payload, self.max_message_size)
+            except (ValueError, zlib.error) as e:
+                socket_log("[BUFFER-ERROR]", f"{e}")
+                return None
+            flags &= ~FRAME_FLAG_COMPRESSED
+        if flags == FRAME_FLAG_BATCH:
+            self._unpack_batch(payload)
+            return self.pending.popleft() if self.pending else None
+        if flags:
+            socket_log("[BUFFER-ERROR]", f"Unsupported frame flags: 0x{flags:02x}")
+            return None
+        return deserialize(payload, self.format, self.names)
+
+    def _decode_routed(self, payload: bytes) -> Optional[Message]:
+        try:
+            route, pos = _decode_route_header(payload, 0, len(payload))
+        except (UnicodeDecodeError, ValueError) as e:
+            socket_log("[BUFFER-ERROR]", f"{e}")
+            return None
+        msg = deserialize(payload[pos:], self.format)
+        if msg:
+            route.apply_to(msg)
+        return msg
+
+    def peek_route(self) -> Optional[RouteHeader]:
+        """Route header of the next frame if it is complete and routed; the body is not decoded"""
+        if self.pending or not self.has_complete_message():
+            return None
+        flags, length = self._read_header()
+        if flags != FRAME_FLAG_ROUTED:
+            return None
+        try:
+            return _decode_route_header(self.buffer, self.head + 4, self.head + 4 + length)[0]
+        except (UnicodeDecodeError, ValueError):
+            return None
+
+    def peek_routed_content(self, route: RouteHeader) -> Optional[Tuple[bytes, int]]:
+        """Content and request id of the routed frame peek_route() returned, leaving it in place
+
+        Only the content field is located; the rest of the body is not
+        decoded. Returns None for JSON bodies or if the body is malformed.
+        """
+        if self.format != WireFormat.BINARY:
+            return None
+        start = self.head + 4
+        located = _locate_binary_content(self.buffer, start + route.header_length, start + route.frame_length)
+        if located is None:
+            return None
+        content_start, content_end, request_id = located
+        return bytes(self.buffer[content_start:content_end]), request_id
+
+    def take_frame(self) -> Optional[bytes]:
+        """Remove the next complete frame and return it exactly as received (for relaying)"""
+        if self.pending or not self.has_complete_message():
+            return None
+        _, length = self._read_header()
+        frame = bytes(self.buffer[self.head:self.head + 4 + length + self._trailer_size()])
+        self._consume(len(frame))
+        return frame
+
+    def _unpack_batch(self, payload: bytes):
+        pos = 0
+        while pos < len(payload):
+            if pos + 4 > len(payload):
+                socket_log("[BUFFER-ERROR]", "Malformed batch frame")
+                break
+            value = struct.unpack_from('>I', payload, pos)[0]
+            length = value & FRAME_LENGTH_MASK
+            if value >> 24 or pos + 4 + length > len(payload):
+                socket_log("[BUFFER-ERROR]", "Malformed batch frame")
+                break
+            msg = deserialize(payload[pos+4:pos+4+length], self.format, self.names)
+            if msg:
+                self.pending.append(msg)
+            pos += 4 + length
+        socket_log("[BUFFER]", f"Unpacked batch of {len(self.pending)} messages")
 
     def clear(self):
-        self.buffer = b""
+        self.buffer = bytearray()
+        self.head = 0
+        self.pending.clear()
+        self.names.clear()
+        self.verified = False
+        self.resync_work = 0
+
+
+# Capability negotiation (see Protocol.h for the handshake rules)
+def create_hello_message(offered: Optional[WireOptions] = None) -> Message:
+    offered = offered or WireOptions.supported()
+    return Message(type=MessageType.HELLO, extra=offered.to_json(offer=True))
+
+
+def create_hello_ack_message(agreed: WireOptions) -> Message:
+    return Message(type=MessageType.HELLO_ACK, extra=agreed.to_json(offer=False))
+
+
+def parse_wire_options(msg: Message) -> Optional[WireOptions]:
+    """Read wire features from HELLO/HELLO_ACK, None if malformed"""
+    if msg.type not in (MessageType.HELLO, MessageType.HELLO_ACK):
+        return None
+    try:
+        data = json.loads(msg.extra)
+        if not isinstance(data, dict):
+            return None
+        codecs = data.get("codecs", [])
+        return WireOptions(
+            version=int(data.get("version", 1)),
+            format=WireFormat.BINARY if "binary" in codecs else WireFormat.JSON,
+            compression=bool(data.get("compression", False)),
+            compression_threshold=int(data.get("compressionThreshold", 0)),
+            batching=bool(data.get("batching", False)),
+            streaming=bool(data.get("streaming", False)),
+            max_frame_size=min(int(data.get("maxFrameSize", MAX_MESSAGE_SIZE)), 0xFFFFFF),
+            tracing=bool(data.get("tracing", False)),
+            typed_payloads=bool(data.get("typedPayloads", False)),
+            routing=bool(data.get("routing", False)),
+            name_dictionary=bool(data.get("nameDictionary", False)),
+            request_ids=bool(data.get("requestIds", False)),
+            checksums=bool(data.get("checksums", False))
+        )
+    except (json.JSONDecodeError, TypeError, ValueError):
+        return None
+
+
+def negotiate(local: WireOptions, remote: WireOptions) -> WireOptions:
+    """Agree on features supported by both peers"""
+    return WireOptions(
+        version=min(local.version, remote.version),
+        format=min(local.format, remote.format),
+        compression=local.compression and remote.compression,
+        compression_threshold=max(local.compression_threshold, remote.compression_threshold),
+        batching=local.batching and remote.batching,
+        streaming=local.streaming and remote.streaming,
+        max_frame_size=min(local.max_frame_size, remote.max_frame_size),
+        tracing=local.tracing and remote.tracing,
+        typed_payloads=local.typed_payloads and remote.typed_payloads,
+        routing=local.routing and remote.routing,
+        name_dictionary=local.name_dictionary and remote.name_dictionary,
+        request_ids=local.request_ids and remote.request_ids,
+        checksums=local.checksums and remote.checksums
+    )
 
 
 # Helper functions to create common messages
 def create_login_message(username: str, password: str) -> Message:
-    content = json.dumps({"username": username, "password": password})
-    return Message(type=MessageType.LOGIN, content=content)
+    return Message(type=MessageType.LOGIN, fields=[username, password])
 
 
 def create_register_message(username: str, password: str) -> Message:
-    content = json.dumps({"username": username, "password": password})
-    return Message(type=MessageType.REGISTER, content=content)
+    return Message(type=MessageType.REGISTER, fields=[username, password])
 
 
 def create_logout_message() -> Message:
@@ -215,5 +1095,81 @@ def create_ping_message() -> Message:
 
 
 def create_change_password_message(old_password: str, new_password: str) -> Message:
-    content = json.dumps({"oldPassword": old_password, "newPassword": new_password})
-    return Message(type=MessageType.CHANGE_PASSWORD, content=content)
+    return Message(type=MessageType.CHANGE_PASSWORD, fields=[old_password, new_password])
+
+
+def create_online_list_message(users: List[str]) -> Message:
+    return Message(type=MessageType.ONLINE_LIST, fields=list(users))
+
+
+def create_user_status_message(username: str, status: str) -> Message:
+    """status is 'online' or 'offline'"""
+    return Message(type=MessageType.USER_STATUS, sender=username, fields=[status])
+
+
+def create_admin_command(msg_type: MessageType, target: str) -> Message:
+    """KICK_USER, BAN_USER, MUTE_USER, ...; the target travels in receiver"""
+    return Message(type=msg_type, receiver=target)
+
+
+# Typed payload readers: prefer the fields, fall back to the legacy
+# JSON-in-string form sent by peers without typed payloads
+def _parse_field_pair(msg: Message, first_key: str, second_key: str) -> Optional[Tuple[str, str]]:
+    if len(msg.fields) >= 2:
+        return msg.fields[0], msg.fields[1]
+    try:
+        data = json.loads(msg.content)
+    except (json.JSONDecodeError, TypeError):
+        return None
+    if not isinstance(data, dict):
+        return None
+    first, second = data.get(first_key), data.get(second_key)
+    if not isinstance(first, str) or not isinstance(second, str):
+        return None
+    return first, second
+
+
+def parse_credentials(msg: Message) -> Optional[Tuple[str, str]]:
+    """(username, password) from LOGIN / REGISTER, None if malformed"""
+    if msg.type not in (MessageType.LOGIN, MessageType.REGISTER):
+        return None
+    return _parse_field_pair(msg, "username", "password")
+
+
+def parse_password_change(msg: Message) -> Optional[Tuple[str, str]]:
+    """(old_password, new_password) from CHANGE_PASSWORD, None if malformed"""
+    if msg.type != MessageType.CHANGE_PASSWORD:
+        return None
+    return _parse_field_pair(msg, "oldPassword", "newPassword")
+
+
+def parse_online_list(msg: Message) -> Optional[List[str]]:
+    """User names from ONLINE_LIST, None if malformed"""
+    if msg.type != MessageType.ONLINE_LIST:
+        return None
+    if msg.fields or not msg.extra:
+        return list(msg.fields)
+    try:
+        users = json.loads(msg.extra)
+    except (json.JSONDecodeError, TypeError):
+        return None
+    if not isinstance(users, list) or not all(isinstance(u, str) for u in users):
+        return None
+    return users
+
+
+def parse_user_status(msg: Message) -> Optional[str]:
+    """'online' / 'offline' from USER_STATUS, None if malformed"""
+    if msg.type != MessageType.USER_STATUS:
+        return None
+    if msg.fields:
+        status = msg.fields[0]
+    elif msg.content:
+        status = msg.content
+    else:
+        try:
+            data = json.loads(msg.extra)
+        except (json.JSONDecodeError, TypeError):
+            return None
+        status = data.get("status") if isinstance(data, dict) else None
+    return status if status in ("online", "offline") else None
@@ -1,39 +1,118 @@
 """
 socket_wrapper.py - Python ctypes wrapper for C++ socket DLL
 
-This module loads socket_client.dll and provides a Pythonic interface
-to the C++ Winsock socket operations.
+This module loads socket_client.dll (Windows, built by build.bat) or
+socket_client.so / .dylib (built by the CMake target socket_client) and
+provides a Pythonic interface to the C++ socket operations.
 """
 
+import atexit
 import ctypes
+import itertools
 import os
 import json
-from typing import Optional, Dict, Any
+import sys
+import weakref
+from typing import Optional, Dict, Any, List, Callable
+
+if sys.platform == "win32":
+    LIBRARY_NAME = "socket_client.dll"
+elif sys.platform == "darwin":
+    LIBRARY_NAME = "socket_client.dylib"
+else:
+    LIBRARY_NAME = "socket_client.so"
+
+
+def _library_candidates() -> List[str]:
+    """Places the native library is looked for: next to this script, then cpp_socket/"""
+    script_dir = os.path.dirname(os.path.abspath(__file__))
+    return [os.path.join(script_dir, LIBRARY_NAME),
+            os.path.join(script_dir, "cpp_socket", LIBRARY_NAME)]
+
+
+def find_library() -> Optional[str]:
+    """Path of the built native library, None if it has not been built"""
+    for path in _library_candidates():
+        if os.path.exists(path):
+            return path
+    return None
+
+
+# The library is loaded and its signatures set up once per process; every
+# SocketClient then opens its own connection handle on it
+_library: Optional[ctypes.CDLL] = None
+
+# Receive result when the next message does not fit: it is kept for a retry
+BUFFER_TOO_SMALL = -2
+
+# Initial recv_messages() buffer, doubled whenever one message does not fit
+BATCH_BUFFER_SIZE = 256 * 1024
+BATCH_MAX_COUNT = 256
+
+# void (*sc_message_callback)(void* user_data, const char* json_data, int length)
+MESSAGE_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int)
+
+# Receive callbacks by the id handed to the library as user_data
+_receivers: Dict[int, Callable[[Dict[str, Any]], None]] = {}
+_receiver_ids = itertools.count(1)
+_receiving_clients: "weakref.WeakSet[SocketClient]" = weakref.WeakSet()
+
+
+def _dispatch_message(user_data, json_data, length):
+    """Runs on a library receive thread for every message (or disconnect)"""
+    callback = _receivers.get(user_data)
+    if callback is None:
+        return
+    if length < 0:
+        message = {"error": True}  # Error/disconnect marker, as recv_message()
+    else:
+        try:
+            message = json.loads(ctypes.string_at(json_data, length).decode('utf-8'))
+        except (json.JSONDecodeError, UnicodeDecodeError) as e:
+            print(f"Error decoding message: {e}")
+            return
+    try:
+        callback(message)
+    except Exception as e:
+        print(f"Error in receive callback: {e}")
+
+
+# Registered once for every receiver: the ctypes thunk has to outlive all
+# receive threads, which may still be returning from it
+_dispatch_message_c = MESSAGE_CALLBACK(_dispatch_message)
+
+
+@atexit.register
+def _stop_receivers():
+    """Receive threads must not call into Python while it shuts down"""
+    for client in list(_receiving_clients):
+        client.stop_receiver()
 
 class SocketClient:
-    """Wrapper class for C++ socket DLL"""
+    """Wrapper class for C++ socket DLL (one connection handle per instance)"""
 
     def __init__(self):
         self._dll = None
+        self._handle = None
+        self._receiver_id = None
+        self.legacy_wire = False
+        self._batch = None  # recv_messages() buffers, allocated on first use
+        self._open_error = b""
         self._initialized = False
         self._load_dll()
 
     def _load_dll(self):
         """Load the C++ socket DLL"""
-        # Try to find DLL in same directory as this script
-        script_dir = os.path.dirname(os.path.abspath(__file__))
-        dll_path = os.path.join(script_dir, "socket_client.dll")
-
-        # Also check cpp_socket subdirectory
-        if not os.path.exists(dll_path):
-            dll_path = os.path.join(script_dir, "cpp_socket", "socket_client.dll")
+        global _library
+        if _library is not None:
+            self._dll = _library
+            return
 
-        if not os.path.exists(dll_path):
+        dll_path = find_library()
+        if dll_path is None:
             raise FileNotFoundError(
-                f"socket_client.dll not found. Please build it first.\n"
-                f"Looked in:\n"
-                f"  - {os.path.join(script_dir, 'socket_client.dll')}\n"
-                f"  - {os.path.join(script_dir, 'cpp_socket', 'socket_client.dll')}"
+                f"{LIBRARY_NAME} not found. Please build it first.\n"
+                f"Looked in:\n" + "\n".join(f"  - {path}" for path in _library_candidates())
             )
 
         try:
@@ -43,6 +122,7 @@ class SocketClient:
 
         # Setup function signatures
         self._setup_functions()
+        _library = self._dll
 
     def _setup_functions(self):
         """Setup ctypes function signatures for type safety"""
@@ -83,6 +163,37 @@ class SocketClient:
         self._dll.socket_recv_message.argtypes = [ctypes.c_char_p, ctypes.c_int]
         self._dll.socket_recv_message.restype = ctypes.c_int
 
+        # int socket_recv_messages(char* buffer, int capacity, int* offsets, int* lengths, int max_count)
+        int_array = ctypes.POINTER(ctypes.c_int)
+        self._dll.socket_recv_messages.argtypes = [ctypes.c_char_p, ctypes.c_int, int_array, int_array, ctypes.c_int]
+        self._dll.socket_recv_messages.restype = ctypes.c_int
+
+        # int socket_wait_message(int timeout_ms)
+        self._dll.socket_wait_message.argtypes = [ctypes.c_int]
+        self._dll.socket_wait_message.restype = ctypes.c_int
+
+        # int socket_start_receiver(sc_message_callback callback, void* user_data)
+        self._dll.socket_start_receiver.argtypes = [MESSAGE_CALLBACK, ctypes.c_void_p]
+        self._dll.socket_start_receiver.restype = ctypes.c_int
+
+        # void socket_stop_receiver(void)
+        self._dll.socket_stop_receiver.argtypes = []
+        self._dll.socket_stop_receiver.restype = None
+
+        # int socket_negotiate(int timeout_ms)
+        self._dll.socket_negotiate.argtypes = [ctypes.c_int]
+        self._dll.socket_negotiate.restype = ctypes.c_int
+
+        # Delivery latency histogram of traced messages
+        self._dll.socket_latency_count.argtypes = []
+        self._dll.socket_latency_count.restype = ctypes.c_ulonglong
+        self._dll.socket_latency_percentile.argtypes = [ctypes.c_double]
+        self._dll.socket_latency_percentile.restype = ctypes.c_ulonglong
+        self._dll.socket_latency_histogram.argtypes = [ctypes.POINTER(ctypes.c_ulonglong), ctypes.c_int]
+        self._dll.socket_latency_histogram.restype = ctypes.c_int
+        self._dll.socket_latency_reset.argtypes = []
+        self._dll.socket_latency_reset.restype = None
+
         # const char* socket_get_error(void)
         self._dll.socket_get_error.argtypes = []
         self._dll.socket_get_error.restype = ctypes.c_char_p
@@ -91,8 +202,49 @@ class SocketClient:
         self._dll.socket_set_nonblocking.argtypes = [ctypes.c_int]
         self._dll.socket_set_nonblocking.restype = ctypes.c_int
 
+        # Handle API: the same calls on an opaque sc_conn*
+        handle = ctypes.c_void_p
+        self._dll.sc_open.argtypes = [ctypes.c_char_p, ctypes.c_int]
+        self._dll.sc_open.restype = handle
+        self._dll.sc_close.argtypes = [handle]
+        self._dll.sc_close.restype = None
+        self._dll.sc_disconnect.argtypes = [handle]
+        self._dll.sc_disconnect.restype = None
+        self._dll.sc_is_connected.argtypes = [handle]
+        self._dll.sc_is_connected.restype = ctypes.c_int
+        self._dll.sc_send_raw.argtypes = [handle, ctypes.c_char_p, ctypes.c_int]
+        self._dll.sc_send_raw.restype = ctypes.c_int
+        self._dll.sc_recv_raw.argtypes = [handle, ctypes.c_char_p, ctypes.c_int]
+        self._dll.sc_recv_raw.restype = ctypes.c_int
+        self._dll.sc_send.argtypes = [handle, ctypes.c_char_p]
+        self._dll.sc_send.restype = ctypes.c_int
+        self._dll.sc_recv.argtypes = [handle, ctypes.c_char_p, ctypes.c_int]
+        self._dll.sc_recv.restype = ctypes.c_int
+        self._dll.sc_recv_messages.argtypes = [handle, ctypes.c_char_p, ctypes.c_int, int_array, int_array, ctypes.c_int]
+        self._dll.sc_recv_messages.restype = ctypes.c_int
+        self._dll.sc_wait_message.argtypes = [handle, ctypes.c_int]
+        self._dll.sc_wait_message.restype = ctypes.c_int
+        self._dll.sc_start_receiver.argtypes = [handle, MESSAGE_CALLBACK, ctypes.c_void_p]
+        self._dll.sc_start_receiver.restype = ctypes.c_int
+        self._dll.sc_stop_receiver.argtypes = [handle]
+        self._dll.sc_stop_receiver.restype = None
+        self._dll.sc_negotiate.argtypes = [handle, ctypes.c_int]
+        self._dll.sc_negotiate.restype = ctypes.c_int
+        self._dll.sc_latency_count.argtypes = [handle]
+        self._dll.sc_latency_count.restype = ctypes.c_ulonglong
+        self._dll.sc_latency_percentile.argtypes = [handle, ctypes.c_double]
+        self._dll.sc_latency_percentile.restype = ctypes.c_ulonglong
+        self._dll.sc_latency_histogram.argtypes = [handle, ctypes.POINTER(ctypes.c_ulonglong), ctypes.c_int]
+        self._dll.sc_latency_histogram.restype = ctypes.c_int
+        self._dll.sc_latency_reset.argtypes = [handle]
+        self._dll.sc_latency_reset.restype = None
+        self._dll.sc_get_error.argtypes = [handle]
+        self._dll.sc_get_error.restype = ctypes.c_char_p
+        self._dll.sc_set_nonblocking.argtypes = [handle, ctypes.c_int]
+        self._dll.sc_set_nonblocking.restype = ctypes.c_int
+
     def init(self) -> bool:
-        """Initialize Winsock library"""
+        """Initialize the socket library (Winsock on Windows; connect() does not need it)"""
         if self._initialized:
             return True
         result = self._dll.socket_init()
@@ -102,32 +254,79 @@ class SocketClient:
         return False
 
     def cleanup(self):
-        """Cleanup Winsock library"""
+        """Cleanup the socket library"""
         if self._initialized:
             self._dll.socket_cleanup()
             self._initialized = False
 
     def connect(self, host: str, port: int) -> bool:
         """Connect to server"""
-        if not self._initialized:
-            if not self.init():
+        self._open_error = b""
+        self.stop_receiver()
+        if self._handle is not None:
+            if self.is_connected():
+                self._open_error = b"Already connected. Disconnect first."
                 return False
+            self._close_handle()
 
         host_bytes = host.encode('utf-8')
-        result = self._dll.socket_connect(host_bytes, port)
-        return result == 0
+        self._handle = self._dll.sc_open(host_bytes, port)
+        if not self._handle:
+            self._handle = None
+            self._open_error = self._dll.sc_get_error(None)
+            return False
+        return True
 
     def disconnect(self):
-        """Disconnect from server"""
-        self._dll.socket_disconnect()
+        """Disconnect from server (wakes up a receive thread blocked in wait_message)"""
+        if self._handle is not None:
+            self._dll.sc_disconnect(self._handle)
+            self.stop_receiver()
+
+    def _close_handle(self):
+        """Free the connection handle; no other thread may still be using it"""
+        if self._handle is not None:
+            self._dll.sc_close(self._handle)
+            self._handle = None
+        self._forget_receiver()
+
+    def start_receiver(self, callback: Callable[[Dict[str, Any]], None]) -> bool:
+        """
+        Deliver messages from a library thread instead of polling recv_message()
+        callback(dict) runs on that thread once per message, and once with
+        {"error": True} if the connection drops. It may call disconnect().
+        """
+        if self._receiver_id is not None:
+            self._open_error = b"Receiver already running"
+            return False
+        receiver_id = next(_receiver_ids)
+        _receivers[receiver_id] = callback
+        if self._dll.sc_start_receiver(self._handle, _dispatch_message_c, receiver_id) != 0:
+            del _receivers[receiver_id]
+            return False
+        self._receiver_id = receiver_id
+        _receiving_clients.add(self)
+        return True
+
+    def stop_receiver(self):
+        """Stop the receive thread (returns at once when called from its callback)"""
+        if self._receiver_id is not None:
+            self._dll.sc_stop_receiver(self._handle)
+            self._forget_receiver()
+
+    def _forget_receiver(self):
+        if self._receiver_id is not None:
+            _receivers.pop(self._receiver_id, None)
+            self._receiver_id = None
+            _receiving_clients.discard(self)
 
     def is_connected(self) -> bool:
         """Check if connected to server"""
-        return self._dll.socket_is_connected() == 1
+        return self._dll.sc_is_connected(self._handle) == 1
 
     def send_raw(self, data: bytes) -> int:
         """Send raw bytes to server"""
-        return self._dll.socket_send_raw(data, len(data))
+        return self._dll.sc_send_raw(self._handle, data, len(data))
 
     def recv_raw(self, max_length: int = 4096) -> Optional[bytes]:
         """
@@ -135,7 +334,7 @@ class SocketClient:
         Returns None on error, empty bytes if no data, bytes otherwise
         """
         buffer = ctypes.create_string_buffer(max_length)
-        result = self._dll.socket_recv_raw(buffer, max_length)
+        result = self._dll.sc_recv_raw(self._handle, buffer, max_length)
 
         if result < 0:
             return None  # Error or disconnect
@@ -148,7 +347,7 @@ class SocketClient:
         """Send a JSON message with length prefix"""
         json_str = json.dumps(data, ensure_ascii=False)
         json_bytes = json_str.encode('utf-8')
-        result = self._dll.socket_send_message(json_bytes)
+        result = self._dll.sc_send(self._handle, json_bytes)
         return result == 0
 
     def recv_message(self, max_length: int = 65536) -> Optional[Dict[str, Any]]:
@@ -157,7 +356,12 @@ class SocketClient:
         Returns None if no complete message or error, dict otherwise
         """
         buffer = ctypes.create_string_buffer(max_length)
-        result = self._dll.socket_recv_message(buffer, max_length)
+        result = self._dll.sc_recv(self._handle, buffer, max_length)
+        while result == BUFFER_TOO_SMALL:
+            # The message was kept: take it with a larger buffer
+            max_length *= 2
+            buffer = ctypes.create_string_buffer(max_length)
+            result = self._dll.sc_recv(self._handle, buffer, max_length)
 
         if result <= 0:
             if result < 0:
@@ -171,22 +375,89 @@ class SocketClient:
             print(f"Error decoding message: {e}")
             return None
 
+    def recv_messages(self, max_count: int = BATCH_MAX_COUNT) -> List[Dict[str, Any]]:
+        """
+        Receive every complete JSON message in one call
+        Returns an empty list if none is complete, [{"error": True}] on error/disconnect
+        """
+        size = len(self._batch[0]) if self._batch is not None else BATCH_BUFFER_SIZE
+        while True:
+            if self._batch is None or len(self._batch[0]) < size or len(self._batch[1]) < max_count:
+                self._batch = (ctypes.create_string_buffer(size),
+                               (ctypes.c_int * max_count)(), (ctypes.c_int * max_count)())
+            buffer, offsets, lengths = self._batch
+            count = self._dll.sc_recv_messages(self._handle, buffer, size, offsets, lengths, max_count)
+            if count != BUFFER_TOO_SMALL:
+                break
+            size *= 2  # The first message was kept: retry with room for it
+        if count < 0:
+            return [{"error": True}]  # Error/disconnect marker
+
+        messages = []
+        # One copy of the filled part only (buffer.raw would copy all of it)
+        data = ctypes.string_at(buffer, offsets[count - 1] + lengths[count - 1]) if count else b""
+        for i in range(count):
+            start = offsets[i]
+            try:
+                messages.append(json.loads(data[start:start + lengths[i]].decode('utf-8')))
+            except (json.JSONDecodeError, UnicodeDecodeError) as e:
+                print(f"Error decoding message: {e}")
+        return messages
+
+    def wait_message(self, timeout_ms: int = -1) -> int:
+        """
+        Block until a complete message is buffered (the GIL is released while waiting)
+        Returns 1 if recv_message() has a message, 0 on timeout, -1 on error/disconnect
+        """
+        return self._dll.sc_wait_message(self._handle, timeout_ms)
+
+    def negotiate(self, timeout_ms: int = 3000) -> bool:
+        """
+        Agree on wire features with the server (call right after connect)
+        A server without HELLO support leaves the connection on legacy JSON
+        (legacy_wire is set); False only if the connection failed
+        """
+        result = self._dll.sc_negotiate(self._handle, timeout_ms)
+        self.legacy_wire = result == 1  # Server predates HELLO: plain JSON
+        return result >= 0
+
+    def latency_stats(self) -> Dict[str, int]:
+        """Delivery latency of traced messages in microseconds (count, p50, p90, p99)"""
+        return {
+            "count": self._dll.sc_latency_count(self._handle),
+            "p50": self._dll.sc_latency_percentile(self._handle, 50.0),
+            "p90": self._dll.sc_latency_percentile(self._handle, 90.0),
+            "p99": self._dll.sc_latency_percentile(self._handle, 99.0),
+        }
+
+    def latency_histogram(self) -> List[int]:
+        """Bucket counts: bucket 0 is 0 us, bucket i covers [2^(i-1), 2^i) us"""
+        buckets = (ctypes.c_ulonglong * 32)()
+        count = self._dll.sc_latency_histogram(self._handle, buckets, len(buckets))
+        return list(buckets[:max(count, 0)])
+
+    def latency_reset(self):
+        """Clear the latency histogram"""
+        self._dll.sc_latency_reset(self._handle)
+
     def get_error(self) -> str:
         """Get last error message"""
-        error = self._dll.socket_get_error()
+        error = self._open_error
+        if not error and self._handle is not None:
+            error = self._dll.sc_get_error(self._handle)
         if error:
             return error.decode('utf-8')
         return ""
 
     def set_nonblocking(self, non_blocking: bool = True) -> bool:
         """Set socket to non-blocking mode"""
-        result = self._dll.socket_set_nonblocking(1 if non_blocking else 0)
+        result = self._dll.sc_set_nonblocking(self._handle, 1 if non_blocking else 0)
         return result == 0
 
     def __del__(self):
         """Cleanup on destruction"""
         try:
-            self.disconnect()
+            self._close_handle()
             self.cleanup()
         except:
             pass
@@ -238,7 +509,7 @@ if __name__ == "__main__":
         print("DLL loaded successfully!")
 
         if client.init():
-            print("Winsock initialized!")
+            print("Socket library initialized!")
         else:
             print(f"Init failed: {client.get_error()}")
 